@@ -2,14 +2,52 @@
 #include <queue>
 #include <cstdlib>
 #include <random>
-
+#include <climits>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "common.h"
 
 #include "munkres.h"
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define USE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_SSSE3
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
 using namespace cv;
 using namespace std;
 
@@ -104,1322 +142,1697 @@ struct Group{
 	}
 };
 
+//disjoint sets of the elements 0..n-1, Clear only starts a new epoch so a pass pays only for the elements it adds,
+//an element that was not added since the last Clear is a set of its own
 struct UnionFind{
 	int n;
-	int *parent;
-	int *size;
-	int *sum;
+	vector<int> parent;
+	vector<int> size;
+	vector<int> sum;
+	//the epoch in which every element was added last
+	vector<unsigned> stamp;
+	unsigned epoch;
+	//the elements added since the last Clear in the order they were added
+	vector<int> added;
 	
-	UnionFind(int n=0):n(n){
-		parent=new int[n];
-		size=new int[n];
-		sum=new int[n];
-		Clear();
+	UnionFind(int n=0):n(n), parent(n), size(n, 0), sum(n, 0), stamp(n, 0){
+		epoch=1;
 	}
 	
-	~UnionFind(){
-		delete[] parent;
-		delete[] size;
+	bool Contains(int x) const{
+		return stamp[x]==epoch;
 	}
-	
+
 	void Add(int x, int value=0){
+		stamp[x]=epoch;
 		parent[x]=x;
 		size[x]=1;
 		sum[x]=value;
+		added.push_back(x);
 	}
 
+	//path halving, every visited element is linked to its grandparent
 	int Find(int x){
-		if (parent[x]!=x){
-			parent[x]=Find(parent[x]);
+		if (Contains(x)==false){
+			return x;
 		}
-		return parent[x];
+		while (parent[x]!=x){
+			parent[x]=parent[parent[x]];
+			x=parent[x];
+		}
+		return x;
 	}
 	
-	void Union(int x, int y, bool sizePriority=false){
+	//the smaller set is linked under the larger one, on equal sizes the set of y under the set of x
+	void Union(int x, int y){
 		int px=Find(x);
 		int py=Find(y);
 		if (px!=py){
-			if ((sizePriority && size[px]<size[py]) || px<py){
-				parent[px]=py;
-				size[py]+=size[px];
-				sum[py]+=sum[px];
-			} else{
-				parent[py]=px;
-				size[px]+=size[py];
-				sum[px]+=sum[py];
+			if (size[px]<size[py]){
+				swap(px, py);
 			}
+			parent[py]=px;
+			size[px]+=size[py];
+			sum[px]+=sum[py];
 		}
 	}
 
 	void Clear(){
-		for (int i=0;i<n;++i){
-			parent[i]=i;
-			size[i]=0;
-			sum[i]=0;
+		++epoch;
+		if (epoch==0){
+			fill(stamp.begin(), stamp.end(), 0);
+			epoch=1;
 		}
+		added.clear();
 	}
 };
 
-int** GetIntMatrix(int rows, int cols, bool setToZero=false){
-	
-	int **matrix=new int*[rows];
-	for (int i=0;i<rows;++i){
-		matrix[i]=new int[cols];
+//contiguous per-pixel buffer backed by a single Mat so that it can be handed to OpenCV without any conversion
+//the element type determines the width (uchar for flags, ushort for counts, int for labels)
+template<typename T>
+struct Plane{
+	int rows;
+	int cols;
+	Mat mat;
+
+	explicit Plane(int rows=0, int cols=0, bool setToZero=false):rows(0), cols(0){
+		if (rows>0 && cols>0){
+			Create(rows, cols, setToZero);
+		}
+	}
+
+	void Create(int rows, int cols, bool setToZero=false){
+		this->rows=rows;
+		this->cols=cols;
+		mat.create(rows, cols, DataType<T>::type);
 		if (setToZero==true){
-			for (int j=0;j<cols;++j){
-				matrix[i][j]=0;
-			}
+			SetToZero();
 		}
 	}
 
-	return matrix;
-}
+	void SetToZero(){
+		memset(mat.data, 0, (size_t)rows*cols*sizeof(T));
+	}
 
-void FreeIntMatrix(int **matrix, int rows){
-	
-	for (int i=0;i<rows;++i){
-		delete[] matrix[i];
+	bool Empty() const{
+		return mat.empty();
 	}
 
-	delete[] matrix;
+	T *Data(){
+		return (T *)(mat.data);
+	}
+
+	const T *Data() const{
+		return (const T *)(mat.data);
+	}
+
+	T *operator[](int i){
+		return ((T *)(mat.data))+i*cols;
+	}
+
+	const T *operator[](int i) const{
+		return ((const T *)(mat.data))+i*cols;
+	}
+
+	//the returned Mat shares the memory with the plane, i.e. no data is copied
+	Mat View() const{
+		return mat;
+	}
+
+	void CopyTo(Plane<T> &other) const{
+		other.rows=rows;
+		other.cols=cols;
+		mat.copyTo(other.mat);
+	}
+};
+
+enum SimdLevel{
+	SIMD_NONE=0,
+	SIMD_SSE41=1,
+	SIMD_AVX2=2
+};
+
+//detected only once, the kernels below use it to select their implementation
+int GetSimdLevel(){
+#ifdef USE_X86_SIMD
+	static int level=checkHardwareSupport(CV_CPU_AVX2)==true ? SIMD_AVX2 : (checkHardwareSupport(CV_CPU_SSE4_1)==true ? SIMD_SSE41 : SIMD_NONE);
+	return level;
+#else
+	return SIMD_NONE;
+#endif
 }
 
-bool IsForegroundPixel2(Vec3b point, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double greenThreshold=35){
-	double s=point[0]+point[1]+point[2];
-	if (s==0){
-		return false;
+//x must not be 0
+static inline int TrailingZeros64(uint64 x){
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	int count=0;
+	for (;(x&1)==0;x>>=1){
+		++count;
 	}
-	double r=point[2]/s;
-	double g=point[1]/s;
-	return ((redLower<=r && r<=redUpper && greenLower<=g && g<=greenUpper)==false || point[1]<=greenThreshold);
+	return count;
+#endif
 }
 
-void GetBackgroundMask(Mat img, int ***flagPtr, UnionFind &uf, double greenFactor=1.0, double redFactor=1.0, double greenFactor2=1.3, double previousSizeThreshold=2.0, bool yAligned=false){
+//the builtin falls back to a library call without the popcnt instruction, __popcnt64 of MSVC needs it, so the bits are summed in parallel there
+static inline int PopCount64(uint64 x){
+#if defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x=x-((x>>1)&0x5555555555555555ULL);
+	x=(x&0x3333333333333333ULL)+((x>>2)&0x3333333333333333ULL);
+	x=(x+(x>>4))&0x0F0F0F0F0F0F0F0FULL;
+	return (int)((x*0x0101010101010101ULL)>>56);
+#endif
+}
 
-	int rows=img.rows;
-	int cols=img.cols;
+//a 0/1 plane with one bit per pixel, every row starts at a new 64-bit word and the bits after the last column are 0
+struct BitPlane{
+	int rows;
+	int cols;
+	int wordsPerRow;
+	vector<uint64> words;
 
-	int **flag=*flagPtr;
-	uf.Clear();
-	
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			Vec3b &sourcePoint=*(((Vec3b *)(img.data))+i*cols+j);
-			//if (point[1]>point[2] && point[2]>point[0]){
-			if (sourcePoint[1]>greenFactor*sourcePoint[2] && sourcePoint[2]>redFactor*sourcePoint[0] && sourcePoint[1]>greenFactor2*sourcePoint[0]){
-				uf.Add(i*cols+j, i);
-				flag[i][j]=1;
-				if (i>0){
-					if (flag[i-1][j]==1){
-						uf.Union(i*cols+j, (i-1)*cols+j);
-					}
-				}
-				if (j>0){
-					if (flag[i][j-1]==1){
-						uf.Union(i*cols+j, i*cols+j-1);
-					}
-				}
-			} else{
-				flag[i][j]=0;
-			}
+	BitPlane():rows(0), cols(0), wordsPerRow(0){}
 
-		}
+	void Create(int rows, int cols){
+		this->rows=rows;
+		this->cols=cols;
+		wordsPerRow=(cols+63)/64;
+		words.assign((size_t)rows*wordsPerRow, 0);
 	}
-		
-	vector<Group> groups;
-	int msp=0;
-	set<int> distinctGroups;
-	for (int i=0;i<rows*cols;++i){
-		if (uf.size[msp]<uf.size[i]){
-			msp=i;
-		}
+
+	bool Empty() const{
+		return rows==0;
 	}
-	int sizeThreshold=uf.size[msp];
-	double meanY=uf.sum[msp]/(double)uf.size[msp];
-	for (int i=0;i<rows*cols;++i){
-		if (i==uf.parent[i] && sizeThreshold<uf.size[i]*previousSizeThreshold){
-			if (yAligned==false || fabs(uf.sum[i]/(double)uf.size[i]-meanY)<0.1*rows){
-				uf.Union(i, msp, true);
-			}
-		}
+
+	uint64 *operator[](int i){
+		return words.data()+(size_t)i*wordsPerRow;
 	}
-	
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (flag[i][j]==1 && uf.Find(i*cols+j)!=msp){
-				flag[i][j]=0;
-			}
-		}
+
+	const uint64 *operator[](int i) const{
+		return words.data()+(size_t)i*wordsPerRow;
 	}
 
-}
+	bool Get(int i, int j) const{
+		return (((*this)[i][j>>6]>>(j&63))&1)!=0;
+	}
 
-void GetBackgroundMask2(Mat img, int ***flagPtr, UnionFind &uf, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false){
+	//the number of set bits of the row i, the bits after the last column are 0
+	int CountRow(int i) const{
+		const uint64 *row=(*this)[i];
+		int count=0;
+		for (int w=0;w<wordsPerRow;++w){
+			count+=PopCount64(row[w]);
+		}
+		return count;
+	}
 
-	int rows=img.rows;
-	int cols=img.cols;
+	void Set(int i, int j){
+		(*this)[i][j>>6]|=(uint64)1<<(j&63);
+	}
 
-	int **flag=*flagPtr;
-	uf.Clear();
-	
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			Vec3b &sourcePoint=*(((Vec3b *)(img.data))+i*cols+j);
-			//if (point[1]>point[2] && point[2]>point[0]){
-			double s=sourcePoint[0]+sourcePoint[1]+sourcePoint[2];
-			if (s>0){
-				double r=sourcePoint[2]/s;
-				double g=sourcePoint[1]/s;
-				if (redLower<=r && r<=redUpper && greenLower<=g && g<=greenUpper){
-					uf.Add(i*cols+j, i);
-					flag[i][j]=1;
-					if (i>0){
-						if (flag[i-1][j]==1){
-							uf.Union(i*cols+j, (i-1)*cols+j);
-						}
-					}
-					if (j>0){
-						if (flag[i][j-1]==1){
-							uf.Union(i*cols+j, i*cols+j-1);
-						}
+	//packs a row of 0/1 bytes
+	void SetRow(int i, const uchar *values){
+		uint64 *row=(*this)[i];
+		int j=0;
+#ifdef USE_X86_SIMD
+		bool vector=GetSimdLevel()>=SIMD_SSE41;
+#endif
+		for (int w=0;w<wordsPerRow;++w){
+			uint64 word=0;
+			int k=0;
+#ifdef USE_X86_SIMD
+			if (vector==true){
+				k=PackBytesSse2(values+j, min(64, cols-j), word);
+			}
+#endif
+			for (;k<64 && j+k<cols;++k){
+				word|=(uint64)(values[j+k]!=0)<<k;
+			}
+			row[w]=word;
+			j+=64;
+		}
+	}
+
+#ifdef USE_X86_SIMD
+	//packs the bytes 16 at a time into word, returns the number of packed bytes, the rest is left for the scalar path
+	TARGET_SSE2 static int PackBytesSse2(const uchar *values, int n, uint64 &word){
+		const __m128i zero=_mm_setzero_si128();
+		int k=0;
+		for (;k+16<=n;k+=16){
+			__m128i v=_mm_loadu_si128((const __m128i *)(values+k));
+			uint64 mask=(~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)))&0xFFFF;
+			word|=mask<<k;
+		}
+		return k;
+	}
+#endif
+
+	//the bit (i, j) is moved to (i+dy, j+dx), the bits moved outside are lost and the uncovered ones are 0
+	void Translate(int dx, int dy){
+		vector<uint64> moved(words.size(), 0);
+		for (int i=max(0, -dy);i<rows && i+dy<rows;++i){
+			const uint64 *row=(*this)[i];
+			uint64 *target=moved.data()+(size_t)(i+dy)*wordsPerRow;
+			for (int w=0;w<wordsPerRow;++w){
+				for (uint64 bits=row[w];bits!=0;bits&=bits-1){
+					int j=w*64+TrailingZeros64(bits)+dx;
+					if (0<=j && j<cols){
+						target[j>>6]|=(uint64)1<<(j&63);
 					}
-				} else{
-					flag[i][j]=0;
 				}
-			} else{
-				flag[i][j]=0;
 			}
 		}
+		words.swap(moved);
 	}
-		
-	vector<Group> groups;
-	int msp=0;
-	set<int> distinctGroups;
-	for (int i=0;i<rows*cols;++i){
-		if (uf.size[msp]<uf.size[i]){
-			msp=i;
+};
+
+//writes the state of the tracker for the checkpoints as raw bytes, so they can only be read by the same build on the same platform,
+//failed is set by the first write that does not succeed and the following writes are skipped
+struct StateWriter{
+	FILE *file;
+	bool failed;
+
+	StateWriter(FILE *file):file(file), failed(false){}
+
+	void Write(const void *data, size_t size){
+		if (failed==false && size!=0 && fwrite(data, 1, size, file)!=size){
+			failed=true;
 		}
 	}
-	int sizeThreshold=uf.size[msp];
-	double meanY=uf.sum[msp]/(double)uf.size[msp];
-	for (int i=0;i<rows*cols;++i){
-		if (i==uf.parent[i] && sizeThreshold<uf.size[i]*previousSizeThreshold){
-			if (yAligned==false || fabs(uf.sum[i]/(double)uf.size[i]-meanY)<0.1*rows){
-				uf.Union(i, msp, true);
-			}
-		}
+
+	template<typename T>
+	void WriteValue(const T &value){
+		Write(&value, sizeof(T));
 	}
-	
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (flag[i][j]==1 && uf.Find(i*cols+j)!=msp){
-				flag[i][j]=0;
-			}
+
+	void WriteMat(const Mat &mat){
+		WriteValue(mat.rows);
+		WriteValue(mat.cols);
+		WriteValue(mat.type());
+		for (int i=0;i<mat.rows;++i){
+			Write(mat.ptr(i), mat.cols*mat.elemSize());
 		}
 	}
 
-}
+	template<typename T>
+	void WritePlane(const Plane<T> &plane){
+		WriteValue(plane.rows);
+		WriteValue(plane.cols);
+		Write(plane.Data(), (size_t)plane.rows*plane.cols*sizeof(T));
+	}
 
-void GetFilledBackgroundMask2(Mat img, int ***flagPtr, UnionFind &uf, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool combineWithPrevious=false){
+	void WriteBitPlane(const BitPlane &plane){
+		WriteValue(plane.rows);
+		WriteValue(plane.cols);
+		Write(plane.words.data(), plane.words.size()*sizeof(uint64));
+	}
 
-	int rows=img.rows;
-	int cols=img.cols;
-	int **previousFlag=NULL;
+	template<typename T>
+	void WriteVector(const vector<T> &values){
+		WriteValue((long long)values.size());
+		Write(values.data(), values.size()*sizeof(T));
+	}
 
-	if (combineWithPrevious==true){
-		previousFlag=GetIntMatrix(rows, cols, true);
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				previousFlag[i][j]=(*flagPtr)[i][j];
-			}
+	//an 8-bit image compressed as PNG, for the replay snapshots which are written often
+	void WriteCompressedMat(const Mat &mat){
+		vector<uchar> buffer;
+		if (mat.empty()==false && imencode(".png", mat, buffer)==false){
+			failed=true;
 		}
+		WriteVector(buffer);
 	}
+};
 
-	GetBackgroundMask2(img, flagPtr, uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
-	
-	int **flag=*flagPtr;
-	uf.Clear();
+//reads what StateWriter wrote, failed is set by the first read that does not succeed or finds sizes that can not be right
+struct StateReader{
+	FILE *file;
+	bool failed;
 
-	int border=rows*cols;
-	uf.Add(border);
+	StateReader(FILE *file):file(file), failed(false){}
 
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (flag[i][j]!=1){
-				uf.Add(i*cols+j);
-				if (i==0 || j==0 || i==rows-1 || j==cols-1){
-					uf.Union(i*cols+j, border);
-				} else{
-					if (i>0 && flag[i-1][j]!=1){
-						uf.Union(i*cols+j, (i-1)*cols+j);
-					}
-						
-					if(j>0 && flag[i][j-1]!=1){
-						uf.Union(i*cols+j, i*cols+j-1);
-					}
-				}
-					
-			}
+	void Read(void *data, size_t size){
+		if (failed==true){
+			memset(data, 0, size);
+		} else if (size!=0 && fread(data, 1, size, file)!=size){
+			memset(data, 0, size);
+			failed=true;
 		}
 	}
 
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (flag[i][j]==0 && uf.Find(i*cols+j)!=border || (combineWithPrevious==true && previousFlag[i][j]==1)){
-				flag[i][j]=1;
-			}
-		}
+	template<typename T>
+	void ReadValue(T &value){
+		Read(&value, sizeof(T));
 	}
 
-	if (combineWithPrevious==true){
-		FreeIntMatrix(previousFlag, img.rows);
+	template<typename T>
+	T ReadValue(){
+		T value;
+		Read(&value, sizeof(T));
+		return value;
 	}
 
-}
-
-void GetBackground(VideoCapture video, Mat &background, int skip=0, int step=30, int take=30, double greenFactor=1.0, double redFactor=1.0, double greenFactor2=1.3, double previousSizeThreshold=2.0, bool yAligned=false){
+	bool ReadSize(int &rows, int &cols){
+		ReadValue(rows);
+		ReadValue(cols);
+		if (rows<0 || cols<0 || (rows==0)!=(cols==0) || (long long)rows*cols>(1LL<<28)){
+			failed=true;
+		}
+		return failed==false;
+	}
 
-	while(skip>0){
-		Mat img;
-		video>>img;
-		if (img.empty()){
+	void ReadMat(Mat &mat){
+		int rows, cols;
+		ReadSize(rows, cols);
+		int type=ReadValue<int>();
+		if (failed==true){
 			return;
 		}
-		--skip;
+		if (rows==0){
+			mat.release();
+			return;
+		}
+		mat.create(rows, cols, type);
+		for (int i=0;i<rows;++i){
+			Read(mat.ptr(i), mat.cols*mat.elemSize());
+		}
 	}
 
-	int **flag=NULL;
-	int **count=NULL;
-	UnionFind *uf=NULL;
-	
-	int rows=0;
-	int cols=0;
-	background=Mat(0, 0, CV_64FC3);
-
-	int currentStep=1;
-	while(take>0){
-		Mat img;
-		video>>img;
-		if (img.empty()){
-			break;
+	template<typename T>
+	void ReadPlane(Plane<T> &plane){
+		int rows, cols;
+		if (ReadSize(rows, cols)==false){
+			return;
 		}
-		--currentStep;
-		if (currentStep!=0){
-			continue;
+		if (rows==0){
+			plane=Plane<T>();
+			return;
 		}
+		plane.Create(rows, cols);
+		Read(plane.Data(), (size_t)rows*cols*sizeof(T));
+	}
 
+	void ReadBitPlane(BitPlane &plane){
+		int rows, cols;
+		if (ReadSize(rows, cols)==false){
+			return;
+		}
 		if (rows==0){
-			rows=img.rows;
-			cols=img.cols;
-			background=Mat(rows, cols, CV_64FC3);
-			flag=GetIntMatrix(rows, cols);
-			count=GetIntMatrix(rows, cols);
-			for (int i=0;i<rows;++i){
-				for (int j=0;j<cols;++j){
-					count[i][j]=0;
-				}
-			}
-			uf=new UnionFind(rows*cols+1);
+			plane=BitPlane();
+			return;
 		}
+		plane.Create(rows, cols);
+		Read(plane.words.data(), plane.words.size()*sizeof(uint64));
+	}
 
-		currentStep=step;
-		--take;
-
-		GetBackgroundMask(img, &flag, *uf, greenFactor, redFactor, greenFactor2, previousSizeThreshold, yAligned);
-
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (flag[i][j]==1){
-					++count[i][j];
-					*(((Vec3d *)(background.data))+i*cols+j)+=*(((Vec3b *)(img.data))+i*cols+j);
-				}
-			}
+	template<typename T>
+	void ReadVector(vector<T> &values){
+		long long size=ReadValue<long long>();
+		if (size<0 || size>(1LL<<28)){
+			failed=true;
+		}
+		if (failed==true){
+			return;
 		}
+		values.resize(size);
+		Read(values.data(), values.size()*sizeof(T));
+	}
 
+	void ReadCompressedMat(Mat &mat){
+		vector<uchar> buffer;
+		ReadVector(buffer);
+		if (failed==true || buffer.empty()==true){
+			mat.release();
+			return;
+		}
+		mat=imdecode(buffer, -1);
+		if (mat.empty()==true){
+			failed=true;
+		}
 	}
 
-	if (rows!=0){
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (count[i][j]!=0){
-					*(((Vec3d *)(background.data))+i*cols+j)/=count[i][j];
-				}
-			}
+	template<typename T>
+	void ReadCompressedPlane(Plane<T> &plane){
+		Mat mat;
+		ReadCompressedMat(mat);
+		if (mat.empty()==true || mat.type()!=DataType<T>::type){
+			failed=failed==true || mat.empty()==false;
+			plane=Plane<T>();
+			return;
 		}
-		background.convertTo(background, CV_8U);
+		plane.rows=mat.rows;
+		plane.cols=mat.cols;
+		plane.mat=mat;
 	}
+};
 
-	delete uf;
+//work-stealing pool for the loops over rows: every worker owns a deque, takes its tasks from the back and steals from the front of the others
+//the thread calling ParallelFor works on the tiles as well until its loop is done, so it can be called from several threads at once
+struct ThreadPool{
+	struct Job{
+		const function<void(int, int)> *body;
+		atomic<int> remaining;
+	};
 
-}
+	struct Task{
+		Job *job;
+		int begin;
+		int end;
+	};
 
-void GetBackground2(VideoCapture video, Mat &background, int skip=0, int step=30, int take=30, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false){
+	struct Worker{
+		mutex lock;
+		deque<Task> tasks;
+	};
 
-	while(skip>0){
-		Mat img;
-		video>>img;
-		if (img.empty()){
-			return;
-		}
-		--skip;
+	int threadsCount;
+	vector<Worker*> workers;
+	vector<thread> threads;
+	mutex sleepLock;
+	condition_variable wake;
+	atomic<int> queued;
+	atomic<unsigned> nextWorker;
+	bool stopping;
+
+	//0 uses all cores, the calling thread counts as one of the threads
+	explicit ThreadPool(int threadsCount=0){
+		Start(threadsCount);
 	}
 
-	int **flag=NULL;
-	int **count=NULL;
-	UnionFind *uf=NULL;
-	
-	int rows=0;
-	int cols=0;
-	background=Mat(0, 0, CV_64FC3);
+	~ThreadPool(){
+		Stop();
+	}
 
-	int currentStep=1;
-	while(take>0){
-		Mat img;
-		video>>img;
-		if (img.empty()){
-			break;
+	void Start(int threadsCount){
+		if (threadsCount<=0){
+			threadsCount=thread::hardware_concurrency();
 		}
-		--currentStep;
-		if (currentStep!=0){
-			continue;
+		if (threadsCount<=0){
+			threadsCount=1;
 		}
-
-		if (rows==0){
-			rows=img.rows;
-			cols=img.cols;
-			background=Mat(rows, cols, CV_64FC3);
-			flag=GetIntMatrix(rows, cols);
-			count=GetIntMatrix(rows, cols);
-			for (int i=0;i<rows;++i){
-				for (int j=0;j<cols;++j){
-					count[i][j]=0;
-				}
-			}
-			uf=new UnionFind(rows*cols+1);
+		this->threadsCount=threadsCount;
+		queued=0;
+		nextWorker=0;
+		stopping=false;
+		for (int i=0;i<threadsCount-1;++i){
+			workers.push_back(new Worker());
+		}
+		for (int i=0;i<threadsCount-1;++i){
+			threads.push_back(thread(&ThreadPool::WorkerLoop, this, i));
 		}
+	}
 
-		currentStep=step;
-		--take;
+	void Stop(){
+		{
+			lock_guard<mutex> guard(sleepLock);
+			stopping=true;
+		}
+		wake.notify_all();
+		for (int i=0;i<threads.size();++i){
+			threads[i].join();
+		}
+		threads.clear();
+		for (int i=0;i<workers.size();++i){
+			delete workers[i];
+		}
+		workers.clear();
+	}
 
-		GetBackgroundMask2(img, &flag, *uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+	//must not be called while any loop is running
+	void SetThreadsCount(int threadsCount){
+		Stop();
+		Start(threadsCount);
+	}
 
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (flag[i][j]==1){
-					++count[i][j];
-					*(((Vec3d *)(background.data))+i*cols+j)+=*(((Vec3b *)(img.data))+i*cols+j);
-				}
+	bool Pop(int index, Task &task){
+		Worker &worker=*workers[index];
+		lock_guard<mutex> guard(worker.lock);
+		if (worker.tasks.empty()==true){
+			return false;
+		}
+		task=worker.tasks.back();
+		worker.tasks.pop_back();
+		--queued;
+		return true;
+	}
+
+	bool Steal(int first, Task &task){
+		int workersCount=workers.size();
+		for (int k=0;k<workersCount;++k){
+			Worker &worker=*workers[(first+k)%workersCount];
+			lock_guard<mutex> guard(worker.lock);
+			if (worker.tasks.empty()==false){
+				task=worker.tasks.front();
+				worker.tasks.pop_front();
+				--queued;
+				return true;
 			}
 		}
+		return false;
+	}
 
+	void Execute(const Task &task){
+		(*task.job->body)(task.begin, task.end);
+		task.job->remaining.fetch_sub(1, memory_order_acq_rel);
 	}
 
-	if (rows!=0){
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (count[i][j]!=0){
-					*(((Vec3d *)(background.data))+i*cols+j)/=count[i][j];
-				}
+	void WorkerLoop(int index){
+		Task task;
+		while (true){
+			if (Pop(index, task)==true || Steal(index+1, task)==true){
+				Execute(task);
+				continue;
+			}
+			unique_lock<mutex> guard(sleepLock);
+			wake.wait(guard, [this]{
+				return stopping==true || 0<queued.load();
+			});
+			if (stopping==true){
+				return;
 			}
 		}
-		background.convertTo(background, CV_8U);
 	}
 
-	delete uf;
+	//calls body(tileBegin, tileEnd) for tiles of at least grain rows covering [begin, end) and returns when all of them are done
+	void ParallelFor(int begin, int end, const function<void(int, int)> &body, int grain=8){
+		int n=end-begin;
+		if (n<=0){
+			return;
+		}
+		int tilesCount=min(threadsCount*4, (n+grain-1)/grain);
+		if (threadsCount==1 || tilesCount<=1){
+			body(begin, end);
+			return;
+		}
 
-}
+		Job job;
+		job.body=&body;
+		job.remaining=tilesCount;
 
-void inline MinMaxRowColWithCount(int &minRow, int &maxRow, int &minCol, int &maxCol, const int i, const int j){
-	if (minRow==-1 || i<minRow){
-		minRow=i;
-	}
-	
-	if (maxRow==-1 || maxRow<i){
-		maxRow=i;
-	}
+		//the tiles are dealt round robin, the first one is kept by the calling thread
+		int workersCount=workers.size();
+		int first=nextWorker.fetch_add(1)%workersCount;
+		for (int t=1;t<tilesCount;++t){
+			Task task;
+			task.job=&job;
+			task.begin=begin+(int)((long long)n*t/tilesCount);
+			task.end=begin+(int)((long long)n*(t+1)/tilesCount);
+			Worker &worker=*workers[(first+t)%workersCount];
+			lock_guard<mutex> guard(worker.lock);
+			worker.tasks.push_back(task);
+			++queued;
+		}
+		{
+			lock_guard<mutex> guard(sleepLock);
+		}
+		wake.notify_all();
 
-	if (minCol==-1 || j<minCol){
-		minCol=j;
-	}
+		body(begin, begin+n/tilesCount);
+		job.remaining.fetch_sub(1, memory_order_acq_rel);
 
-	if (maxCol==-1 || maxCol<j){
-		maxCol=j;
+		Task task;
+		while (job.remaining.load(memory_order_acquire)!=0){
+			if (Steal(first, task)==true){
+				Execute(task);
+			} else{
+				this_thread::yield();
+			}
+		}
 	}
+};
 
+ThreadPool &GetThreadPool(){
+	static ThreadPool pool;
+	return pool;
 }
 
-void inline MinMaxRowCol(int &minRow, int &maxRow, int &minCol, int &maxCol, const int i, const int j, const int count=1){
-	if (count!=0){
-		MinMaxRowColWithCount(minRow, maxRow, minCol, maxCol, i, j);
-	}
+//the rows of a tile are processed by one thread, so the loops whose rows are independent give the same result as without the pool
+void ParallelForRows(int begin, int end, const function<void(int, int)> &body, int grain=8){
+	GetThreadPool().ParallelFor(begin, end, body, grain);
 }
 
-struct BackgroundFetcher5{
-	Mat *images;
-	int ***flags;
-	int **count;
-	int **untouchedCount;
-	int n;
-	int size;
-	int minimumSize;
-	int start;
-	int newPosition;
-	int untouchedTTL;
-	Mat background;
+//the columns [begin, end) of one row
+struct Span{
+	int begin;
+	int end;
+	Span(int begin=0, int end=0):begin(begin), end(end){}
+};
+
+//a mask stored as the runs of its set pixels, the spans of row i are spans[rowStart[i]..rowStart[i+1]) ordered by their columns
+//an empty mask (no rows) stands for no mask at all, the same as an empty Plane
+struct SpanMask{
 	int rows;
-	UnionFind *uf;
-	double redLower;
-	double redUpper;
-	double greenLower;
-	double greenUpper;
-	double previousSizeThreshold;
-	bool yAligned;
-	int minRow;
-	int maxRow;
-	int minCol;
-	int maxCol;
-	
-	BackgroundFetcher5(int n, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=true, int minimumSize=3, int untouchedTTL=30):n(n), redLower(redLower), redUpper(redUpper), greenLower(greenLower), greenUpper(greenUpper), previousSizeThreshold(previousSizeThreshold), yAligned(yAligned), minimumSize(minimumSize), untouchedTTL(untouchedTTL){
-		images=new Mat[n];
-		uf=NULL;
-		size=0;
-		start=0;
-		newPosition=0;
-		background=Mat(0, 0, CV_64FC3);
-		int rows=0;
-		count=NULL;
-		untouchedCount=NULL;
-		flags=new int**[n];
-		for (int i=0;i<n;++i){
-			flags[i]=NULL;
+	int cols;
+	vector<Span> spans;
+	vector<int> rowStart;
+
+	SpanMask():rows(0), cols(0){}
+
+	explicit SpanMask(const Plane<uchar> &plane){
+		FromPlane(plane);
+	}
+
+	//every non-zero pixel of the plane is set
+	void FromPlane(const Plane<uchar> &plane){
+		rows=plane.rows;
+		cols=plane.cols;
+		spans.clear();
+		rowStart.assign(rows+1, 0);
+		for (int i=0;i<rows;++i){
+			rowStart[i]=spans.size();
+			const uchar *row=plane[i];
+			int j=0;
+			while (j<cols){
+				while (j<cols && row[j]==0){
+					++j;
+				}
+				if (j==cols){
+					break;
+				}
+				int begin=j;
+				while (j<cols && row[j]!=0){
+					++j;
+				}
+				spans.push_back(Span(begin, j));
+			}
 		}
-		minRow=-1;
-		maxRow=-1;
-		minCol=-1;
-		maxCol=-1;
+		rowStart[rows]=spans.size();
 	}
 
-	~BackgroundFetcher5(){
-		for (int i=0;i<n;++i){
-			if (flags[i]!=NULL){
-				FreeIntMatrix(flags[i], rows);
+	//the pixels of the component with the given label inside of its bounding box
+	void FromLabels(const Plane<int> &labels, int label, int minRow, int maxRow, int minCol, int maxCol){
+		rows=labels.rows;
+		cols=labels.cols;
+		spans.clear();
+		rowStart.assign(rows+1, 0);
+		for (int i=0;i<rows;++i){
+			rowStart[i]=spans.size();
+			if (i<minRow || maxRow<i){
+				continue;
+			}
+			const int *row=labels[i];
+			int j=minCol;
+			while (j<=maxCol){
+				while (j<=maxCol && row[j]!=label){
+					++j;
+				}
+				if (maxCol<j){
+					break;
+				}
+				int begin=j;
+				while (j<=maxCol && row[j]==label){
+					++j;
+				}
+				spans.push_back(Span(begin, j));
 			}
-			images[i].release();
 		}
-		if (count!=NULL){
-			FreeIntMatrix(count, rows);
-			FreeIntMatrix(untouchedCount, rows);
+		rowStart[rows]=spans.size();
+	}
+
+	//the pixels (j, i) inside of the polygon by the even-odd rule, filled row by row from an edge table, the polygon is closed by the edge
+	//from its last point to the first one; an edge covers the rows from its upper end up to but without its lower end, so a vertex is not counted twice
+	void FromPolygon(const vector<Point> &polygon, int rows, int cols){
+		struct Edge{
+			int minRow;
+			int maxRow;
+			int x;
+			int y;
+			int dx;
+			int dy;
+			bool operator <(const Edge &other) const{
+				return minRow<other.minRow;
+			}
+		};
+		//the column x+(i-y)*dx/dy where the row i crosses an edge is kept as the fraction numerator/dy, so the pixels on the edge are exact
+		struct Crossing{
+			long long numerator;
+			long long denominator;
+			bool operator <(const Crossing &other) const{
+				return numerator*other.denominator<other.numerator*denominator;
+			}
+			int Floor() const{
+				return numerator>=0 ? numerator/denominator : -((-numerator+denominator-1)/denominator);
+			}
+			int Ceil() const{
+				return -Crossing{-numerator, denominator}.Floor();
+			}
+		};
+
+		this->rows=rows;
+		this->cols=cols;
+		spans.clear();
+		rowStart.assign(rows+1, 0);
+
+		vector<Edge> edges;
+		int n=polygon.size();
+		for (int k=0;k<n;++k){
+			Point p=polygon[k];
+			Point q=polygon[(k+1)%n];
+			if (p.y==q.y){
+				continue;
+			}
+			if (q.y<p.y){
+				swap(p, q);
+			}
+			Edge edge;
+			edge.minRow=max(p.y, 0);
+			edge.maxRow=min(q.y, rows);
+			edge.x=p.x;
+			edge.y=p.y;
+			edge.dx=q.x-p.x;
+			edge.dy=q.y-p.y;
+			if (edge.minRow<edge.maxRow){
+				edges.push_back(edge);
+			}
 		}
-		delete[] images;
-		delete[] flags;
-		if (uf!=NULL){
-			delete uf;
+		sort(edges.begin(), edges.end());
+
+		vector<const Edge *> active;
+		vector<Crossing> xs;
+		size_t next=0;
+		for (int i=0;i<rows;++i){
+			rowStart[i]=spans.size();
+			while (next<edges.size() && edges[next].minRow<=i){
+				active.push_back(&edges[next]);
+				++next;
+			}
+			xs.clear();
+			for (size_t k=0;k<active.size();){
+				if (active[k]->maxRow<=i){
+					active[k]=active.back();
+					active.pop_back();
+				} else{
+					const Edge &edge=*active[k];
+					Crossing crossing={(long long)edge.x*edge.dy+(long long)(i-edge.y)*edge.dx, edge.dy};
+					xs.push_back(crossing);
+					++k;
+				}
+			}
+			sort(xs.begin(), xs.end());
+			for (size_t k=0;k+1<xs.size();k+=2){
+				int begin=max(0, xs[k].Ceil());
+				int end=min(cols, xs[k+1].Floor()+1);
+				if (end<=begin){
+					continue;
+				}
+				if ((int)spans.size()>rowStart[i] && begin<=spans.back().end){
+					spans.back().end=max(spans.back().end, end);
+				} else{
+					spans.push_back(Span(begin, end));
+				}
+			}
 		}
+		rowStart[rows]=spans.size();
 	}
-	
-	void Clear(){
-		if (size==0){
-			return;
-		}
-		Mat &img=images[start];
-		int rows=img.rows;
-		int cols=img.cols;
 
-		size=0;
-		start=0;
-		newPosition=0;
+	//the plane gets 1 inside of the mask and 0 elsewhere
+	void ToPlane(Plane<uchar> &plane) const{
+		if (plane.rows!=rows || plane.cols!=cols){
+			plane.Create(rows, cols);
+		}
+		plane.SetToZero();
 		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				count[i][j]=0;
-				untouchedCount[i][j]=0;
-				(*(((Vec3d *)(background.data))+i*cols+j))=Vec3d(0.0, 0.0, 0.0);
+			for (const Span *span=RowBegin(i);span!=RowEnd(i);++span){
+				memset(plane[i]+span->begin, 1, span->end-span->begin);
 			}
 		}
-		
 	}
 
-	void Remove(){
-		if (size==0){
-			return;
-		}
+	bool Empty() const{
+		return rows==0;
+	}
 
-		minRow=-1;
-		maxRow=-1;
-		minCol=-1;
-		maxCol=-1;
+	const Span *RowBegin(int i) const{
+		return spans.data()+rowStart[i];
+	}
 
-		Mat &img=images[start];
-		int rows=img.rows;
-		int cols=img.cols;
-		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (flags[start][i][j]==1){
-					bool remove=true;
-					if (count[i][j]<=minimumSize && untouchedTTL<untouchedCount[i][j]){
-						for (int fi=0;fi<size;++fi){
-							int frame=(newPosition+n-fi-1)%n;
-							if (frame==start){
-								break;
-							}
-							if (flags[frame][i][j]==0){
-								*(((Vec3b *)(images[frame].data))+i*cols+j)=*(((Vec3b *)(img.data))+i*cols+j);
-								flags[frame][i][j]==1;
-								remove=false;
-								break;
-							}
-						}
-					}
-					if (remove==true){
-						--count[i][j];
-						(*(((Vec3d *)(background.data))+i*cols+j))-=*(((Vec3b *)(img.data))+i*cols+j);
-					}
-				}
-				MinMaxRowCol(minRow, maxRow, minCol, maxCol, i, j, count[i][j]);
+	const Span *RowEnd(int i) const{
+		return spans.data()+rowStart[i+1];
+	}
+
+	bool Contains(int i, int j) const{
+		for (const Span *span=RowBegin(i);span!=RowEnd(i) && span->begin<=j;++span){
+			if (j<span->end){
+				return true;
 			}
 		}
-		img.release();
-		start=(start+1)%n;
-		--size;
+		return false;
 	}
 
-	void Add(Mat img){
-		if (size==n){
-			Remove();
+	int Area() const{
+		int area=0;
+		for (int k=0;k<spans.size();++k){
+			area+=spans[k].end-spans[k].begin;
 		}
-		
+		return area;
+	}
+
+	//returns false if the mask has no pixels
+	bool BoundingBox(int &minRow, int &maxRow, int &minCol, int &maxCol) const{
 		minRow=-1;
 		maxRow=-1;
 		minCol=-1;
 		maxCol=-1;
-
-		++size;
-		img.copyTo(images[newPosition]);
-		
-		rows=img.rows;
-		int cols=img.cols;
-		
-		if (uf==NULL){
-			uf=new UnionFind(rows*cols+1);
-		}
-		if (flags[newPosition]==NULL){
-			flags[newPosition]=GetIntMatrix(img.rows, img.cols);
-		}
-		if (background.rows==0){
-			background=Mat::zeros(img.rows, img.cols, CV_64FC3);
-			count=GetIntMatrix(img.rows, img.cols, true);
-			untouchedCount=GetIntMatrix(img.rows, img.cols, true);
+		for (int i=0;i<rows;++i){
+			if (rowStart[i]==rowStart[i+1]){
+				continue;
+			}
+			if (minRow==-1){
+				minRow=i;
+			}
+			maxRow=i;
+			if (minCol==-1 || RowBegin(i)->begin<minCol){
+				minCol=RowBegin(i)->begin;
+			}
+			if (maxCol<(RowEnd(i)-1)->end-1){
+				maxCol=(RowEnd(i)-1)->end-1;
+			}
 		}
-		
-		GetBackgroundMask2(images[newPosition], flags+newPosition, *uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+		return minRow!=-1;
+	}
+
+	//both masks must have the same size
+	SpanMask Intersect(const SpanMask &other) const{
+		SpanMask result;
+		result.rows=rows;
+		result.cols=cols;
+		result.rowStart.assign(rows+1, 0);
 		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (flags[newPosition][i][j]==1){
-					++count[i][j];
-					untouchedCount[i][j]=0;
-					(*(((Vec3d *)(background.data))+i*cols+j))+=*(((Vec3b *)(img.data))+i*cols+j);
+			result.rowStart[i]=result.spans.size();
+			const Span *a=RowBegin(i);
+			const Span *b=other.RowBegin(i);
+			while (a!=RowEnd(i) && b!=other.RowEnd(i)){
+				int begin=max(a->begin, b->begin);
+				int end=min(a->end, b->end);
+				if (begin<end){
+					result.spans.push_back(Span(begin, end));
+				}
+				if (a->end<b->end){
+					++a;
 				} else{
-					++untouchedCount[i][j];
+					++b;
 				}
-				MinMaxRowCol(minRow, maxRow, minCol, maxCol, i, j, count[i][j]);
 			}
 		}
-		newPosition=(newPosition+1)%n;
+		result.rowStart[rows]=result.spans.size();
+		return result;
 	}
-	
-	void GetBackground(Mat &result){
-		if (background.rows==0){
-			return;
-		}
-		int rows=background.rows;
-		int cols=background.cols;
-		result=Mat::zeros(rows, cols, CV_8UC3);
+
+	//the part of the mask inside of the rectangle
+	SpanMask Intersect(int minRow, int maxRow, int minCol, int maxCol) const{
+		SpanMask result;
+		result.rows=rows;
+		result.cols=cols;
+		result.rowStart.assign(rows+1, 0);
 		for (int i=0;i<rows;++i){
-			for (int j=0;j<cols;++j){
-				if (count[i][j]!=0){
-					*(((Vec3b *)(result.data))+i*cols+j)=(*(((Vec3d *)(background.data))+i*cols+j))/count[i][j];
+			result.rowStart[i]=result.spans.size();
+			if (i<minRow || maxRow<i){
+				continue;
+			}
+			for (const Span *span=RowBegin(i);span!=RowEnd(i);++span){
+				int begin=max(span->begin, minCol);
+				int end=min(span->end, maxCol+1);
+				if (begin<end){
+					result.spans.push_back(Span(begin, end));
 				}
 			}
 		}
+		result.rowStart[rows]=result.spans.size();
+		return result;
 	}
-
 };
 
-void GetBase(const char *path, char *base){
-	int l=strlen(path);
-	int start=0;
-	int end=-1;
-	for (int i=l-1;i>-1;--i){
-		if (end==-1 && path[i]=='.'){
-			end=i;
-		}
-		if (path[i]=='/' || path[i]=='\\'){
-			start=i+1;
-			break;
+void CreateMaskFromFlags(const Plane<uchar> &flag, Mat &mask){
+	
+	int rows=flag.rows;
+	int cols=flag.cols;
+
+	mask=Mat::zeros(rows, cols, CV_8UC1);
+
+	ParallelForRows(0, rows, [&](int begin, int end){
+		for (int i=begin;i<end;++i){
+			for (int j=0;j<cols;++j){
+				int bf=flag[i][j];
+				*(((uchar *)(mask.data))+i*cols+j)=255*bf;
+			}
 		}
-	}
+	});
+	
+}
 
-	for (int i=start;i<end;++i){
-		base[i-start]=path[i];
-	}
-	base[end-start]='\0';
+#ifdef USE_X86_SIMD
+//splits 16 interleaved BGR pixels into separate B, G and R vectors
+TARGET_SSSE3 static inline void LoadBgr16(const uchar *p, __m128i &b, __m128i &g, __m128i &r){
+	__m128i a0=_mm_loadu_si128((const __m128i *)(p));
+	__m128i a1=_mm_loadu_si128((const __m128i *)(p+16));
+	__m128i a2=_mm_loadu_si128((const __m128i *)(p+32));
 
+	b=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)), _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))), _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	g=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)), _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))), _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	r=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)), _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))), _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
 }
+#endif
 
-void GetBackgroundSmartly2(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/backgrounds/", bool write=false, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0){
+struct GrassTable;
+struct ChromaticityClassifier;
+shared_ptr<const GrassTable> FindGrassTable(const ChromaticityClassifier &classifier);
 
-	char base[1025];
-	GetBase(videoPath, base);
-	char path[1025];
-	sprintf(path, "%s/%s_%d_%d_%d.png", backgroundsPath, base, skip, step, take);
+//division-free form of the chromaticity test used in GetBackgroundMask2 and IsForegroundPixel2
+//for every bound the extreme fraction x/s (x<=255, s<=765) that still passes the double precision comparison
+//is stored as numerator/denominator, so x*denominator compared with numerator*s gives exactly the same decision as x/s compared with the bound
+struct ChromaticityClassifier{
+	//red lower, red upper, green lower, green upper
+	int numerator[4];
+	int denominator[4];
+	//the published lookup table of the same bounds if it was built already, the decisions are the same with or without it
+	shared_ptr<const GrassTable> table;
 
-	FILE *input=fopen(path, "rb");
-	
-	if (input==NULL){
-		VideoCapture video=VideoCapture(videoPath);
-		GetBackground2(video, background, skip, step, take, redLower, redUpper, greenLower, greenUpper);
-		video.release();
-		if (write==true){
-			imwrite(path, background);
-		}
-	} else{
-		fclose(input);
-		background=imread(path, 6);
+	ChromaticityClassifier(double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075){
+		Set(redLower, redUpper, greenLower, greenUpper);
 	}
 
-}
-
-void GetForegroundFlag(Mat img, Mat background, int **terrainMask, double threshold, int **flag, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
-
-	int rows=img.rows;
-	int cols=img.cols;
-
-	if (minRow==-1){
-		minRow=0;
-	}
-	if (maxRow==-1){
-		maxRow=rows-1;
-	}
-	if (minCol==-1){
-		minCol=0;
-	}
-	if (maxCol==-1){
-		maxCol=cols-1;
+	void Set(double redLower, double redUpper, double greenLower, double greenUpper){
+		SetLowerBound(0, redLower);
+		SetUpperBound(1, redUpper);
+		SetLowerBound(2, greenLower);
+		SetUpperBound(3, greenUpper);
+		table=FindGrassTable(*this);
 	}
 
-	for (int i=minRow;i<=maxRow;++i){
-		for (int j=minCol;j<=maxCol;++j){
-			flag[i][j]=0;
-			if (terrainMask[i][j]!=0){
-				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+i*cols+j);
-				if (backgroundPoint[0]!=0 || backgroundPoint[1]!=0 || backgroundPoint[2]){
-					const Vec3b point=*(((Vec3b *)(img.data))+i*cols+j);
-				
-					//TESTING
-					if (false){
-						double thresholdAngle=6;
-						Vec3d v1=point;
-						Vec3d v2=backgroundPoint;
-						double currentAngle=0;
-						double a=0;
-						double b=0;
-						for (int i=0;i<3;++i){
-							currentAngle+=v1[i]*v2[i];
-							a+=v1[i]*v1[i];
-							b+=v2[i]*v2[i];
-						}
-						currentAngle/=sqrt(a*b);
-						currentAngle=180*acos(currentAngle)/3.141592654;
-						//printf("%lf\n", currentAngle);
-						if (thresholdAngle<currentAngle){
-							flag[i][j]=1;
-						}
-						continue;
-					}
-				
-
-					double d=0.0;
-					for (int k=0;k<3;++k){
-						double dd=point[k]-backgroundPoint[k];
-						dd*=dd;
-						d+=dd;
-					}
-					if (threshold<d){
-						flag[i][j]=1;
-					}
-				}
+	bool SameBounds(const int *numerator, const int *denominator) const{
+		for (int k=0;k<4;++k){
+			if (this->numerator[k]!=numerator[k] || this->denominator[k]!=denominator[k]){
+				return false;
 			}
 		}
+		return true;
 	}
 
-}
-
-void GetForegroundFlag(Mat img, Mat background, int **terrainMask, double threshold, int **flag, int **suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
-
-	int rows=img.rows;
-	int cols=img.cols;
-
-	if (minRow==-1){
-		minRow=0;
-	}
-	if (maxRow==-1){
-		maxRow=rows-1;
+	void SetLowerBound(int idx, double bound){
+		//no fraction passes unless one is found
+		int bestX=1;
+		int bestS=0;
+		for (int s=1;s<=765;++s){
+			int maximumX=s<255 ? s : 255;
+			int x=(int)ceil(bound*s);
+			if (x<0){
+				x=0;
+			}
+			if (x>maximumX+1){
+				x=maximumX+1;
+			}
+			while (x>0 && x-1<=maximumX && bound<=(x-1)/(double)s){
+				--x;
+			}
+			while (x<=maximumX && (bound<=x/(double)s)==false){
+				++x;
+			}
+			if (x<=maximumX && (bestS==0 || x*bestS<bestX*s)){
+				bestX=x;
+				bestS=s;
+			}
+		}
+		numerator[idx]=bestX;
+		denominator[idx]=bestS;
 	}
-	if (minCol==-1){
-		minCol=0;
+
+	void SetUpperBound(int idx, double bound){
+		//no fraction passes unless one is found
+		int bestX=-1;
+		int bestS=1;
+		bool found=false;
+		for (int s=1;s<=765;++s){
+			int maximumX=s<255 ? s : 255;
+			int x=(int)floor(bound*s);
+			if (x<-1){
+				x=-1;
+			}
+			if (x>maximumX){
+				x=maximumX;
+			}
+			while (x<maximumX && x+1>=0 && (x+1)/(double)s<=bound){
+				++x;
+			}
+			while (x>=0 && (x/(double)s<=bound)==false){
+				--x;
+			}
+			if (x>=0 && (found==false || bestX*s<x*bestS)){
+				bestX=x;
+				bestS=s;
+				found=true;
+			}
+		}
+		numerator[idx]=bestX;
+		denominator[idx]=bestS;
 	}
-	if (maxCol==-1){
-		maxCol=cols-1;
+
+	bool CalculateIsGrass(const uchar *point) const{
+		int s=point[0]+point[1]+point[2];
+		if (s==0){
+			return false;
+		}
+		int r=point[2];
+		int g=point[1];
+		return numerator[0]*s<=r*denominator[0] && r*denominator[1]<=numerator[1]*s && numerator[2]*s<=g*denominator[2] && g*denominator[3]<=numerator[3]*s;
 	}
 
-	for (int i=minRow;i<=maxRow;++i){
-		for (int j=minCol;j<=maxCol;++j){
-			flag[i][j]=0;
-			if (terrainMask==NULL || terrainMask[i][j]!=0){
-				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+i*cols+j);
-				if (backgroundPoint[0]!=0 || backgroundPoint[1]!=0 || backgroundPoint[2]){
-					const Vec3b point=*(((Vec3b *)(img.data))+i*cols+j);
-				
-					//TESTING
-					if (false){
-						double thresholdAngle=6;
-						Vec3d v1=point;
-						Vec3d v2=backgroundPoint;
-						double currentAngle=0;
-						double a=0;
-						double b=0;
-						for (int i=0;i<3;++i){
-							currentAngle+=v1[i]*v2[i];
-							a+=v1[i]*v1[i];
-							b+=v2[i]*v2[i];
-						}
-						currentAngle/=sqrt(a*b);
-						currentAngle=180*acos(currentAngle)/3.141592654;
-						//printf("%lf\n", currentAngle);
-						if (thresholdAngle<currentAngle){
-							flag[i][j]=1;
-						}
-						continue;
-					}
-				
+	//one table lookup once the table is published, defined after GrassTable
+	bool IsGrass(const uchar *point) const;
 
-					double d=0.0;
-					for (int k=0;k<3;++k){
-						double dd=point[k]-backgroundPoint[k];
-						dd*=dd;
-						d+=dd;
-					}
-					if (threshold<d){
-						flag[i][j]=1;
-					} else{
-						suddenlyChanged[i][j]=0;
-					}
-				} else{
-					suddenlyChanged[i][j]=0;
-				}
+	//same decision as IsForegroundPixel2 with the bounds of this classifier
+	bool IsForeground(const uchar *point, double greenThreshold=35) const{
+		if (point[0]+point[1]+point[2]==0){
+			return false;
+		}
+		return IsGrass(point)==false || point[1]<=greenThreshold;
+	}
+
+	//writes 1 to mask[j] if the j-th pixel of the BGR row is grass, 0 otherwise,
+	//the vector paths compare 16 pixels at once which is 2.5 to 4 times faster than looking them up in the table one by one
+	//(2.0 ms with AVX2, 3.5 ms with SSE4.1 and 8.7 ms with the table for a 1080p frame on one core), the table is used for the rest
+	void ClassifyRow(const uchar *bgr, uchar *mask, int n) const{
+		int j=0;
+#ifdef USE_X86_SIMD
+		int level=GetSimdLevel();
+		if (level==SIMD_AVX2){
+			j=ClassifyRowAvx2(bgr, mask, n);
+		} else if (level==SIMD_SSE41){
+			j=ClassifyRowSse41(bgr, mask, n);
+		}
+#endif
+		for (;j<n;++j){
+			mask[j]=IsGrass(bgr+3*j);
+		}
+	}
+
+#ifdef USE_X86_SIMD
+	//both return the number of processed pixels, the rest is left for the scalar path
+	TARGET_SSE41 int ClassifyRowSse41(const uchar *bgr, uchar *mask, int n) const{
+		__m128i zero=_mm_setzero_si128();
+		__m128i one=_mm_set1_epi8(1);
+		__m128i nm[4];
+		__m128i dn[4];
+		for (int k=0;k<4;++k){
+			nm[k]=_mm_set1_epi32(numerator[k]);
+			dn[k]=_mm_set1_epi32(denominator[k]);
+		}
+
+		int j=0;
+		for (;j+16<=n;j+=16){
+			__m128i b8, g8, r8;
+			LoadBgr16(bgr+3*j, b8, g8, r8);
+			__m128i fail[4];
+			for (int k=0;k<4;++k){
+				__m128i b=_mm_cvtepu8_epi32(b8);
+				__m128i g=_mm_cvtepu8_epi32(g8);
+				__m128i r=_mm_cvtepu8_epi32(r8);
+				b8=_mm_srli_si128(b8, 4);
+				g8=_mm_srli_si128(g8, 4);
+				r8=_mm_srli_si128(r8, 4);
+				__m128i s=_mm_add_epi32(_mm_add_epi32(b, g), r);
+				__m128i f=_mm_cmpeq_epi32(s, zero);
+				f=_mm_or_si128(f, _mm_cmpgt_epi32(_mm_mullo_epi32(nm[0], s), _mm_mullo_epi32(r, dn[0])));
+				f=_mm_or_si128(f, _mm_cmpgt_epi32(_mm_mullo_epi32(r, dn[1]), _mm_mullo_epi32(nm[1], s)));
+				f=_mm_or_si128(f, _mm_cmpgt_epi32(_mm_mullo_epi32(nm[2], s), _mm_mullo_epi32(g, dn[2])));
+				f=_mm_or_si128(f, _mm_cmpgt_epi32(_mm_mullo_epi32(g, dn[3]), _mm_mullo_epi32(nm[3], s)));
+				fail[k]=f;
+			}
+			__m128i packed=_mm_packs_epi16(_mm_packs_epi32(fail[0], fail[1]), _mm_packs_epi32(fail[2], fail[3]));
+			_mm_storeu_si128((__m128i *)(mask+j), _mm_andnot_si128(packed, one));
+		}
+		return j;
+	}
+
+	TARGET_AVX2 int ClassifyRowAvx2(const uchar *bgr, uchar *mask, int n) const{
+		__m256i zero=_mm256_setzero_si256();
+		__m128i one=_mm_set1_epi8(1);
+		__m256i nm[4];
+		__m256i dn[4];
+		for (int k=0;k<4;++k){
+			nm[k]=_mm256_set1_epi32(numerator[k]);
+			dn[k]=_mm256_set1_epi32(denominator[k]);
+		}
+
+		int j=0;
+		for (;j+16<=n;j+=16){
+			__m128i b8, g8, r8;
+			LoadBgr16(bgr+3*j, b8, g8, r8);
+			__m256i fail[2];
+			for (int k=0;k<2;++k){
+				__m256i b=_mm256_cvtepu8_epi32(b8);
+				__m256i g=_mm256_cvtepu8_epi32(g8);
+				__m256i r=_mm256_cvtepu8_epi32(r8);
+				b8=_mm_srli_si128(b8, 8);
+				g8=_mm_srli_si128(g8, 8);
+				r8=_mm_srli_si128(r8, 8);
+				__m256i s=_mm256_add_epi32(_mm256_add_epi32(b, g), r);
+				__m256i f=_mm256_cmpeq_epi32(s, zero);
+				f=_mm256_or_si256(f, _mm256_cmpgt_epi32(_mm256_mullo_epi32(nm[0], s), _mm256_mullo_epi32(r, dn[0])));
+				f=_mm256_or_si256(f, _mm256_cmpgt_epi32(_mm256_mullo_epi32(r, dn[1]), _mm256_mullo_epi32(nm[1], s)));
+				f=_mm256_or_si256(f, _mm256_cmpgt_epi32(_mm256_mullo_epi32(nm[2], s), _mm256_mullo_epi32(g, dn[2])));
+				f=_mm256_or_si256(f, _mm256_cmpgt_epi32(_mm256_mullo_epi32(g, dn[3]), _mm256_mullo_epi32(nm[3], s)));
+				fail[k]=f;
 			}
+			//packs works within 128-bit lanes, the permutation restores the pixel order
+			__m256i packed16=_mm256_permute4x64_epi64(_mm256_packs_epi32(fail[0], fail[1]), 0xD8);
+			__m128i packed=_mm_packs_epi16(_mm256_castsi256_si128(packed16), _mm256_extracti128_si256(packed16, 1));
+			_mm_storeu_si128((__m128i *)(mask+j), _mm_andnot_si128(packed, one));
 		}
+		return j;
 	}
+#endif
+};
 
-}
-
-void GetForegroundFlag(Mat img, Mat background, int **terrainMask, double threshold, double greenThreshold, int **flag, int **suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
-	
-	int rows=img.rows;
-	int cols=img.cols;
+//squared BGR distance of a pixel to a reference pixel plus the penalty for pixels that are too dark in the green channel,
+//computed in integers; greenThreshold is expected to be integral as in all current configurations
+//with skipEmptyReference the distance is -1 wherever the reference is (0, 0, 0), i.e. where there is no background yet
+struct BackgroundDistance{
+	int greenThreshold;
+	int greenPenaltyBias;
+	bool skipEmptyReference;
 
-	if (minRow==-1){
-		minRow=0;
+	BackgroundDistance(double greenThreshold=0, int greenPenaltyBias=0, bool skipEmptyReference=true):greenPenaltyBias(greenPenaltyBias), skipEmptyReference(skipEmptyReference){
+		//point[1]<greenThreshold is the same as point[1]<ceil(greenThreshold) for integer values
+		double t=ceil(greenThreshold);
+		if (t<0){
+			t=0;
+		}
+		if (t>256){
+			t=256;
+		}
+		this->greenThreshold=(int)t;
 	}
-	if (maxRow==-1){
-		maxRow=rows-1;
+
+	//threshold<d is the same as floor(threshold)<d for integer distances, -1 keeps the pixels without background out
+	static int IntegerThreshold(double threshold){
+		double t=floor(threshold);
+		if (t<-1){
+			return -1;
+		}
+		if (t>INT_MAX){
+			return INT_MAX;
+		}
+		return (int)t;
 	}
-	if (minCol==-1){
-		minCol=0;
+
+	int Distance(const uchar *point, const uchar *reference) const{
+		if (skipEmptyReference==true && reference[0]+reference[1]+reference[2]==0){
+			return -1;
+		}
+		int d=0;
+		for (int k=0;k<3;++k){
+			int dd=point[k]-reference[k];
+			d+=dd*dd;
+		}
+		if (point[1]<greenThreshold){
+			int dd=greenThreshold-point[1];
+			d+=dd*dd+greenPenaltyBias;
+		}
+		return d;
 	}
-	if (maxCol==-1){
-		maxCol=cols-1;
+
+	//either distance or mask can be NULL, the mask gets 1 where the distance is above threshold
+	void Row(const uchar *img, const uchar *reference, int n, int *distance, uchar *mask, int threshold=0) const{
+		int j=0;
+#ifdef USE_X86_SIMD
+		int level=GetSimdLevel();
+		if (level==SIMD_AVX2){
+			j=RowAvx2(img, reference, n, distance, mask, threshold);
+		} else if (level==SIMD_SSE41){
+			j=RowSse41(img, reference, n, distance, mask, threshold);
+		}
+#endif
+		for (;j<n;++j){
+			int d=Distance(img+3*j, reference+3*j);
+			if (distance!=NULL){
+				distance[j]=d;
+			}
+			if (mask!=NULL){
+				mask[j]=threshold<d;
+			}
+		}
 	}
 
-	for (int i=minRow;i<=maxRow;++i){
-		for (int j=minCol;j<=maxCol;++j){
-			flag[i][j]=0;
-			if (terrainMask==NULL || terrainMask[i][j]!=0){
-				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+i*cols+j);
-				if (backgroundPoint[0]!=0 || backgroundPoint[1]!=0 || backgroundPoint[2]){
-					const Vec3b point=*(((Vec3b *)(img.data))+i*cols+j);
-				
-					//TESTING
-					if (false){
-						double thresholdAngle=6;
-						Vec3d v1=point;
-						Vec3d v2=backgroundPoint;
-						double currentAngle=0;
-						double a=0;
-						double b=0;
-						for (int i=0;i<3;++i){
-							currentAngle+=v1[i]*v2[i];
-							a+=v1[i]*v1[i];
-							b+=v2[i]*v2[i];
-						}
-						currentAngle/=sqrt(a*b);
-						currentAngle=180*acos(currentAngle)/3.141592654;
-						//printf("%lf\n", currentAngle);
-						if (thresholdAngle<currentAngle){
-							flag[i][j]=1;
-						}
-						continue;
-					}
-				
+#ifdef USE_X86_SIMD
+	//both return the number of processed pixels, the rest is left for the scalar path
+	TARGET_SSE41 int RowSse41(const uchar *img, const uchar *reference, int n, int *distance, uchar *mask, int threshold) const{
+		__m128i zero=_mm_setzero_si128();
+		__m128i one=_mm_set1_epi8(1);
+		__m128i gt=_mm_set1_epi16(greenThreshold);
+		__m128i bias=_mm_set1_epi32(greenPenaltyBias);
+		__m128i thr=_mm_set1_epi32(threshold);
+		__m128i emptyEnabled=skipEmptyReference==true ? _mm_set1_epi8(-1) : zero;
+
+		int j=0;
+		for (;j+16<=n;j+=16){
+			__m128i b8, g8, r8, rb8, rg8, rr8;
+			LoadBgr16(img+3*j, b8, g8, r8);
+			LoadBgr16(reference+3*j, rb8, rg8, rr8);
+			__m128i empty8=_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(_mm_or_si128(rb8, rg8), rr8), zero), emptyEnabled);
+
+			__m128i d32[4];
+			for (int h=0;h<2;++h){
+				__m128i b=h==0 ? _mm_unpacklo_epi8(b8, zero) : _mm_unpackhi_epi8(b8, zero);
+				__m128i g=h==0 ? _mm_unpacklo_epi8(g8, zero) : _mm_unpackhi_epi8(g8, zero);
+				__m128i r=h==0 ? _mm_unpacklo_epi8(r8, zero) : _mm_unpackhi_epi8(r8, zero);
+				__m128i rb=h==0 ? _mm_unpacklo_epi8(rb8, zero) : _mm_unpackhi_epi8(rb8, zero);
+				__m128i rg=h==0 ? _mm_unpacklo_epi8(rg8, zero) : _mm_unpackhi_epi8(rg8, zero);
+				__m128i rr=h==0 ? _mm_unpacklo_epi8(rr8, zero) : _mm_unpackhi_epi8(rr8, zero);
+				__m128i empty=h==0 ? _mm_unpacklo_epi8(empty8, empty8) : _mm_unpackhi_epi8(empty8, empty8);
+
+				__m128i db=_mm_sub_epi16(b, rb);
+				__m128i dg=_mm_sub_epi16(g, rg);
+				__m128i dr=_mm_sub_epi16(r, rr);
+				__m128i penalty=_mm_max_epi16(_mm_sub_epi16(gt, g), zero);
+				__m128i dark=_mm_cmpgt_epi16(gt, g);
+
+				__m128i bg=_mm_unpacklo_epi16(db, dg);
+				__m128i rp=_mm_unpacklo_epi16(dr, penalty);
+				__m128i d=_mm_add_epi32(_mm_madd_epi16(bg, bg), _mm_madd_epi16(rp, rp));
+				d=_mm_add_epi32(d, _mm_and_si128(_mm_unpacklo_epi16(dark, dark), bias));
+				d32[2*h]=_mm_or_si128(d, _mm_unpacklo_epi16(empty, empty));
+
+				bg=_mm_unpackhi_epi16(db, dg);
+				rp=_mm_unpackhi_epi16(dr, penalty);
+				d=_mm_add_epi32(_mm_madd_epi16(bg, bg), _mm_madd_epi16(rp, rp));
+				d=_mm_add_epi32(d, _mm_and_si128(_mm_unpackhi_epi16(dark, dark), bias));
+				d32[2*h+1]=_mm_or_si128(d, _mm_unpackhi_epi16(empty, empty));
+			}
 
-					double d=0.0;
-					for (int k=0;k<3;++k){
-						double dd=point[k]-backgroundPoint[k];
-						dd*=dd;
-						d+=dd;
-					}
-					if (point[1]<greenThreshold){
-						double dd=greenThreshold-point[1];
-						dd*=dd;
-						d+=dd;
-					}
-					if (threshold<d){
-						flag[i][j]=1;
-					} else{
-						suddenlyChanged[i][j]=0;
-					}
-				} else{
-					suddenlyChanged[i][j]=0;
+			if (distance!=NULL){
+				for (int k=0;k<4;++k){
+					_mm_storeu_si128((__m128i *)(distance+j+4*k), d32[k]);
 				}
 			}
+			if (mask!=NULL){
+				__m128i c01=_mm_packs_epi32(_mm_cmpgt_epi32(d32[0], thr), _mm_cmpgt_epi32(d32[1], thr));
+				__m128i c23=_mm_packs_epi32(_mm_cmpgt_epi32(d32[2], thr), _mm_cmpgt_epi32(d32[3], thr));
+				_mm_storeu_si128((__m128i *)(mask+j), _mm_and_si128(_mm_packs_epi16(c01, c23), one));
+			}
+		}
+		return j;
+	}
+
+	TARGET_AVX2 int RowAvx2(const uchar *img, const uchar *reference, int n, int *distance, uchar *mask, int threshold) const{
+		__m128i zero8=_mm_setzero_si128();
+		__m256i zero=_mm256_setzero_si256();
+		__m128i one=_mm_set1_epi8(1);
+		__m256i gt=_mm256_set1_epi16(greenThreshold);
+		__m256i bias=_mm256_set1_epi32(greenPenaltyBias);
+		__m256i thr=_mm256_set1_epi32(threshold);
+		__m128i emptyEnabled=skipEmptyReference==true ? _mm_set1_epi8(-1) : zero8;
+
+		int j=0;
+		for (;j+16<=n;j+=16){
+			__m128i b8, g8, r8, rb8, rg8, rr8;
+			LoadBgr16(img+3*j, b8, g8, r8);
+			LoadBgr16(reference+3*j, rb8, rg8, rr8);
+			__m128i empty8=_mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(_mm_or_si128(rb8, rg8), rr8), zero8), emptyEnabled);
+
+			__m256i db=_mm256_sub_epi16(_mm256_cvtepu8_epi16(b8), _mm256_cvtepu8_epi16(rb8));
+			__m256i dg=_mm256_sub_epi16(_mm256_cvtepu8_epi16(g8), _mm256_cvtepu8_epi16(rg8));
+			__m256i dr=_mm256_sub_epi16(_mm256_cvtepu8_epi16(r8), _mm256_cvtepu8_epi16(rr8));
+			__m256i g=_mm256_cvtepu8_epi16(g8);
+			__m256i penalty=_mm256_max_epi16(_mm256_sub_epi16(gt, g), zero);
+			__m256i dark=_mm256_cmpgt_epi16(gt, g);
+			__m256i empty=_mm256_cvtepi8_epi16(empty8);
+
+			//unpacking works within 128-bit lanes, lo holds pixels 0-3 and 8-11, hi holds pixels 4-7 and 12-15
+			__m256i bg=_mm256_unpacklo_epi16(db, dg);
+			__m256i rp=_mm256_unpacklo_epi16(dr, penalty);
+			__m256i lo=_mm256_add_epi32(_mm256_madd_epi16(bg, bg), _mm256_madd_epi16(rp, rp));
+			lo=_mm256_add_epi32(lo, _mm256_and_si256(_mm256_unpacklo_epi16(dark, dark), bias));
+			lo=_mm256_or_si256(lo, _mm256_unpacklo_epi16(empty, empty));
+
+			bg=_mm256_unpackhi_epi16(db, dg);
+			rp=_mm256_unpackhi_epi16(dr, penalty);
+			__m256i hi=_mm256_add_epi32(_mm256_madd_epi16(bg, bg), _mm256_madd_epi16(rp, rp));
+			hi=_mm256_add_epi32(hi, _mm256_and_si256(_mm256_unpackhi_epi16(dark, dark), bias));
+			hi=_mm256_or_si256(hi, _mm256_unpackhi_epi16(empty, empty));
+
+			if (distance!=NULL){
+				_mm256_storeu_si256((__m256i *)(distance+j), _mm256_permute2x128_si256(lo, hi, 0x20));
+				_mm256_storeu_si256((__m256i *)(distance+j+8), _mm256_permute2x128_si256(lo, hi, 0x31));
+			}
+			if (mask!=NULL){
+				__m256i c=_mm256_packs_epi32(_mm256_cmpgt_epi32(lo, thr), _mm256_cmpgt_epi32(hi, thr));
+				__m128i packed=_mm_packs_epi16(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+				_mm_storeu_si128((__m128i *)(mask+j), _mm_and_si128(packed, one));
+			}
 		}
+		return j;
 	}
+#endif
+};
 
-}
+//the grass decision of ChromaticityClassifier for every BGR color as a bit, 2^24 bits (2 MB) indexed by (r<<16)|(g<<8)|b,
+//for a fixed r and g the passing sums s=r+g+b form one interval so every row of 256 bits is filled at once
+struct GrassTable{
+	int numerator[4];
+	int denominator[4];
+	vector<uint64> bits;
 
-void GetForegroundFlagWithRespectToPreviousFrameAndBackground2(Mat img, Mat previous, Mat background, int **terrainMask, double threshold, double thresholdForPrevious, double greenThreshold, int **flag, int **suddenlyChanged, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
-	
-	if (suddenlyChanged==NULL){
-		GetForegroundFlag(img, background, terrainMask, threshold, flag, minRow, maxRow, minCol, maxCol);
-	} else{
-		GetForegroundFlag(img, background, terrainMask, threshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+	explicit GrassTable(const ChromaticityClassifier &classifier){
+		for (int k=0;k<4;++k){
+			numerator[k]=classifier.numerator[k];
+			denominator[k]=classifier.denominator[k];
+		}
+		Build();
 	}
 
-	int rows=img.rows;
-	int cols=img.cols;
-
-	if (minRow==-1){
-		minRow=0;
+	static int FloorDivide(int a, int b){
+		int q=a/b;
+		return (a%b!=0 && (a<0)!=(b<0)) ? q-1 : q;
 	}
-	if (maxRow==-1){
-		maxRow=rows-1;
-	}
-	if (minCol==-1){
-		minCol=0;
+
+	static int CeilDivide(int a, int b){
+		return -FloorDivide(-a, b);
 	}
-	if (maxCol==-1){
-		maxCol=cols-1;
+
+	//narrows [lower, upper] to the sums s with a*s<=c
+	static void Constrain(int a, int c, int &lower, int &upper){
+		if (a>0){
+			upper=min(upper, FloorDivide(c, a));
+		} else if (a<0){
+			lower=max(lower, CeilDivide(c, a));
+		} else if (c<0){
+			upper=lower-1;
+		}
 	}
 
-	for (int i=minRow;i<=maxRow;++i){
-		for (int j=minCol;j<=maxCol;++j){
-			if (flag[i][j]!=0){
-				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+i*cols+j);
-				if (backgroundPoint[0]!=0 || backgroundPoint[1]!=0 || backgroundPoint[2]){
-					const Vec3b point=*(((Vec3b *)(img.data))+i*cols+j);
-					const Vec3b previousPoint=*(((Vec3b *)(previous.data))+i*cols+j);
-				
-					double d=0.0;
-					for (int k=0;k<3;++k){
-						double dd=point[k]-previousPoint[k];
-						dd*=dd;
-						d+=dd;
-					}
-					if (point[1]<greenThreshold){
-						double dd=greenThreshold-point[1];
-						dd*=dd;
-						d+=dd;
-					}
-					
-					if (thresholdForPrevious<d){
-						suddenlyChanged[i][j]=1;
-					}
-					//if (suddenlyChanged[i][j]==0){
-					if (suddenlyChanged[i][j]==0 && IsForegroundPixel2(point, redLower, redUpper, greenLower, greenUpper)==false){
-						flag[i][j]=0;
-					}
+	void Build(){
+		bits.assign((1<<24)/64, 0);
+		for (int r=0;r<256;++r){
+			for (int g=0;g<256;++g){
+				//the sum is r+g+b for b in [0, 255] and the black pixel is not grass
+				int lower=max(r+g, 1);
+				int upper=r+g+255;
+				Constrain(numerator[0], r*denominator[0], lower, upper);
+				Constrain(-numerator[1], -r*denominator[1], lower, upper);
+				Constrain(numerator[2], g*denominator[2], lower, upper);
+				Constrain(-numerator[3], -g*denominator[3], lower, upper);
+				uint64 *row=&bits[(r<<16|g<<8)/64];
+				for (int b=lower-r-g;b<=upper-r-g;++b){
+					row[b>>6]|=(uint64)1<<(b&63);
 				}
 			}
 		}
 	}
 
-}
-
-void GetGroups(int **flag, int rows, int cols, vector<vector<Position>> &groups, UnionFind &uf, bool ufIsInitialized=false, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
-
-	if (minRow==-1){
-		minRow=0;
+	bool IsGrass(const uchar *point) const{
+		unsigned index=point[2]<<16|point[1]<<8|point[0];
+		return ((bits[index>>6]>>(index&63))&1)!=0;
 	}
-	if (maxRow==-1){
-		maxRow=rows-1;
+};
+
+inline bool ChromaticityClassifier::IsGrass(const uchar *point) const{
+	if (table!=nullptr){
+		return table->IsGrass(point);
 	}
-	if (minCol==-1){
-		minCol=0;
+	return CalculateIsGrass(point);
+}
+
+//builds the table of the last requested bounds on its own thread and publishes it with an atomic swap,
+//a classifier takes the published table only if it has exactly its bounds, so the results never depend on when it was built
+struct GrassTables{
+	mutex lock;
+	condition_variable wake;
+	thread worker;
+	bool started;
+	bool stopping;
+	bool pending;
+	int numerator[4];
+	int denominator[4];
+	shared_ptr<const GrassTable> published;
+
+	GrassTables(){
+		started=false;
+		stopping=false;
+		pending=false;
+	}
+
+	~GrassTables(){
+		if (started==true){
+			{
+				lock_guard<mutex> guard(lock);
+				stopping=true;
+			}
+			wake.notify_one();
+			worker.join();
+		}
 	}
-	if (maxCol==-1){
-		maxCol=cols-1;
+
+	shared_ptr<const GrassTable> Find(const ChromaticityClassifier &classifier) const{
+		shared_ptr<const GrassTable> latest=atomic_load(&published);
+		if (latest==nullptr || classifier.SameBounds(latest->numerator, latest->denominator)==false){
+			return nullptr;
+		}
+		return latest;
 	}
-	
-	int border=rows*cols;
-	
-	if (ufIsInitialized==false){
-		uf.Clear();
-		uf.Add(border);
-		
-		for (int i=minRow;i<=maxRow;++i){
-			for (int j=minCol;j<=maxCol;++j){
-				if (flag[i][j]==1){
-					uf.Add(i*cols+j);
-					if (i==0 || j==0 || i==rows-1 || j==cols-1){
-						uf.Union(i*cols+j, border);
-					} else{
-						if (i>0 && flag[i-1][j]==1){
-							uf.Union(i*cols+j, (i-1)*cols+j);
-						}
-						
-						if(j>0 && flag[i][j-1]==1){
-							uf.Union(i*cols+j, i*cols+j-1);
-						}
-					}
-					
-				}
+
+	//returns at once, a request that was not started yet is replaced by the newer one
+	void Request(const ChromaticityClassifier &classifier){
+		if (Find(classifier)!=nullptr){
+			return;
+		}
+		{
+			lock_guard<mutex> guard(lock);
+			for (int k=0;k<4;++k){
+				numerator[k]=classifier.numerator[k];
+				denominator[k]=classifier.denominator[k];
+			}
+			pending=true;
+			if (started==false){
+				started=true;
+				worker=thread(&GrassTables::Run, this);
 			}
 		}
+		wake.notify_one();
 	}
 
-	map<int, vector<Position>> positions;
-
-	for (int i=minRow;i<=maxRow;++i){
-		for (int j=minCol;j<=maxCol;++j){
-			if (flag[i][j]==1){
-				int parent=uf.Find(i*cols+j);
-				if (parent!=border){
-					positions[parent].push_back(Position(i, j));
+	void Run(){
+		while (true){
+			ChromaticityClassifier classifier;
+			{
+				unique_lock<mutex> guard(lock);
+				wake.wait(guard, [this]{
+					return stopping==true || pending==true;
+				});
+				if (stopping==true){
+					return;
+				}
+				for (int k=0;k<4;++k){
+					classifier.numerator[k]=numerator[k];
+					classifier.denominator[k]=denominator[k];
 				}
+				classifier.table=nullptr;
+				pending=false;
+			}
+			if (Find(classifier)==nullptr){
+				atomic_store(&published, shared_ptr<const GrassTable>(make_shared<GrassTable>(classifier)));
 			}
 		}
 	}
+};
 
-	groups.clear();
-	
-	for (auto mi=positions.begin();mi!=positions.end();++mi){
-		groups.push_back(mi->second);
-	}
-	
+GrassTables &GetGrassTables(){
+	static GrassTables tables;
+	return tables;
 }
 
-enum BoundingBoxType{
-	NORMAL=0,
-	PUSHED_OUT=1,
-	PUSHER=2,
-	FILLED=4
-};
+shared_ptr<const GrassTable> FindGrassTable(const ChromaticityClassifier &classifier){
+	return GetGrassTables().Find(classifier);
+}
 
-struct BoundingBox{
-	int minRow;
-	int maxRow;
-	int minCol;
-	int maxCol;
-	int frame;
-	int type;
-	Vec3b meanColor;
-	BoundingBox(int minRow=0, int maxRow=0, int minCol=0, int maxCol=0, int frame=0, int type=0, Vec3b meanColor=Vec3b(0, 0, 0)):minRow(minRow), maxRow(maxRow), minCol(minCol), maxCol(maxCol), frame(frame), type(type), meanColor(meanColor){}
-};
+//the table is built in the background, the classifiers of these bounds use it once it is published
+void RequestGrassTable(double redLower, double redUpper, double greenLower, double greenUpper){
+	GetGrassTables().Request(ChromaticityClassifier(redLower, redUpper, greenLower, greenUpper));
+}
 
-void GetBoundingBox(const vector<Position> &points, int &minRow, int &maxRow, int &minCol, int &maxCol){
-	int n=points.size();
-	if (n==0){
-		return;
-	}
-	minRow=points[0].row;
-	maxRow=minRow;
-	minCol=points[0].col;
-	maxCol=minCol;
-	for (int i=0;i<n;++i){
-		int cr=points[i].row;
-		int cc=points[i].col;
-		if (cr<minRow){
-			minRow=cr;
-		}
-		if (maxRow<cr){
-			maxRow=cr;
-		}
-		if (cc<minCol){
-			minCol=cc;
-		}
-		if (maxCol<cc){
-			maxCol=cc;
-		}
-				
-	}
-	
-}
-
-BoundingBox GetBoundingBox(const vector<Position> &points){
-	int n=points.size();
-	if (n==0){
-		return BoundingBox(-1, -1, -1, -1);
-	}
-	int minRow=points[0].row;
-	int maxRow=minRow;
-	int minCol=points[0].col;
-	int maxCol=minCol;
-	for (int i=0;i<n;++i){
-		int cr=points[i].row;
-		int cc=points[i].col;
-		if (cr<minRow){
-			minRow=cr;
-		}
-		if (maxRow<cr){
-			maxRow=cr;
-		}
-		if (cc<minCol){
-			minCol=cc;
-		}
-		if (maxCol<cc){
-			maxCol=cc;
-		}
-				
-	}
-	
-	return BoundingBox(minRow, maxRow, minCol, maxCol);
-}
-
-void DrawRectangle(Mat &img, int minRow, int maxRow, int minCol, int maxCol, int size=-1){
-	double height=maxRow-minRow;
-	double width=maxCol-minCol;
-
-	Scalar drawColor=Scalar(0, 0, 255);
-	if (height*1.5<width || width*10<height || (size!=-1 && size*5<height*width)){
-		drawColor=Scalar(255, 0, 0);
+bool IsForegroundPixel2(Vec3b point, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double greenThreshold=35){
+	double s=point[0]+point[1]+point[2];
+	if (s==0){
+		return false;
 	}
-
-	rectangle(img, Point(minCol, minRow), Point(maxCol, maxRow), drawColor);
+	double r=point[2]/s;
+	double g=point[1]/s;
+	return ((redLower<=r && r<=redUpper && greenLower<=g && g<=greenUpper)==false || point[1]<=greenThreshold);
 }
 
-void DrawRectangles(Mat &img, const vector<BoundingBox> &boundingBoxes){
-
-	for (int i=0;i<boundingBoxes.size();++i){
-		int minRow=boundingBoxes[i].minRow;
-		int maxRow=boundingBoxes[i].maxRow;
-		int minCol=boundingBoxes[i].minCol;
-		int maxCol=boundingBoxes[i].maxCol;
-		
-		DrawRectangle(img, minRow, maxRow, minCol, maxCol, -1);
-	}
-
+bool IsForegroundPixel2(Vec3b point, const ChromaticityClassifier &classifier, double greenThreshold=35){
+	return classifier.IsForeground(&point[0], greenThreshold);
 }
 
-Mat terrainSelectionImg;
-vector<Position> terrainSelectionPositions;
-Position terrainSelectionPointerPoint;
-const char *terrainSelectionWindowName = "terrain_selection";
-bool terrainSelectionActionsPerformed = false;
-bool terrainSelectionMouseDown = false;
-int terrainSelectionX = 0;
-int terrainSelectionY = 0;
-bool terrainSelectionMovePerformed = false;
-
-bool LineIntersectionExists(double p0_x, double p0_y, double p1_x, double p1_y, double p2_x, double p2_y, double p3_x, double p3_y){
-    
-	double s1_x=p1_x-p0_x;
-	double s1_y=p1_y-p0_y;
-    double s2_x=p3_x-p2_x;
-	double s2_y=p3_y-p2_y;
-
-    double s=(-s1_y*(p0_x-p2_x)+s1_x*(p0_y-p2_y))/(-s2_x*s1_y+s1_x*s2_y);
-    double t=(s2_x*(p0_y-p2_y)-s2_y*(p0_x-p2_x))/(-s2_x*s1_y+s1_x*s2_y);
-
-    if (s>=0 && s<=1 && t>=0 && t<=1){
-        return true;
-    }
+void GetBackgroundMask(Mat img, Plane<uchar> &flag, UnionFind &uf, double greenFactor=1.0, double redFactor=1.0, double greenFactor2=1.3, double previousSizeThreshold=2.0, bool yAligned=false){
 
-    return false;
-}
+	int rows=img.rows;
+	int cols=img.cols;
 
-void TerrainSelectionMouseCallback(int event, int x, int y, int flags, void* userdata){
+	uf.Clear();
 	
-	int radius=10;
-	int radiusIdx=-1;
-
-	for (int i=0;i<terrainSelectionPositions.size();++i){
-		int x2=terrainSelectionPositions[i].col;
-		int y2=terrainSelectionPositions[i].row;
-
-		int d=(x-x2)*(x-x2)+(y-y2)*(y-y2);
-		if (d<=radius*radius){
-			radiusIdx=i;
-			break;
-		}
-	}
-
-	if (event==EVENT_LBUTTONDOWN || event==EVENT_MBUTTONDOWN || event==EVENT_RBUTTONDOWN){
-		terrainSelectionMouseDown=true;
-		terrainSelectionMovePerformed=false;
-	}
-
-	bool disregardUp=false;
-	if (event==EVENT_LBUTTONUP || event==EVENT_MBUTTONUP || event==EVENT_RBUTTONUP){
-		terrainSelectionMouseDown=false;
-		disregardUp=terrainSelectionMovePerformed;
-		terrainSelectionMovePerformed=false;
-	}
-
-	if (event==EVENT_LBUTTONUP && disregardUp==false){
-		if (radiusIdx!=-1){
-			
-			terrainSelectionActionsPerformed=true;
-			int n=terrainSelectionPositions.size();
-			bool collision=false;
-			for (int i=radiusIdx;i<n-3;++i){
-				for (int j=i+2;j<n-1;++j){
-					if (LineIntersectionExists(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row, terrainSelectionPositions[i+1].col, terrainSelectionPositions[i+1].row, terrainSelectionPositions[j].col, terrainSelectionPositions[j].row, terrainSelectionPositions[j+1].col, terrainSelectionPositions[j+1].row)==true){
-						collision=true;
-						break;
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			Vec3b &sourcePoint=*(((Vec3b *)(img.data))+i*cols+j);
+			//if (point[1]>point[2] && point[2]>point[0]){
+			if (sourcePoint[1]>greenFactor*sourcePoint[2] && sourcePoint[2]>redFactor*sourcePoint[0] && sourcePoint[1]>greenFactor2*sourcePoint[0]){
+				uf.Add(i*cols+j, i);
+				flag[i][j]=1;
+				if (i>0){
+					if (flag[i-1][j]==1){
+						uf.Union(i*cols+j, (i-1)*cols+j);
 					}
 				}
-			}
-			
-			if (collision==false){
-				Position add=terrainSelectionPositions[radiusIdx];
-				if (radiusIdx>0){
-					for (int i=0;i<terrainSelectionPositions.size()-radiusIdx;++i){
-						terrainSelectionPositions[i]=terrainSelectionPositions[i+radiusIdx];
+				if (j>0){
+					if (flag[i][j-1]==1){
+						uf.Union(i*cols+j, i*cols+j-1);
 					}
-					terrainSelectionPositions.resize(terrainSelectionPositions.size()-radiusIdx);
-					radiusIdx=0;
 				}
-				terrainSelectionPositions.push_back(add);
+			} else{
+				flag[i][j]=0;
 			}
-		} else{
-			terrainSelectionPositions.push_back(Position(y, x));
-		}
-
-	} else if (event==EVENT_RBUTTONUP && disregardUp==false){
 
-		terrainSelectionActionsPerformed=true;
-		terrainSelectionPositions.pop_back();
-		
-	} else if (event==EVENT_MBUTTONUP && disregardUp==false){
-		
-		terrainSelectionActionsPerformed=true;
-		terrainSelectionPositions.clear();
-
-	} else if (event==EVENT_MOUSEMOVE){
+		}
+	}
 		
-		if (terrainSelectionMouseDown==true){
-			int dx=x-terrainSelectionX;
-			int dy=y-terrainSelectionY;
-			for (int i=0;i<terrainSelectionPositions.size();++i){
-				terrainSelectionPositions[i].col+=dx;
-				terrainSelectionPositions[i].row+=dy;
-			}
-			terrainSelectionMovePerformed=true;
-			terrainSelectionActionsPerformed=true;
+	//only the added elements are visited, a set is larger than any element below its root so the largest size is at a root;
+	//of equally large sets the one whose root comes first in added (row-major order) is taken, which is not always the set the
+	//scan over all pixels took before, since the roots were other elements then
+	int msp=-1;
+	for (int k=0;k<uf.added.size();++k){
+		int i=uf.added[k];
+		if (msp==-1 || uf.size[msp]<uf.size[i]){
+			msp=i;
 		}
-		terrainSelectionPointerPoint=Position(y, x);
-		terrainSelectionX=x;
-		terrainSelectionY=y;
 	}
-
-	Mat img;
-	terrainSelectionImg.copyTo(img);
-
-	for (int i=1;i<terrainSelectionPositions.size();++i){
-		Point previous=Point(terrainSelectionPositions[i-1].col, terrainSelectionPositions[i-1].row);
-		Point current=Point(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row);
-		line(img, previous, current, Scalar(0, 0, 255));
+	if (msp==-1){
+		return;
 	}
-
-	if (terrainSelectionPositions.size()>0 && terrainSelectionMouseDown==false){
-		Point previous=Point(terrainSelectionPositions[terrainSelectionPositions.size()-1].col, terrainSelectionPositions[terrainSelectionPositions.size()-1].row);
-		Point current=Point(terrainSelectionPointerPoint.col, terrainSelectionPointerPoint.row);
-		line(img, previous, current, Scalar(0, 0, 255));
+	int sizeThreshold=uf.size[msp];
+	double meanY=uf.sum[msp]/(double)uf.size[msp];
+	for (int k=0;k<uf.added.size();++k){
+		int i=uf.added[k];
+		if (i==uf.parent[i] && sizeThreshold<uf.size[i]*previousSizeThreshold){
+			if (yAligned==false || fabs(uf.sum[i]/(double)uf.size[i]-meanY)<0.1*rows){
+				uf.Union(i, msp);
+			}
+		}
 	}
-
-	for (int i=0;i<terrainSelectionPositions.size();++i){
-		Point center=Point(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row);
-		Scalar color=Scalar(0, 0, 255);
-		if (i==radiusIdx && i!=terrainSelectionPositions.size()-1 && terrainSelectionPositions.size()-i>2){
-			color=Scalar(255, 0, 0);
+	
+	int mspRoot=uf.Find(msp);
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (flag[i][j]==1 && uf.Find(i*cols+j)!=mspRoot){
+				flag[i][j]=0;
+			}
 		}
-		circle(img, center, radius, color);
 	}
 
-	imshow(terrainSelectionWindowName, img);
-
 }
 
-void CleanUpSelectedTerrain(int ***flagPtr, UnionFind *uf, int rows, int cols){
+void GetBackgroundMask2(Mat img, Plane<uchar> &flag, UnionFind &uf, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false){
+
+	int rows=img.rows;
+	int cols=img.cols;
+
+	uf.Clear();
+
+	ChromaticityClassifier classifier(redLower, redUpper, greenLower, greenUpper);
 
-	int **flag=*flagPtr;
-	uf->Clear();
+	ParallelForRows(0, rows, [&](int begin, int end){
+		for (int i=begin;i<end;++i){
+			classifier.ClassifyRow(img.data+3*i*cols, flag[i], cols);
+		}
+	});
 	
 	for (int i=0;i<rows;++i){
 		for (int j=0;j<cols;++j){
 			if (flag[i][j]==1){
-				uf->Add(i*cols+j, i);
+				uf.Add(i*cols+j, i);
 				if (i>0){
 					if (flag[i-1][j]==1){
-						uf->Union(i*cols+j, (i-1)*cols+j);
+						uf.Union(i*cols+j, (i-1)*cols+j);
 					}
 				}
 				if (j>0){
 					if (flag[i][j-1]==1){
-						uf->Union(i*cols+j, i*cols+j-1);
+						uf.Union(i*cols+j, i*cols+j-1);
 					}
 				}
-			} else{
-				flag[i][j]=0;
 			}
-
 		}
 	}
 		
-	vector<Group> groups;
-	int msp=0;
-	set<int> distinctGroups;
-	for (int i=0;i<rows*cols;++i){
-		if (uf->size[msp]<uf->size[i]){
+	//only the added elements are visited, a set is larger than any element below its root so the largest size is at a root;
+	//of equally large sets the one whose root comes first in added (row-major order) is taken, which is not always the set the
+	//scan over all pixels took before, since the roots were other elements then
+	int msp=-1;
+	for (int k=0;k<uf.added.size();++k){
+		int i=uf.added[k];
+		if (msp==-1 || uf.size[msp]<uf.size[i]){
 			msp=i;
 		}
 	}
+	if (msp==-1){
+		return;
+	}
+	int sizeThreshold=uf.size[msp];
+	double meanY=uf.sum[msp]/(double)uf.size[msp];
+	for (int k=0;k<uf.added.size();++k){
+		int i=uf.added[k];
+		if (i==uf.parent[i] && sizeThreshold<uf.size[i]*previousSizeThreshold){
+			if (yAligned==false || fabs(uf.sum[i]/(double)uf.size[i]-meanY)<0.1*rows){
+				uf.Union(i, msp);
+			}
+		}
+	}
 	
+	int mspRoot=uf.Find(msp);
 	for (int i=0;i<rows;++i){
 		for (int j=0;j<cols;++j){
-			if (flag[i][j]==1 && uf->Find(i*cols+j)!=msp){
+			if (flag[i][j]==1 && uf.Find(i*cols+j)!=mspRoot){
 				flag[i][j]=0;
 			}
 		}
 	}
 
-	int border=rows*cols;
-	uf->Clear();
-	uf->Add(border);
+}
+
+void GetFilledBackgroundMask2(Mat img, Plane<uchar> &flag, UnionFind &uf, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool combineWithPrevious=false){
+
+	int rows=img.rows;
+	int cols=img.cols;
+	Plane<uchar> previousFlag;
+
+	if (combineWithPrevious==true){
+		flag.CopyTo(previousFlag);
+	}
+
+	GetBackgroundMask2(img, flag, uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
 	
+	uf.Clear();
+
+	int border=rows*cols;
+	uf.Add(border);
+
 	for (int i=0;i<rows;++i){
 		for (int j=0;j<cols;++j){
-			if (flag[i][j]==0){
-					
-				uf->Add(i*cols+j);
+			if (flag[i][j]!=1){
+				uf.Add(i*cols+j);
 				if (i==0 || j==0 || i==rows-1 || j==cols-1){
-					uf->Union(i*cols+j, border);
+					uf.Union(i*cols+j, border);
 				} else{
-					if (i>0 && flag[i-1][j]==0){
-						uf->Union(i*cols+j, (i-1)*cols+j);
+					if (i>0 && flag[i-1][j]!=1){
+						uf.Union(i*cols+j, (i-1)*cols+j);
 					}
 						
-					if(j>0 && flag[i][j-1]==0){
-						uf->Union(i*cols+j, i*cols+j-1);
+					if(j>0 && flag[i][j-1]!=1){
+						uf.Union(i*cols+j, i*cols+j-1);
 					}
 				}
 					
@@ -1427,10 +1840,10 @@ void CleanUpSelectedTerrain(int ***flagPtr, UnionFind *uf, int rows, int cols){
 		}
 	}
 
-	int f=uf->Find(border);
+	int borderRoot=uf.Find(border);
 	for (int i=0;i<rows;++i){
 		for (int j=0;j<cols;++j){
-			if (flag[i][j]==0 && uf->Find(i*cols+j)!=border){
+			if (flag[i][j]==0 && uf.Find(i*cols+j)!=borderRoot || (combineWithPrevious==true && previousFlag[i][j]==1)){
 				flag[i][j]=1;
 			}
 		}
@@ -1438,1587 +1851,6613 @@ void CleanUpSelectedTerrain(int ***flagPtr, UnionFind *uf, int rows, int cols){
 
 }
 
-int **SelectTerrain(double f=1.0){
-	int rows=terrainSelectionImg.rows;
-	int cols=terrainSelectionImg.cols;
-	
-	resize(terrainSelectionImg, terrainSelectionImg, Size(terrainSelectionImg.cols/f, terrainSelectionImg.rows/f));
-
-	terrainSelectionActionsPerformed=false;
-	terrainSelectionMouseDown=false;
-	terrainSelectionMovePerformed=false;
-
-	bool selected=false;
+//how the frames between the sampled ones are skipped: decoding them fully, grabbing them without decoding them into images or seeking past them
+//(seeking lands on the exact frame only if the backend seeks accurately)
+enum FrameSampling{
+	SAMPLE_DECODE=0,
+	SAMPLE_GRAB=1,
+	SAMPLE_SEEK=2
+};
 
-	while(selected==false){
-		imshow(terrainSelectionWindowName, terrainSelectionImg);
-		setMouseCallback(terrainSelectionWindowName, TerrainSelectionMouseCallback, NULL);
-		waitKey();
-		if (terrainSelectionPositions.size()<3 || terrainSelectionPositions[0].row!=terrainSelectionPositions[terrainSelectionPositions.size()-1].row || terrainSelectionPositions[0].col!=terrainSelectionPositions[terrainSelectionPositions.size()-1].col){
-			terrainSelectionPositions.clear();
-		} else{
-			selected=true;
+//moves the video from the frame position to the frame target (not before position) and reads it, position is updated
+bool ReadSampledFrame(VideoCapture &video, int &position, int target, Mat &img, int sampling=SAMPLE_GRAB){
+	if (sampling==SAMPLE_SEEK && position!=target){
+		video.set(CAP_PROP_POS_FRAMES, target);
+		position=target;
+	}
+	while (position<target){
+		if (sampling==SAMPLE_DECODE){
+			Mat skipped;
+			video>>skipped;
+			if (skipped.empty()){
+				return false;
+			}
+		} else if (video.grab()==false){
+			return false;
 		}
+		++position;
+	}
+	video>>img;
+	if (img.empty()){
+		return false;
 	}
+	++position;
+	return true;
+}
 
-	for (int i=0;i<terrainSelectionPositions.size();++i){
-		terrainSelectionPositions[i].row/=f;
-		terrainSelectionPositions[i].col/=f;
+//sums the grass pixels of the sampled frames, the background is their mean
+struct BackgroundAccumulator{
+	Plane<uchar> flag;
+	Plane<ushort> count;
+	Plane<Vec3i> sum;
+	UnionFind *uf;
+
+	BackgroundAccumulator():uf(NULL){}
+
+	~BackgroundAccumulator(){
+		delete uf;
 	}
 
-	int **terrainMask=GetIntMatrix(rows, cols, true);
+	void Add(const Mat &img, double redLower, double redUpper, double greenLower, double greenUpper, double previousSizeThreshold, bool yAligned){
+		int rows=img.rows;
+		int cols=img.cols;
 
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			
-			int count=0;
+		if (uf==NULL){
+			flag.Create(rows, cols);
+			count.Create(rows, cols, true);
+			sum.Create(rows, cols, true);
+			uf=new UnionFind(rows*cols+1);
+		}
 
-			int n=terrainSelectionPositions.size();
-			for (int ii=0;ii<n-1;++ii){
-				if (LineIntersectionExists(terrainSelectionPositions[ii].col, terrainSelectionPositions[ii].row, terrainSelectionPositions[ii+1].col, terrainSelectionPositions[ii+1].row, 0, 0, j, i)==true){
-					++count;
-				}
-			}
+		GetBackgroundMask2(img, flag, *uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
 
-			/*
-			for (int ii=0;ii<n;++ii){
-				if (terrainSelectionPositions[ii].row<=j && terrainSelectionPositions[ii].col<=i){
-					int dx1=terrainSelectionPositions[ii].col;
-					int dx2=i-terrainSelectionPositions[ii].col;
-					int dy1=terrainSelectionPositions[ii].row;
-					int dy2=j-terrainSelectionPositions[ii].row;
-
-					if (dx1*dy2==dy1*dx2){
-						--count;
+		ParallelForRows(0, rows, [&](int begin, int end){
+			for (int i=begin;i<end;++i){
+				for (int j=0;j<cols;++j){
+					if (flag[i][j]==1){
+						const uchar *point=img.data+3*(i*cols+j);
+						Vec3i &s=sum[i][j];
+						++count[i][j];
+						s[0]+=point[0];
+						s[1]+=point[1];
+						s[2]+=point[2];
 					}
-
 				}
 			}
-			*/
-
-			if (count%2!=0){
-				terrainMask[i][j]=1;
-			}
-
-		}
+		});
 	}
 
-	UnionFind *uf=new UnionFind(rows*cols+1);
-	CleanUpSelectedTerrain(&terrainMask, uf, rows, cols);
-	delete uf;
-
-	/*
-	int move[4][2]={
-				{-1, 0},
-				{0, 1},
-				{1, 0},
-				{0, -1}
-			};
-	queue<Position> q1;
-	q1.push(Position(0, 0));
-	terrainMask[0][0]=2;
-	while(q1.empty()==false){
-		int row=q1.front().row;
-		int col=q1.front().col;
-		q1.pop();
-
-		for (int i=0;i<4;++i){
-			int row2=row+move[i][0];
-			int col2=col+move[i][1];
-			if (row2>=0 && row2<rows && col2>0 && col2<cols && terrainMask[row2][col2]==0){
-				terrainMask[row2][col2]=2;
-				q1.push(Position(row2, col2));
+	//the sums are integers, so the order in which the frames were added does not matter
+	void Merge(const BackgroundAccumulator &other){
+		if (other.uf==NULL){
+			return;
+		}
+		if (uf==NULL){
+			flag.Create(other.flag.rows, other.flag.cols);
+			count.Create(other.count.rows, other.count.cols, true);
+			sum.Create(other.sum.rows, other.sum.cols, true);
+			uf=new UnionFind(other.uf->n);
+		}
+		for (int i=0;i<count.rows;++i){
+			for (int j=0;j<count.cols;++j){
+				count[i][j]+=other.count[i][j];
+				sum[i][j]+=other.sum[i][j];
 			}
 		}
 	}
 
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (terrainMask[i][j]==0){
-				terrainMask[i][j]=1;
-			} else if (terrainMask[i][j]==2){
-				terrainMask[i][j]=0;
+	//the same rounding as the conversion of the mean in double to CV_8U, background is empty if nothing was added
+	void GetBackground(Mat &background) const{
+		if (uf==NULL){
+			background=Mat();
+			return;
+		}
+		int rows=count.rows;
+		int cols=count.cols;
+		background=Mat::zeros(rows, cols, CV_8UC3);
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				int c=count[i][j];
+				if (c!=0){
+					uchar *point=background.data+3*(i*cols+j);
+					const Vec3i &s=sum[i][j];
+					point[0]=saturate_cast<uchar>(s[0]/(double)c);
+					point[1]=saturate_cast<uchar>(s[1]/(double)c);
+					point[2]=saturate_cast<uchar>(s[2]/(double)c);
+				}
 			}
 		}
 	}
-	*/
+};
 
-	destroyWindow(terrainSelectionWindowName);
+void GetBackground(VideoCapture video, Mat &background, int skip=0, int step=30, int take=30, double greenFactor=1.0, double redFactor=1.0, double greenFactor2=1.3, double previousSizeThreshold=2.0, bool yAligned=false, int sampling=SAMPLE_GRAB){
 
-	return terrainMask;
-}
+	Plane<uchar> flag;
+	Plane<ushort> count;
+	UnionFind *uf=NULL;
+	
+	int rows=0;
+	int cols=0;
+	background=Mat(0, 0, CV_64FC3);
 
-int **SelectTerrainSmartly(const char *videoPath, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/terrains/", bool write=false, double f=1.0){
-	char base[1025];
-	GetBase(videoPath, base);
-	char path[1025];
-	sprintf(path, "%s/%s_%d_%d_%d.png", backgroundsPath, base, skip, step, take);
+	int position=0;
+	for (int k=0;k<take;++k){
+		Mat img;
+		if (ReadSampledFrame(video, position, skip+k*step, img, sampling)==false){
+			break;
+		}
 
-	int rows=terrainSelectionImg.rows;
-	int cols=terrainSelectionImg.cols;
+		if (rows==0){
+			rows=img.rows;
+			cols=img.cols;
+			background=Mat::zeros(rows, cols, CV_64FC3);
+			flag.Create(rows, cols);
+			count.Create(rows, cols, true);
+			uf=new UnionFind(rows*cols+1);
+		}
 
-	FILE *input=fopen(path, "rb");
-	
-	int **terrainMask=NULL;
-	if (input==NULL){
-		VideoCapture video=VideoCapture(videoPath);
-		terrainMask=SelectTerrain(f);
-		if (write==true){
-			Mat img=Mat::zeros(rows, cols, CV_8UC1);
-			for (int i=0;i<rows;++i){
-				for (int j=0;j<cols;++j){
-					*(((uchar *)(img.data))+i*cols+j)=255*terrainMask[i][j];
+		GetBackgroundMask(img, flag, *uf, greenFactor, redFactor, greenFactor2, previousSizeThreshold, yAligned);
+
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				if (flag[i][j]==1){
+					++count[i][j];
+					*(((Vec3d *)(background.data))+i*cols+j)+=*(((Vec3b *)(img.data))+i*cols+j);
 				}
 			}
-			imwrite(path, img);
 		}
-	} else{
-		fclose(input);
-		Mat img=imread(path, 6);
-		terrainMask=GetIntMatrix(rows, cols, true);
+
+	}
+
+	if (rows!=0){
 		for (int i=0;i<rows;++i){
 			for (int j=0;j<cols;++j){
-				uchar value=*(((uchar *)(img.data))+i*cols+j);
-				if (value==0){
-					terrainMask[i][j]=0;
-				} else{
-					terrainMask[i][j]=1;
+				if (count[i][j]!=0){
+					*(((Vec3d *)(background.data))+i*cols+j)/=count[i][j];
 				}
 			}
 		}
+		background.convertTo(background, CV_8U);
 	}
 
-	return terrainMask;
-}
+	delete uf;
 
-int **SelectTerrainSmartly(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/terrains/", bool write=false, double f=1.0){
-	return SelectTerrainSmartly(videoPath, skip, step, take, backgroundsPath, write, f);
 }
 
-struct TrackingData{
-	struct DisposedComparison{
-		bool operator ()(const TrackingData *t1, const TrackingData *t2) const {
-			if (t1->lastFrame<t2->lastFrame){
-				return true;
-			}
-			if (t2->lastFrame<t1->lastFrame){
-				return false;
-			}
-			if (t1->id<t2->id){
-				return true;
-			}
-			if (t2->id<t1->id){
-				return false;
-			}
-			return t1<t2;
+//the frames skip, skip+step, ..., skip+(take-1)*step are used
+void GetBackground2(VideoCapture video, Mat &background, int skip=0, int step=30, int take=30, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false, int sampling=SAMPLE_GRAB){
+
+	BackgroundAccumulator accumulator;
+
+	int position=0;
+	for (int k=0;k<take;++k){
+		Mat img;
+		if (ReadSampledFrame(video, position, skip+k*step, img, sampling)==false){
+			break;
 		}
-	};
-	int id;
-	vector<Position> positions;
-	vector<BoundingBox> previous;
-	int lastFrame;
-	bool pushedOut;
-	TrackingData *pushedOutBy;
-	bool isTracked;
-	Vec3b meanColor;
-	Position meanPosition;
-	set<TrackingData*, DisposedComparison> pushedOutGroups;
-	int framesOutsideOfTerrain;
-	TrackingData(vector<Position> positions=vector<Position>(), vector<BoundingBox> previous=vector<BoundingBox>(), int lastFrame=-1, bool pushedOut=false, bool isTracked=true, int framesOutsideOfTerrain=0):positions(positions), previous(previous), lastFrame(lastFrame), pushedOut(pushedOut), isTracked(isTracked), id(createdGroupsCount++), framesOutsideOfTerrain(framesOutsideOfTerrain){
-		pushedOutBy=nullptr;
-		meanColor=Vec3b(0, 0, 0);
-		meanPosition=Position(-1, -1);
+		accumulator.Add(img, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
 	}
-	void RemovePushedOutBy(){
-		if (pushedOutBy!=nullptr){
-			auto found=pushedOutBy->pushedOutGroups.find(this);
-			if (found!=pushedOutBy->pushedOutGroups.end()){
-				pushedOutBy->pushedOutGroups.erase(found);
-			}
-		}
-		pushedOutBy=nullptr;
-		pushedOut=false;
+
+	accumulator.GetBackground(background);
+
+}
+
+//the same frames as GetBackground2 split into capturesCount consecutive ranges, every range is decoded by its own VideoCapture on its own thread,
+//each seeking to the start of its range and grabbing the frames in between
+void GetBackground2Parallel(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false, int capturesCount=4){
+
+	if (capturesCount>take){
+		capturesCount=take;
 	}
-	void SetPushedByOutBySmartly(TrackingData *pusher, bool copyPushedOutGroups=false){
-		RemovePushedOutBy();
-		pushedOutBy=pusher;
-		if (pusher!=nullptr){
-			pusher->pushedOutGroups.insert(this);
-			pushedOut=true;
-		} else{
-			pushedOut=false;
-		}
-		if (copyPushedOutGroups==true && pusher!=nullptr){
-			for (auto si=pushedOutGroups.cbegin();si!=pushedOutGroups.cend();++si){
-				(*si)->pushedOutBy=pusher;
-				pusher->pushedOutGroups.insert(*si);
+	if (capturesCount<1){
+		capturesCount=1;
+	}
+
+	vector<BackgroundAccumulator> accumulators(capturesCount);
+	vector<thread> threads;
+	for (int c=0;c<capturesCount;++c){
+		int first=(long long)take*c/capturesCount;
+		int last=(long long)take*(c+1)/capturesCount;
+		threads.push_back(thread([&, c, first, last](){
+			VideoCapture video=VideoCapture(videoPath);
+			if (video.isOpened()==false){
+				return;
 			}
-			pushedOutGroups.clear();
-		}
+			int position=0;
+			for (int k=first;k<last;++k){
+				Mat img;
+				if (ReadSampledFrame(video, position, skip+k*step, img, k==first && first>0 ? SAMPLE_SEEK : SAMPLE_GRAB)==false){
+					break;
+				}
+				accumulators[c].Add(img, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+			}
+			video.release();
+		}));
 	}
-	void ClearPushedOutGropusSmartly(){
-		for (auto si=pushedOutGroups.cbegin();si!=pushedOutGroups.cend();++si){
-			(*si)->pushedOut=false;
-			(*si)->pushedOutBy=nullptr;
-		}
-		pushedOutGroups.clear();
+	for (int c=0;c<capturesCount;++c){
+		threads[c].join();
 	}
-	void CalculateMeanColor(const Mat &img){
-		int rows=img.rows;
-		int cols=img.cols;
 
-		int count=0;
-		Vec3d mean(0.0, 0.0, 0.0);
-		for (int i=0;i<positions.size();++i){
-			int r=positions[i].row;
-			int c=positions[i].col;
-			if (r>=0 && r<rows && c>=0 && c<cols){
-				mean+=*(((Vec3b *)(img.data))+r*cols+c);
-				++count;
-			}
-		}
-		if (count==0){
-			meanColor=Vec3b(0, 0, 0);
-		} else{
-			meanColor=mean/count;
-		}
-	}
-	void CalculateMeanPosition(){
-		
-		int n=positions.size();
-		if (n==0){
-			meanPosition=Position(-1, -1);
-			return;
-		}
-		int row=0;
-		int col=0;
-		for (int i=0;i<n;++i){
-			row+=positions[i].row;
-			col+=positions[i].col;
-		}
-		meanPosition=Position(row/n, col/n);
+	for (int c=1;c<capturesCount;++c){
+		accumulators[0].Merge(accumulators[c]);
 	}
-private:
-	static int createdGroupsCount;
-};
+	accumulators[0].GetBackground(background);
 
-int TrackingData::createdGroupsCount=0;
+}
 
-TrackingData*** GetTrackingDataPointerMatrix(int rows, int cols, bool setToNull=false){
+void inline MinMaxRowColWithCount(int &minRow, int &maxRow, int &minCol, int &maxCol, const int i, const int j){
+	if (minRow==-1 || i<minRow){
+		minRow=i;
+	}
 	
-	TrackingData ***matrix=new TrackingData**[rows];
-	for (int i=0;i<rows;++i){
-		matrix[i]=new TrackingData*[cols];
-		if (setToNull==true){
-			for (int j=0;j<cols;++j){
-				matrix[i][j]=nullptr;
-			}
-		}
+	if (maxRow==-1 || maxRow<i){
+		maxRow=i;
 	}
 
-	return matrix;
-}
+	if (minCol==-1 || j<minCol){
+		minCol=j;
+	}
 
-void FreeTrackingDataPointerMatrix(TrackingData ***matrix, int rows){
-	
-	for (int i=0;i<rows;++i){
-		delete[] matrix[i];
+	if (maxCol==-1 || maxCol<j){
+		maxCol=j;
 	}
 
-	delete[] matrix;
 }
 
-int move8[8][2]={
-				{-1, 0},
-				{-1, 1},
-				{0, 1},
-				{1, 1},
-				{1, 0},
-				{1, -1},
-				{0, -1},
-				{-1, -1}
-			};
+void inline MinMaxRowCol(int &minRow, int &maxRow, int &minCol, int &maxCol, const int i, const int j, const int count=1){
+	if (count!=0){
+		MinMaxRowColWithCount(minRow, maxRow, minCol, maxCol, i, j);
+	}
+}
 
-void Spread(const vector<Position> &group, const Mat &img, const Mat &background, int **terrainMask, double greenThreshold, int **flag, int **spreadData, int **visited, int spreadCount, int visitCount, Position &seedPosition, bool insideTerrain=true){
-	
-	int rows=img.rows;
-	int cols=img.cols;
+//adds the bounds found in one tile to the bounds of the whole image, the order of the tiles does not matter
+void inline MergeMinMaxRowCol(int &minRow, int &maxRow, int &minCol, int &maxCol, const int tileMinRow, const int tileMaxRow, const int tileMinCol, const int tileMaxCol){
+	if (tileMinRow!=-1){
+		MinMaxRowColWithCount(minRow, maxRow, minCol, maxCol, tileMinRow, tileMinCol);
+		MinMaxRowColWithCount(minRow, maxRow, minCol, maxCol, tileMaxRow, tileMaxCol);
+	}
+}
 
-	for (int i=0;i<group.size();++i){
-		Vec3b backgroundPoint=*(((Vec3b *)(background.data))+group[i].row*cols+group[i].col);
-		int row=group[i].row;
-		int col=group[i].col;
-		if ((insideTerrain==false || terrainMask==NULL || terrainMask[row][col]!=0) && backgroundPoint[0]+backgroundPoint[1]+backgroundPoint[2]>0 && visited[row][col]!=visitCount){
-			const Vec3b point=*(((Vec3b *)(img.data))+group[i].row*cols+group[i].col);
-				
-			double d=0.0;
-			for (int k=0;k<3;++k){
-				double dd=point[k]-backgroundPoint[k];
-				dd*=dd;
-				d+=dd;
-			}
-			if (point[1]<greenThreshold){
-				double dd=greenThreshold-point[1];
-				dd*=dd;
-				d+=dd;
-			}
-			flag[group[i].row][group[i].col]=spreadCount;
-			spreadData[group[i].row][group[i].col]=d;
-		}
+//the pixel (i, j) is moved to (i+dy, j+dx) and the uncovered pixels are set to fill, mat gets new memory,
+//so the Mats sharing the old one (e.g. the published backgrounds) are not changed
+void TranslateMat(Mat &mat, int dx, int dy, const Scalar &fill=Scalar()){
+	Mat moved(mat.rows, mat.cols, mat.type(), fill);
+	int width=mat.cols-abs(dx);
+	int height=mat.rows-abs(dy);
+	if (0<width && 0<height){
+		Mat target=moved(Rect(max(0, dx), max(0, dy), width, height));
+		mat(Rect(max(0, -dx), max(0, -dy), width, height)).copyTo(target);
+	}
+	mat=moved;
+}
+
+//the bounds of the pixels moved by TranslateMat, all -1 if none of them stays inside of the image
+void TranslateMinMaxRowCol(int &minRow, int &maxRow, int &minCol, int &maxCol, int dx, int dy, int rows, int cols){
+	if (minRow==-1){
+		return;
+	}
+	minRow=max(0, minRow+dy);
+	maxRow=min(rows-1, maxRow+dy);
+	minCol=max(0, minCol+dx);
+	maxCol=min(cols-1, maxCol+dx);
+	if (maxRow<minRow || maxCol<minCol){
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
 	}
+}
 
-	double md=-1;
-	int mdIdx=0;
-	for (int i=0;i<group.size();++i){
-		if ((insideTerrain==false || terrainMask==NULL || terrainMask[group[i].row][group[i].col]!=0) && flag[group[i].row][group[i].col]==spreadCount){
-			Vec3b point=*(((Vec3b *)(img.data))+group[i].row*cols+group[i].col);
-			double d=spreadData[group[i].row][group[i].col];
-			for (int k=0;k<8;++k){
-				int nr=group[i].row+move8[k][0];
-				int nc=group[i].col+move8[k][1];
-				if (nr>=0 && nr<rows && nc>=0 && nc<cols && flag[nr][nc]==spreadCount){
-					d+=spreadData[nr][nc];
-				}
-			}
-			if (md<d || md==-1){
-				md=d;
-				mdIdx=i;
-			}
+//the bounds of the pixels that are not black, i.e. that have a background, all -1 if there are none
+void GetBackgroundBounds(const Mat &background, int &minRow, int &maxRow, int &minCol, int &maxCol){
+	minRow=-1;
+	maxRow=-1;
+	minCol=-1;
+	maxCol=-1;
+	for (int i=0;i<background.rows;++i){
+		const Vec3b *row=background.ptr<Vec3b>(i);
+		for (int j=0;j<background.cols;++j){
+			MinMaxRowCol(minRow, maxRow, minCol, maxCol, i, j, row[j][0]+row[j][1]+row[j][2]);
 		}
 	}
-	
-	seedPosition=group[mdIdx];
-
 }
 
-bool Visit(TrackingData *trackedGroup, const Mat &img, const Mat &background, int **terrainMask, double greenThreshold, int **visited, int visitCount, const Position &seedPosition, int scanningAttempts, double threshold, int minimumGroupSize, TrackingData ***owners=nullptr, bool insideTerrain=true, int maximumWidth=-1, int maximumHeight=-1, double remainingFactor=1.2){
-	
-	bool takeIt=false;
-	
-	int rows=img.rows;
-	int cols=img.cols;
-	
-	int currentScanningAttempts=scanningAttempts;
-	double currentThreshold=threshold;
+//the common interface of the background engines, Test97 and the headless tracker only use this
+struct BackgroundModel{
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	//the bounds of the pixels that have a background
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
 
-	while(currentScanningAttempts-->0){
-				
-		int remaining=remainingFactor*trackedGroup->positions.size();
+	BackgroundModel(double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075):redLower(redLower), redUpper(redUpper), greenLower(greenLower), greenUpper(greenUpper), minRow(-1), maxRow(-1), minCol(-1), maxCol(-1){}
 
-		vector<Position> newPositions;
+	virtual ~BackgroundModel(){}
 
-		int minRow=seedPosition.row;
-		int maxRow=seedPosition.row;
-		int minCol=seedPosition.col;
-		int maxCol=seedPosition.col;
+	virtual void Add(Mat img)=0;
 
-		queue<Position> q1;
-		TrackingData *touchedOwner=nullptr;
-		bool touchedOther=false;
-		if (visited[seedPosition.row][seedPosition.col]==visitCount){
-			touchedOther=true;
-			if (owners!=nullptr){
-				touchedOwner=owners[seedPosition.row][seedPosition.col];
-			}
-		} else{
-			visited[seedPosition.row][seedPosition.col]=visitCount;
-			newPositions.push_back(seedPosition);
-			q1.push(seedPosition);
-		}
-		while(q1.empty()==false && remaining>0){
-			Position p=q1.front();
-			q1.pop();
+	virtual void Clear()=0;
 
-			for (int i=0;i<8;++i){
-				int row=p.row+move8[i][0];
-				int col=p.col+move8[i][1];
-				if (row<0 || col<0 || row>rows-1 || col>cols-1){
-					continue;
-				}
-				if (visited[row][col]==visitCount){
-					if (row!=seedPosition.row && col!=seedPosition.col){
-						touchedOther=true;
-						if (owners!=nullptr){
-							touchedOwner=owners[row][col];
-						}
-					}
-					continue;
-				}
-					
-				Vec3b point=*(((Vec3b *)(img.data))+row*cols+col);
-				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+row*cols+col);
-					
-				double d=0.0;
-				for (int k=0;k<3;++k){
-					double dd=point[k]-backgroundPoint[k];
-					dd*=dd;
-					d+=dd;
-				}
-				if (point[1]<greenThreshold){
-					double dd=greenThreshold-point[1];
-					dd*=dd;
-					dd+=5;
-					d+=dd;
-				}
-				if ((insideTerrain==false || terrainMask==NULL || terrainMask[row][col]!=0) && currentThreshold<d && backgroundPoint[0]+backgroundPoint[1]+backgroundPoint[2]>0){
-					int currentMinRow=minRow;
-					int currentMaxRow=maxRow;
-					int currentMinCol=minCol;
-					int currentMaxCol=maxCol;
+	//the backgrounds returned before are never changed, the result is a new Mat or one returned before whose content is the same
+	virtual void GetBackground(Mat &result)=0;
 
-					MinMaxRowCol(currentMinRow, currentMaxRow, currentMinCol, currentMaxCol, row, col);
-					if ((maximumHeight==-1 || currentMaxRow-currentMinRow+1<=maximumHeight) && (maximumWidth==-1 || currentMaxCol-currentMinCol+1<=maximumWidth)){
-						minRow=currentMinRow;
-						maxRow=currentMaxRow;
-						minCol=currentMinCol;
-						maxCol=currentMaxCol;
-						--remaining;
-						visited[row][col]=visitCount;
-						newPositions.push_back(Position(row, col));
-						q1.push(Position(row, col));
-					}
-				}
-				
-			}
+	//true once the model holds as many frames as it was built for
+	virtual bool IsFull() const=0;
 
-		}
+	//the engines that return true are given every frame, the others only every step frames
+	virtual bool UpdatesEveryFrame() const{
+		return false;
+	}
 
-		if (newPositions.size()>=minimumGroupSize){
-			vector<Position> &positions=trackedGroup->positions;
-			//positions.clear();
-			positions=newPositions;
-			takeIt=true;
-			
-			trackedGroup->pushedOut=false;
-			trackedGroup->SetPushedByOutBySmartly(nullptr);
+	virtual void SetChromaticityBounds(double redLower, double redUpper, double greenLower, double greenUpper){
+		this->redLower=redLower;
+		this->redUpper=redUpper;
+		this->greenLower=greenLower;
+		this->greenUpper=greenUpper;
+	}
 
-			if (owners!=nullptr){
-				for (int i=0;i<positions.size();++i){
-					owners[positions[i].row][positions[i].col]=trackedGroup;
-				}
-			}
-			if (currentScanningAttempts<scanningAttempts-1){
-				//rescanned=true;
-				//printf("%d %d Success after rescanning (%d)!\n", framesCount, gi, scanningAttempts-1-currentScanningAttempts);
-			} else{
-				//rescanned=false;
-			}
+	//the camera moved by (dx, dy) pixels, the model is moved with it so it does not have to be rebuilt,
+	//false if the engine can not do it and has to be cleared instead
+	virtual bool Translate(int dx, int dy){
+		return false;
+	}
 
-			break;
-		} else{
-			for (int i=0;i<newPositions.size();++i){
-				visited[newPositions[i].row][newPositions[i].col]=visitCount-1;
-			}
-			trackedGroup->pushedOut=touchedOther;
-			
-			if (touchedOther==false){
-				currentThreshold*=0.8;
-			} else{
+	//everything the model needs to continue exactly where it was, false if the engine has no checkpoints
+	virtual bool Save(StateWriter &writer){
+		return false;
+	}
 
-				trackedGroup->SetPushedByOutBySmartly(touchedOwner);
-				break;
-			}
+	//false if the state could not be read or was saved by a model built differently, the model has to be cleared then
+	virtual bool Load(StateReader &reader){
+		return false;
+	}
+
+	void SaveBounds(StateWriter &writer) const{
+		writer.WriteValue(redLower);
+		writer.WriteValue(redUpper);
+		writer.WriteValue(greenLower);
+		writer.WriteValue(greenUpper);
+		writer.WriteValue(minRow);
+		writer.WriteValue(maxRow);
+		writer.WriteValue(minCol);
+		writer.WriteValue(maxCol);
+	}
+
+	void LoadBounds(StateReader &reader){
+		reader.ReadValue(redLower);
+		reader.ReadValue(redUpper);
+		reader.ReadValue(greenLower);
+		reader.ReadValue(greenUpper);
+		reader.ReadValue(minRow);
+		reader.ReadValue(maxRow);
+		reader.ReadValue(minCol);
+		reader.ReadValue(maxCol);
+	}
+};
+
+#if CV_VERSION_MAJOR>=4
+typedef AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+//a buffer of BackgroundFetcher5 with the number of Mats handed out for it that were not released yet
+struct SharedBackground{
+	Mat background;
+	atomic<int> holders;
+
+	SharedBackground(int rows, int cols):background(rows, cols, CV_8UC3), holders(0){}
+};
+
+//the Mats handed out by BackgroundFetcher5 share the memory of its buffers and release them through this allocator, the same way
+//the Python bindings of OpenCV wrap numpy arrays; the last release of a handed out Mat decrements the holders of its buffer
+//and the buffer itself is kept alive by the Mat, so it may outlive the fetcher
+struct SharedBackgroundAllocator:MatAllocator{
+	//the Mats created by the holders of a handed out Mat get memory of their own
+	UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step, MatAccessFlag flags, UMatUsageFlags usageFlags) const{
+		return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+	}
+
+	bool allocate(UMatData *u, MatAccessFlag accessFlags, UMatUsageFlags usageFlags) const{
+		return Mat::getStdAllocator()->allocate(u, accessFlags, usageFlags);
+	}
+
+	void deallocate(UMatData *u) const{
+		if (u==NULL || u->refcount!=0 || u->urefcount!=0){
+			return;
 		}
+		shared_ptr<SharedBackground> *shared=(shared_ptr<SharedBackground> *)u->userdata;
+		//the holder is done with the memory before the fetcher may see the buffer as free
+		(*shared)->holders.fetch_sub(1, memory_order_release);
+		delete shared;
+		delete u;
+	}
+
+	//a new Mat sharing the memory of the buffer, counted as a holder until it and all of its copies are released
+	Mat HandOut(const shared_ptr<SharedBackground> &shared) const{
+		const Mat &background=shared->background;
+		Mat result(background.rows, background.cols, CV_8UC3, background.data);
+		shared->holders.fetch_add(1, memory_order_relaxed);
+		UMatData *u=new UMatData(this);
+		u->data=u->origdata=background.data;
+		u->size=(size_t)background.rows*background.cols*3;
+		u->userdata=new shared_ptr<SharedBackground>(shared);
+		result.u=u;
+		result.addref();
+		result.allocator=(MatAllocator *)this;
+		return result;
 	}
+};
 
-	return takeIt;
+//never destroyed, the handed out Mats may be released after main returns
+const SharedBackgroundAllocator &GetSharedBackgroundAllocator(){
+	static SharedBackgroundAllocator *allocator=new SharedBackgroundAllocator();
+	return *allocator;
 }
 
-void GetWiderAreaPositions(TrackingData *trackedGroup, vector<Position> &positions, int rows, int cols, int previousLookSize=15, double enlargementFactor=3.0){
-	BoundingBox boundingBox=GetBoundingBox(trackedGroup->positions);
-	int dx=boundingBox.maxCol-boundingBox.minCol+1;
-	int dy=boundingBox.maxRow-boundingBox.minRow+1;
+struct BackgroundFetcher5:BackgroundModel{
+	//the pixels are summed and the background is rebuilt in tiles of this size, only the tiles whose sums changed are rebuilt
+	static const int tileRows=16;
+	static const int tileCols=64;
 
-	int back=trackedGroup->previous.size()-previousLookSize;
-	if (back<0){
-		back=0;
-	}
-	
-	//printf("%d %d      ", dx, dy);
-	for (int i=back;i<trackedGroup->previous.size();++i){
-		BoundingBox previous=trackedGroup->previous[i];
-		int cdx=previous.maxCol-previous.minCol+1;
-		int cdy=previous.maxRow-previous.minRow+1;
-		if (dx<cdx){
-			dx=cdx;
+	Mat *images;
+	//the grass flags of the frames in the ring, count is the number of frames in the ring that have the pixel set
+	BitPlane *flags;
+	//the grass mask of the frame being added before it is packed
+	Plane<uchar> grass;
+	Plane<ushort> count;
+	Plane<Vec3i> sum;
+	//the value of addedCount when the pixel was grass for the last time, addedCount-lastGrass is the number of frames it was not
+	Plane<int> lastGrass;
+	int addedCount;
+	int n;
+	int size;
+	int minimumSize;
+	int start;
+	int newPosition;
+	int untouchedTTL;
+	//the rounded means of the sums, rebuilt tile by tile
+	Mat background;
+	vector<uchar> dirty;
+	//incremented every time the tile is rebuilt
+	vector<unsigned> tileVersions;
+	//the buffers handed out by GetBackground with the versions of their tiles, a buffer none of whose handed out Mats is held
+	//any more is reused and only its outdated tiles are copied into it
+	struct PublishedBuffer{
+		shared_ptr<SharedBackground> shared;
+		vector<unsigned> tileVersions;
+	};
+	static const int publishedBuffersCount=3;
+	vector<PublishedBuffer> publishedBuffers;
+	int lastPublished;
+	int tilesPerRow;
+	int rows;
+	UnionFind *uf;
+	double previousSizeThreshold;
+	bool yAligned;
+	
+	BackgroundFetcher5(int n, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=true, int minimumSize=3, int untouchedTTL=30):BackgroundModel(redLower, redUpper, greenLower, greenUpper), n(n), previousSizeThreshold(previousSizeThreshold), yAligned(yAligned), minimumSize(minimumSize), untouchedTTL(untouchedTTL){
+		images=new Mat[n];
+		uf=NULL;
+		size=0;
+		start=0;
+		newPosition=0;
+		addedCount=0;
+		tilesPerRow=0;
+		rows=0;
+		lastPublished=-1;
+		flags=new BitPlane[n];
+	}
+
+	virtual ~BackgroundFetcher5(){
+		for (int i=0;i<n;++i){
+			images[i].release();
 		}
-		if (dy<cdy){
-			dy=cdy;
+		delete[] images;
+		delete[] flags;
+		if (uf!=NULL){
+			delete uf;
 		}
 	}
-	
-	//printf("%d %d\n", dx, dy);
 
-	int startRow=boundingBox.minRow-dx*enlargementFactor;
-	if (startRow<0){
-		startRow=0;
-	}
-	int endRow=boundingBox.maxRow+dx*enlargementFactor;
-	if (endRow>=rows){
-		endRow=rows-1;
-	}
-	int startCol=boundingBox.minCol-dy*enlargementFactor;
-	if (startCol<0){
-		startCol=0;
+	bool IsFull() const{
+		return size==n;
 	}
-	int endCol=boundingBox.maxCol+dy*enlargementFactor;
-	if (endCol>=cols){
-		endCol=cols-1;
+
+	int TileRowsCount() const{
+		return (sum.rows+tileRows-1)/tileRows;
 	}
-	for (int row=startRow;row<=endRow;++row){
-		for (int col=startCol;col<=endCol;++col){
-			positions.push_back(Position(row, col));
+
+	//the mean of count values rounded the same way as the conversion of a double to uchar, i.e. half to even
+	static inline uchar RoundedMean(int sum, int count){
+		int q=sum/count;
+		int r2=2*(sum-q*count);
+		if (count<r2 || (r2==count && (q&1)==1)){
+			++q;
 		}
+		return q;
 	}
-				
-}
-
-void AddMissingPrevious(TrackingData *tracked, BoundingBox start, BoundingBox end, int n){
 	
-	for (int i=0;i<n;++i){
-		BoundingBox boundingBox=BoundingBox(((n-i-1)*start.minRow+(i+1)*end.minRow)/n, ((n-i-1)*start.maxRow+(i+1)*end.maxRow)/n, ((n-i-1)*start.minCol+(i+1)*end.minCol)/n, ((n-i-1)*start.maxCol+(i+1)*end.maxCol)/n);
-		boundingBox.type=BoundingBoxType::FILLED;
-		tracked->previous.push_back(boundingBox);
+	void Clear(){
+		if (size==0){
+			return;
+		}
+
+		size=0;
+		start=0;
+		newPosition=0;
+		count.SetToZero();
+		sum.SetToZero();
+		ParallelForRows(0, lastGrass.rows, [&](int begin, int end){
+			for (int i=begin;i<end;++i){
+				for (int j=0;j<lastGrass.cols;++j){
+					lastGrass[i][j]=addedCount;
+				}
+			}
+		});
+		fill(dirty.begin(), dirty.end(), 1);
+		
 	}
 
-}
+	//a grass pixel of the oldest frame that rarely is grass and was not for untouchedTTL frames is moved into the newest frame instead of being removed,
+	//the newest frame can not have it as grass then, so no other frame has to be searched
+	void Remove(){
+		if (size==0){
+			return;
+		}
 
-void DrawTrajectories(Mat &img2, const vector<TrackingData*> &trackedGroups, int trajectoryDrawingLength, Scalar color=Scalar(0, 0, 255)){
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
 
-	for (int gi=0;gi<trackedGroups.size();++gi){
-		TrackingData *trackedGroup=trackedGroups[gi];
-		int stop=trackedGroup->previous.size()-trajectoryDrawingLength;
-		if (stop<0){
-			stop=0;
+		Mat &img=images[start];
+		int rows=img.rows;
+		int cols=img.cols;
+		int newest=(newPosition+n-1)%n;
+		mutex boundsLock;
+		ParallelForRows(0, TileRowsCount(), [&](int begin, int end){
+			int tileMinRow=-1;
+			int tileMaxRow=-1;
+			int tileMinCol=-1;
+			int tileMaxCol=-1;
+			for (int i=begin*tileRows;i<end*tileRows && i<rows;++i){
+				const uint64 *words=flags[start][i];
+				for (int w=0;w<flags[start].wordsPerRow;++w){
+					for (uint64 bits=words[w];bits!=0;bits&=bits-1){
+						int j=w*64+TrailingZeros64(bits);
+						if (count[i][j]<=minimumSize && untouchedTTL<addedCount-lastGrass[i][j] && newest!=start && flags[newest].Get(i, j)==false){
+							*(((Vec3b *)(images[newest].data))+i*cols+j)=*(((Vec3b *)(img.data))+i*cols+j);
+							flags[newest].Set(i, j);
+						} else{
+							const uchar *point=img.data+3*(i*cols+j);
+							Vec3i &s=sum[i][j];
+							--count[i][j];
+							s[0]-=point[0];
+							s[1]-=point[1];
+							s[2]-=point[2];
+							dirty[i/tileRows*tilesPerRow+j/tileCols]=1;
+						}
+					}
+				}
+				for (int j=0;j<cols;++j){
+					MinMaxRowCol(tileMinRow, tileMaxRow, tileMinCol, tileMaxCol, i, j, count[i][j]);
+				}
+			}
+			lock_guard<mutex> guard(boundsLock);
+			MergeMinMaxRowCol(minRow, maxRow, minCol, maxCol, tileMinRow, tileMaxRow, tileMinCol, tileMaxCol);
+		}, 1);
+		img.release();
+		start=(start+1)%n;
+		--size;
+	}
+
+	void Add(Mat img){
+		if (size==n){
+			Remove();
 		}
 		
-		for (int i=trackedGroup->previous.size()-1;i>stop;--i){
-			line(img2, Point((trackedGroup->previous[i].maxCol+trackedGroup->previous[i].minCol)/2, trackedGroup->previous[i].maxRow), Point((trackedGroup->previous[i-1].maxCol+trackedGroup->previous[i-1].minCol)/2, trackedGroup->previous[i-1].maxRow), color);
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
+
+		++size;
+		++addedCount;
+		img.copyTo(images[newPosition]);
+		
+		rows=img.rows;
+		int cols=img.cols;
+		
+		if (uf==NULL){
+			uf=new UnionFind(rows*cols+1);
 		}
+		if (flags[newPosition].Empty()==true){
+			flags[newPosition].Create(img.rows, img.cols);
+		}
+		if (sum.Empty()==true){
+			grass.Create(img.rows, img.cols);
+			count.Create(img.rows, img.cols, true);
+			sum.Create(img.rows, img.cols, true);
+			lastGrass.Create(img.rows, img.cols, true);
+			background=Mat::zeros(img.rows, img.cols, CV_8UC3);
+			tilesPerRow=(cols+tileCols-1)/tileCols;
+			dirty.assign(TileRowsCount()*tilesPerRow, 0);
+			tileVersions.assign(dirty.size(), 0);
+			publishedBuffers.clear();
+			lastPublished=-1;
+		}
+		
+		GetBackgroundMask2(images[newPosition], grass, *uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+		BitPlane &flag=flags[newPosition];
+		mutex boundsLock;
+		ParallelForRows(0, TileRowsCount(), [&](int begin, int end){
+			int tileMinRow=-1;
+			int tileMaxRow=-1;
+			int tileMinCol=-1;
+			int tileMaxCol=-1;
+			for (int i=begin*tileRows;i<end*tileRows && i<rows;++i){
+				flag.SetRow(i, grass[i]);
+				const uint64 *words=flag[i];
+				for (int w=0;w<flag.wordsPerRow;++w){
+					for (uint64 bits=words[w];bits!=0;bits&=bits-1){
+						int j=w*64+TrailingZeros64(bits);
+						const uchar *point=img.data+3*(i*cols+j);
+						Vec3i &s=sum[i][j];
+						++count[i][j];
+						lastGrass[i][j]=addedCount;
+						s[0]+=point[0];
+						s[1]+=point[1];
+						s[2]+=point[2];
+						dirty[i/tileRows*tilesPerRow+j/tileCols]=1;
+					}
+				}
+				for (int j=0;j<cols;++j){
+					MinMaxRowCol(tileMinRow, tileMaxRow, tileMinCol, tileMaxCol, i, j, count[i][j]);
+				}
+			}
+			lock_guard<mutex> guard(boundsLock);
+			MergeMinMaxRowCol(minRow, maxRow, minCol, maxCol, tileMinRow, tileMaxRow, tileMinCol, tileMaxCol);
+		}, 1);
+		newPosition=(newPosition+1)%n;
 	}
-
-}
-
-void ReconnectGroups(TrackingData *add, TrackingData *newlyFoundGroup, const Mat &img, int framesCount, TrackingData *takePrevious=nullptr){
 	
-	//AddMissingPrevious(add, add->previous[add->previous.size()-1], GetBoundingBox(newlyFoundGroup->positions), framesCount-add->lastFrame);
-	if (takePrevious!=nullptr){
-		for (int j=takePrevious->previous.size()-framesCount+add->lastFrame+1;j<takePrevious->previous.size();++j){
-			BoundingBox boundingBox=takePrevious->previous[j];
-			boundingBox.type=BoundingBoxType::FILLED;
-			add->previous.push_back(boundingBox);
+	//only the dirty tiles are rebuilt and only the tiles that changed since a published buffer was filled are copied into it,
+	//a buffer somebody still holds is never written to, so the previously returned backgrounds stay valid
+	void GetBackground(Mat &result){
+		if (sum.Empty()==true){
+			return;
 		}
-	} else{
-		if (add->previous.size()>0){
-			AddMissingPrevious(add, add->previous[add->previous.size()-1], GetBoundingBox(newlyFoundGroup->positions), framesCount-add->lastFrame-1);
+		int rows=sum.rows;
+		int cols=sum.cols;
+		ParallelForRows(0, TileRowsCount(), [&](int begin, int end){
+			for (int ti=begin;ti<end;++ti){
+				for (int tj=0;tj<tilesPerRow;++tj){
+					uchar &tileDirty=dirty[ti*tilesPerRow+tj];
+					if (tileDirty==0){
+						continue;
+					}
+					tileDirty=0;
+					++tileVersions[ti*tilesPerRow+tj];
+					BuildBackgroundTile(ti*tileRows, min((ti+1)*tileRows, rows)-1, tj*tileCols, min((tj+1)*tileCols, cols)-1);
+				}
+			}
+		}, 1);
+
+		const SharedBackgroundAllocator &allocator=GetSharedBackgroundAllocator();
+		if (lastPublished!=-1 && publishedBuffers[lastPublished].tileVersions==tileVersions){
+			result=allocator.HandOut(publishedBuffers[lastPublished].shared);
+			return;
 		}
-	}
 
-	add->isTracked=true;
-	add->pushedOut=false;
-	add->SetPushedByOutBySmartly(nullptr);
-	add->lastFrame=framesCount;
-	add->positions=newlyFoundGroup->positions;
-	add->CalculateMeanColor(img);
-	add->CalculateMeanPosition();
+		//only this thread hands out Mats, so a buffer without holders stays free while it is written; result may be one of the holders
+		int target=-1;
+		for (int k=0;k<publishedBuffers.size() && target==-1;++k){
+			const shared_ptr<SharedBackground> &shared=publishedBuffers[k].shared;
+			if (shared==nullptr || shared->holders.load(memory_order_acquire)==0){
+				target=k;
+			}
+		}
+		if (target==-1){
+			if (publishedBuffers.size()<publishedBuffersCount){
+				publishedBuffers.push_back(PublishedBuffer());
+				target=publishedBuffers.size()-1;
+			} else{
+				//every buffer is held, the oldest one is left to its holders and replaced by a new one
+				target=(lastPublished+1)%publishedBuffersCount;
+				publishedBuffers[target]=PublishedBuffer();
+			}
+		}
 
-	add->ClearPushedOutGropusSmartly();
-	
-}
+		PublishedBuffer &buffer=publishedBuffers[target];
+		if (buffer.shared==nullptr || buffer.shared->background.rows!=rows || buffer.shared->background.cols!=cols){
+			buffer.shared=make_shared<SharedBackground>(rows, cols);
+			//every tile is copied into a new buffer
+			buffer.tileVersions.resize(tileVersions.size());
+			for (int k=0;k<tileVersions.size();++k){
+				buffer.tileVersions[k]=tileVersions[k]+1;
+			}
+		}
+		ParallelForRows(0, TileRowsCount(), [&](int begin, int end){
+			for (int ti=begin;ti<end;++ti){
+				int tileMinRow=ti*tileRows;
+				int tileMaxRow=min((ti+1)*tileRows, rows)-1;
+				for (int tj=0;tj<tilesPerRow;++tj){
+					int index=ti*tilesPerRow+tj;
+					if (buffer.tileVersions[index]==tileVersions[index]){
+						continue;
+					}
+					buffer.tileVersions[index]=tileVersions[index];
+					int tileMinCol=tj*tileCols;
+					int bytes=3*(min((tj+1)*tileCols, cols)-tileMinCol);
+					for (int i=tileMinRow;i<=tileMaxRow;++i){
+						memcpy(buffer.shared->background.data+3*(i*cols+tileMinCol), background.data+3*(i*cols+tileMinCol), bytes);
+					}
+				}
+			}
+		}, 1);
+		lastPublished=target;
+		result=allocator.HandOut(buffer.shared);
+	}
 
-int CountPositionsInsideTerrain(const vector<Position> &positions, const Mat &terrain){
-	int count=0;
+	//rebuilds the background inside of the rectangle from the sums and the counts
+	virtual void BuildBackgroundTile(int minRow, int maxRow, int minCol, int maxCol){
+		int cols=sum.cols;
+		for (int i=minRow;i<=maxRow;++i){
+			for (int j=minCol;j<=maxCol;++j){
+				uchar *point=background.data+3*(i*cols+j);
+				int c=count[i][j];
+				if (c==0){
+					point[0]=0;
+					point[1]=0;
+					point[2]=0;
+				} else{
+					const Vec3i &s=sum[i][j];
+					point[0]=RoundedMean(s[0], c);
+					point[1]=RoundedMean(s[1], c);
+					point[2]=RoundedMean(s[2], c);
+				}
+			}
+		}
+	}
 
-	int rows=terrain.rows;
-	int cols=terrain.cols;
+	//the frames, their flags and the sums are moved, so the counts and the sums still match the frames in the ring;
+	//the uncovered pixels have no background and count as not being grass since the translation
+	bool Translate(int dx, int dy){
+		if (sum.Empty()==true){
+			return true;
+		}
+		for (int k=0;k<size;++k){
+			int i=(start+k)%n;
+			TranslateMat(images[i], dx, dy);
+			flags[i].Translate(dx, dy);
+		}
+		TranslateMat(count.mat, dx, dy);
+		TranslateMat(sum.mat, dx, dy);
+		TranslateMat(lastGrass.mat, dx, dy, Scalar(addedCount));
+		TranslateMat(background, dx, dy);
+		fill(dirty.begin(), dirty.end(), 1);
+		TranslateMinMaxRowCol(minRow, maxRow, minCol, maxCol, dx, dy, sum.rows, sum.cols);
+		return true;
+	}
+
+	//the frames in the ring are kept in their slots, so the state is the same as before the save
+	bool Save(StateWriter &writer){
+		SaveBounds(writer);
+		writer.WriteValue(n);
+		writer.WriteValue(size);
+		writer.WriteValue(start);
+		writer.WriteValue(newPosition);
+		writer.WriteValue(addedCount);
+		writer.WriteValue(rows);
+		writer.WriteValue(tilesPerRow);
+		for (int k=0;k<size;++k){
+			writer.WriteMat(images[(start+k)%n]);
+			writer.WriteBitPlane(flags[(start+k)%n]);
+		}
+		writer.WritePlane(count);
+		writer.WritePlane(sum);
+		writer.WritePlane(lastGrass);
+		writer.WriteMat(background);
+		writer.WriteVector(dirty);
+		return writer.failed==false;
+	}
+
+	bool Load(StateReader &reader){
+		LoadBounds(reader);
+		if (reader.ReadValue<int>()!=n){
+			return false;
+		}
+		reader.ReadValue(size);
+		reader.ReadValue(start);
+		reader.ReadValue(newPosition);
+		reader.ReadValue(addedCount);
+		reader.ReadValue(rows);
+		reader.ReadValue(tilesPerRow);
+		if (reader.failed==true || size<0 || n<size || start<0 || n<=start || newPosition!=(start+size)%n){
+			return false;
+		}
+		for (int i=0;i<n;++i){
+			images[i].release();
+			flags[i]=BitPlane();
+		}
+		for (int k=0;k<size;++k){
+			reader.ReadMat(images[(start+k)%n]);
+			reader.ReadBitPlane(flags[(start+k)%n]);
+		}
+		reader.ReadPlane(count);
+		reader.ReadPlane(sum);
+		reader.ReadPlane(lastGrass);
+		reader.ReadMat(background);
+		reader.ReadVector(dirty);
+		if (reader.failed==true){
+			return false;
+		}
+		//the loaded tiles are not in the published buffers
+		tileVersions.assign(dirty.size(), 0);
+		publishedBuffers.clear();
+		lastPublished=-1;
+		if (uf!=NULL){
+			delete uf;
+			uf=NULL;
+		}
+		if (sum.Empty()==true){
+			return size==0;
+		}
+		if (ValidLoadedSizes()==false || CountsMatchFlags()==false){
+			return false;
+		}
+		grass.Create(sum.rows, sum.cols);
+		return true;
+	}
 
-	for (int i=0;i<positions.size();++i){
-		int row=positions[i].row;
-		int col=positions[i].col;
-		if (*(((uchar *)(terrain.data))+row*cols+col)!=0){
-			++count;
+	//Add and BuildBackgroundTile index every plane by the size of sum, so a checkpoint whose sizes do not match is not used
+	bool ValidLoadedSizes() const{
+		int cols=sum.cols;
+		if (rows!=sum.rows || count.rows!=rows || count.cols!=cols || lastGrass.rows!=rows || lastGrass.cols!=cols){
+			return false;
+		}
+		if (background.rows!=rows || background.cols!=cols || background.type()!=CV_8UC3){
+			return false;
+		}
+		if (tilesPerRow!=(cols+tileCols-1)/tileCols || (int)dirty.size()!=TileRowsCount()*tilesPerRow){
+			return false;
+		}
+		for (int k=0;k<size;++k){
+			const Mat &img=images[(start+k)%n];
+			const BitPlane &flag=flags[(start+k)%n];
+			if (img.rows!=rows || img.cols!=cols || img.type()!=CV_8UC3 || flag.rows!=rows || flag.cols!=cols){
+				return false;
+			}
 		}
+		return minRow>=-1 && maxRow<rows && minCol>=-1 && maxCol<cols;
 	}
 
-	return count;
-}
+	//Remove subtracts the bits of the oldest flags from count, so every row of count has to add up to the set bits of the row
+	//in the frames of the ring, otherwise a count would drop below 0; checked by popcounts, one per 64 pixels and frame
+	bool CountsMatchFlags() const{
+		atomic<bool> matches(true);
+		ParallelForRows(0, count.rows, [&](int begin, int end){
+			for (int i=begin;i<end && matches.load(memory_order_relaxed)==true;++i){
+				int rowCount=0;
+				const ushort *countRow=count[i];
+				for (int j=0;j<count.cols;++j){
+					rowCount+=countRow[j];
+				}
+				int bitsCount=0;
+				for (int k=0;k<size;++k){
+					bitsCount+=flags[(start+k)%n].CountRow(i);
+				}
+				if (rowCount!=bitsCount){
+					matches=false;
+				}
+			}
+		});
+		return matches;
+	}
 
-template<typename T>
-T CalculateMean(const vector<T> &data){
-	T m=0;
+};
 
-	int n=data.size();
-	for (int i=0;i<n;++i){
-		m+=data[i];
+//the comparators of Batcher's odd-even merge sort for n elements, n does not have to be a power of 2
+void GetSortingNetwork(int n, vector<pair<int, int> > &network){
+	network.clear();
+	for (int p=1;p<n;p<<=1){
+		for (int k=p;k>=1;k>>=1){
+			for (int j=k%p;j<=n-1-k;j+=2*k){
+				for (int i=0;i<=min(k-1, n-j-k-1);++i){
+					if ((i+j)/(2*p)==(i+j+k)/(2*p)){
+						network.push_back(make_pair(i+j, i+j+k));
+					}
+				}
+			}
+		}
 	}
-	m/=n;
-	
-	return m;
 }
 
-template<typename T>
-T CalculateStandardDeviation(const vector<T> &data, T m){
-	
-	T std=0;
+//the same frame ring and grass flags as BackgroundFetcher5, but every channel of the background is the median of the grass values instead of their mean,
+//so a player standing still for less than half of the frames does not bleed into the background; with an even count the two middle values are averaged
+struct BackgroundMedianFetcher:BackgroundFetcher5{
+	//the sorting network works on 16 bytes of a row at once, up to this many frames
+	static const int maximumNetworkSize=64;
+	//the indices of the middle values are kept in bytes, so a larger n is clamped to this
+	static const int maximumSize=255;
+	vector<pair<int, int> > network;
+	int networkSize;
 
-	int n=data.size();
-	for (int i=0;i<n;++i){
-		T d=data[i]-m;
-		std+=d*d;
+	BackgroundMedianFetcher(int n, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=true, int minimumSize=3, int untouchedTTL=30):BackgroundFetcher5(min(n, (int)maximumSize), redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned, minimumSize, untouchedTTL){
+		networkSize=-1;
 	}
-	std=sqrt(std/(n-1));
 
-	return std;
-}
+	void GetBackground(Mat &result){
+		if (networkSize!=size){
+			networkSize=size;
+			GetSortingNetwork(size, network);
+		}
+		BackgroundFetcher5::GetBackground(result);
+	}
+
+	//values holds size rows of stride bytes, the non grass ones being 255 so they are sorted after the grass ones,
+	//lower and upper are the indices of the two middle grass values of every byte, 255 if there are none
+	void MedianBytes(uchar *values, int stride, const uchar *lower, const uchar *upper, uchar *median, int width) const{
+		int x=0;
+#ifdef USE_X86_SIMD
+		if (size<=maximumNetworkSize && GetSimdLevel()>=SIMD_SSE41){
+			x=MedianBytesSse41(values, stride, lower, upper, median, width);
+		}
+#endif
+		uchar sorted[maximumSize];
+		for (;x<width;++x){
+			int k=0;
+			for (int f=0;f<size;++f){
+				sorted[k++]=values[f*stride+x];
+			}
+			sort(sorted, sorted+k);
+			median[x]=lower[x]==255 ? 0 : (sorted[lower[x]]+sorted[upper[x]]+1)>>1;
+		}
+	}
 
-template<typename T>
-T CalculateStandardDeviation(const vector<T> &data){
-	return CalculateStandardDeviation(data, CalculateMean(data));
-}
-
-void CreateMaskFromFlags(int **flag, Mat &mask, int rows, int cols){
-	
-	mask=Mat::zeros(rows, cols, CV_8UC1);
-
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			int bf=flag[i][j];
-			*(((uchar *)(mask.data))+i*cols+j)=255*bf;
+#ifdef USE_X86_SIMD
+	TARGET_SSE41 int MedianBytesSse41(uchar *values, int stride, const uchar *lower, const uchar *upper, uchar *median, int width) const{
+		__m128i v[maximumNetworkSize];
+		int x=0;
+		for (;x+16<=width;x+=16){
+			for (int f=0;f<size;++f){
+				v[f]=_mm_loadu_si128((const __m128i *)(values+f*stride+x));
+			}
+			for (int c=0;c<network.size();++c){
+				__m128i a=v[network[c].first];
+				__m128i b=v[network[c].second];
+				v[network[c].first]=_mm_min_epu8(a, b);
+				v[network[c].second]=_mm_max_epu8(a, b);
+			}
+			__m128i lowerIndex=_mm_loadu_si128((const __m128i *)(lower+x));
+			__m128i upperIndex=_mm_loadu_si128((const __m128i *)(upper+x));
+			__m128i lowerValue=_mm_setzero_si128();
+			__m128i upperValue=_mm_setzero_si128();
+			for (int f=0;f<size;++f){
+				__m128i index=_mm_set1_epi8((char)f);
+				lowerValue=_mm_blendv_epi8(lowerValue, v[f], _mm_cmpeq_epi8(lowerIndex, index));
+				upperValue=_mm_blendv_epi8(upperValue, v[f], _mm_cmpeq_epi8(upperIndex, index));
+			}
+			_mm_storeu_si128((__m128i *)(median+x), _mm_avg_epu8(lowerValue, upperValue));
 		}
+		return x;
 	}
-	
-}
-
-void CalculateColorChromaticityBounds(const Mat &source, const Mat &mask, double &redLower, double &redUpper, double &greenLower, double &greenUpper, double spreadFactor=2.0){
-	
-	Vec3d meanColor=Vec3d(0.0, 0.0, 0.0);
-	vector<double> channels[3];
+#endif
 
-	Mat img;
-	source.convertTo(img, CV_64F);
-
-	int rows=img.rows;
-	int cols=img.cols;
-
-	vector<double> red;
-	vector<double> green;
-	
-	int n=0;
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (*(((const uchar *)(mask.data))+i*cols+j)!=0){
-				Vec3d &point=*(((Vec3d *)(img.data))+i*cols+j);
-				double s=point[0]+point[1]+point[2];
-				if (s>0){
-					red.push_back(point[2]/s);
-					green.push_back(point[1]/s);
+	void BuildBackgroundTile(int minRow, int maxRow, int minCol, int maxCol){
+		int cols=sum.cols;
+		int width=3*(maxCol-minCol+1);
+		vector<uchar> values(size*width+1);
+		vector<uchar> lower(width);
+		vector<uchar> upper(width);
+		for (int i=minRow;i<=maxRow;++i){
+			for (int f=0;f<size;++f){
+				int frame=(start+f)%n;
+				const uchar *source=images[frame].data+3*(i*cols+minCol);
+				uchar *destination=&values[f*width];
+				for (int j=0;j<=maxCol-minCol;++j){
+					bool isGrass=flags[frame].Get(i, minCol+j);
+					destination[3*j]=isGrass==true ? source[3*j] : 255;
+					destination[3*j+1]=isGrass==true ? source[3*j+1] : 255;
+					destination[3*j+2]=isGrass==true ? source[3*j+2] : 255;
 				}
 			}
+			for (int j=0;j<=maxCol-minCol;++j){
+				int c=count[i][minCol+j];
+				uchar l=c==0 ? 255 : (c-1)/2;
+				uchar u=c==0 ? 255 : c/2;
+				lower[3*j]=lower[3*j+1]=lower[3*j+2]=l;
+				upper[3*j]=upper[3*j+1]=upper[3*j+2]=u;
+			}
+			MedianBytes(&values[0], width, &lower[0], &upper[0], background.data+3*(i*cols+minCol), width);
 		}
 	}
+};
 
-	double redMean=CalculateMean(red);
-	double greenMean=CalculateMean(green);
+//a running Gaussian per pixel (the mean of the channels and one variance), learned every frame from the pixels the chromaticity test takes for grass,
+//so it needs no frame ring and costs the same for every frame; a grass pixel far from the mean is learned slower, so players in green do not bleed in
+struct RunningGaussianBackground:BackgroundModel{
+	int n;
+	double learningRate;
+	double slowLearningFactor;
+	//a pixel farther than this many standard deviations from the mean is learned slower
+	double matchFactor;
+	float initialVariance;
+	float minimumVariance;
+	float maximumVariance;
+
+	Plane<Vec3f> mean;
+	//0 marks a pixel that has not been grass yet
+	Plane<float> variance;
+	int addedCount;
+
+	//learningRate 0 means 1/n, the model counts as full after n frames
+	RunningGaussianBackground(int n, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double learningRate=0, double slowLearningFactor=0.1, double matchFactor=2.5):BackgroundModel(redLower, redUpper, greenLower, greenUpper), n(n), learningRate(learningRate), slowLearningFactor(slowLearningFactor), matchFactor(matchFactor){
+		if (this->learningRate<=0){
+			this->learningRate=1.0/max(n, 1);
+		}
+		initialVariance=15*15;
+		minimumVariance=4*4;
+		maximumVariance=50*50;
+		addedCount=0;
+	}
 
-	double redStd=CalculateStandardDeviation(red, redMean);
-	double greenStd=CalculateStandardDeviation(green, greenMean);
-	
-	redLower=redMean-spreadFactor*redStd;
-	redUpper=redMean+spreadFactor*redStd;
-	greenLower=greenMean-spreadFactor*greenStd;
-	greenUpper=greenMean+spreadFactor*greenStd;
-}
+	void Add(Mat img){
+		int rows=img.rows;
+		int cols=img.cols;
 
-double CalculateApproximateDifference2(const Mat &img1, const Mat &img2, int step=10, int **terrainMask=NULL, double threshold=5.0){
-	int rows=img1.rows;
-	int cols=img1.cols;
+		if (mean.rows!=rows || mean.cols!=cols){
+			mean.Create(rows, cols, true);
+			variance.Create(rows, cols, true);
+		}
+		++addedCount;
 
-	if (rows!=img2.rows || cols!=img2.cols){
-		return -1;
-	}
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
 
-	int n=0;
-	int count=0;
-	for (int i=0;i<rows;i+=step){
-		for (int j=0;j<cols;j+=step){
-			if (terrainMask==NULL || terrainMask[i][j]!=0){
-				for (int k=0;k<3;++k){
-					double dd=(*(((Vec3b *)(img1.data))+i*cols+j))[k]-(*(((Vec3b *)(img2.data))+i*cols+j))[k];
-					if (dd<0){
-						dd=-dd;
+		ChromaticityClassifier classifier(redLower, redUpper, greenLower, greenUpper);
+		float alpha=learningRate;
+		float slowAlpha=learningRate*slowLearningFactor;
+		float match=matchFactor*matchFactor;
+		mutex boundsLock;
+		ParallelForRows(0, rows, [&](int begin, int end){
+			int tileMinRow=-1;
+			int tileMaxRow=-1;
+			int tileMinCol=-1;
+			int tileMaxCol=-1;
+			vector<uchar> grass(cols);
+			for (int i=begin;i<end;++i){
+				const uchar *row=img.data+3*i*cols;
+				classifier.ClassifyRow(row, &grass[0], cols);
+				Vec3f *m=mean[i];
+				float *v=variance[i];
+				for (int j=0;j<cols;++j){
+					if (grass[j]==1){
+						const uchar *point=row+3*j;
+						if (v[j]==0){
+							m[j]=Vec3f(point[0], point[1], point[2]);
+							v[j]=initialVariance;
+						} else{
+							float d0=point[0]-m[j][0];
+							float d1=point[1]-m[j][1];
+							float d2=point[2]-m[j][2];
+							float d=(d0*d0+d1*d1+d2*d2)/3;
+							float a=d<=match*v[j] ? alpha : slowAlpha;
+							m[j][0]+=a*d0;
+							m[j][1]+=a*d1;
+							m[j][2]+=a*d2;
+							v[j]=min(maximumVariance, max(minimumVariance, v[j]+a*(d-v[j])));
+						}
 					}
-					if (threshold<dd){
-						++count;
-						break;
+					MinMaxRowCol(tileMinRow, tileMaxRow, tileMinCol, tileMaxCol, i, j, v[j]!=0);
+				}
+			}
+			lock_guard<mutex> guard(boundsLock);
+			MergeMinMaxRowCol(minRow, maxRow, minCol, maxCol, tileMinRow, tileMaxRow, tileMinCol, tileMaxCol);
+		});
+	}
+
+	void Clear(){
+		if (mean.Empty()==true){
+			return;
+		}
+		addedCount=0;
+		variance.SetToZero();
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
+	}
+
+	void GetBackground(Mat &result){
+		if (mean.Empty()==true){
+			return;
+		}
+		int rows=mean.rows;
+		int cols=mean.cols;
+		//a new Mat, create would reuse the buffer of a background that was already handed out
+		result=Mat(rows, cols, CV_8UC3);
+		ParallelForRows(0, rows, [&](int begin, int end){
+			for (int i=begin;i<end;++i){
+				const Vec3f *m=mean[i];
+				const float *v=variance[i];
+				uchar *point=result.data+3*i*cols;
+				for (int j=0;j<cols;++j){
+					if (v[j]==0){
+						point[3*j]=0;
+						point[3*j+1]=0;
+						point[3*j+2]=0;
+					} else{
+						point[3*j]=saturate_cast<uchar>(m[j][0]);
+						point[3*j+1]=saturate_cast<uchar>(m[j][1]);
+						point[3*j+2]=saturate_cast<uchar>(m[j][2]);
 					}
 				}
-				++n;
 			}
+		});
+	}
+
+	bool IsFull() const{
+		return n<=addedCount;
+	}
+
+	bool UpdatesEveryFrame() const{
+		return true;
+	}
+
+	//the uncovered pixels get the variance 0, i.e. they are learned again from the first frame they are grass in
+	bool Translate(int dx, int dy){
+		if (mean.Empty()==true){
+			return true;
 		}
+		TranslateMat(mean.mat, dx, dy);
+		TranslateMat(variance.mat, dx, dy);
+		TranslateMinMaxRowCol(minRow, maxRow, minCol, maxCol, dx, dy, mean.rows, mean.cols);
+		return true;
+	}
+
+	bool Save(StateWriter &writer){
+		SaveBounds(writer);
+		writer.WriteValue(addedCount);
+		writer.WritePlane(mean);
+		writer.WritePlane(variance);
+		return writer.failed==false;
+	}
+
+	bool Load(StateReader &reader){
+		LoadBounds(reader);
+		reader.ReadValue(addedCount);
+		reader.ReadPlane(mean);
+		reader.ReadPlane(variance);
+		return reader.failed==false && mean.rows==variance.rows && mean.cols==variance.cols;
 	}
+};
 
-	return count/(float)n;
+//engine is "mean" for BackgroundFetcher5, "median" for BackgroundMedianFetcher or "gaussian" for RunningGaussianBackground,
+//NULL is returned for unknown engines
+BackgroundModel *CreateBackgroundModel(const string &engine, int n, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, double learningRate=0){
+	if (engine=="mean"){
+		return new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
+	}
+	if (engine=="median"){
+		if (BackgroundMedianFetcher::maximumSize<n){
+			printf("The median engine keeps at most %d frames, n %d is lowered.\n", BackgroundMedianFetcher::maximumSize, n);
+		}
+		return new BackgroundMedianFetcher(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
+	}
+	if (engine=="gaussian"){
+		return new RunningGaussianBackground(n, redLower, redUpper, greenLower, greenUpper, learningRate);
+	}
+	return NULL;
 }
 
-void CalculateCenter(const Mat &img, int &row, int &col){
-	
-	int rows=img.rows;
-	int cols=img.cols;
+//a background and its bounds published by AsyncBackgroundModel, generation is the number of times the model was cleared before
+struct PublishedBackground{
+	Mat background;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+	int generation;
+};
 
-	int n=0;
-	row=0;
-	col=0;
-	for (int i=0;i<rows;++i){
-		for (int j=0;j<cols;++j){
-			if (*(((uchar *)(img.data))+i*cols+j)!=0){
-				row+=i;
-				col+=j;
-				++n;
+//runs another model on its own thread: Add, Clear and SetChromaticityBounds are queued and return at once,
+//after every Add the worker publishes a new background with an atomic swap and GetBackground returns the latest one without waiting,
+//so the frames on which the model is updated take no longer than the others; every frame is added, Add waits only if
+//maximumQueuedFrames frames are queued already, i.e. if the worker is slower than the frames are given to it
+struct AsyncBackgroundModel:BackgroundModel{
+	enum CommandType{
+		ADD=0,
+		CLEAR=1,
+		SET_CHROMATICITY_BOUNDS=2,
+		TRANSLATE=3
+	};
+
+	struct Command{
+		int type;
+		Mat img;
+		double redLower;
+		double redUpper;
+		double greenLower;
+		double greenUpper;
+		int dx;
+		int dy;
+	};
+
+	BackgroundModel *model;
+	thread worker;
+	mutex lock;
+	condition_variable wake;
+	deque<Command> commands;
+	static const int maximumQueuedFrames=2;
+	//the ADD commands in the queue
+	int queuedFrames;
+	//the worker is executing a command it took from the queue
+	bool working;
+	condition_variable drained;
+	bool stopping;
+	//the generation seen by the caller and the one the model is at when it is full, -1 if it is not
+	int generation;
+	atomic<int> fullGeneration;
+	shared_ptr<const PublishedBackground> published;
+
+	//takes the ownership of the model
+	AsyncBackgroundModel(BackgroundModel *model):BackgroundModel(model->redLower, model->redUpper, model->greenLower, model->greenUpper), model(model){
+		stopping=false;
+		queuedFrames=0;
+		working=false;
+		generation=0;
+		fullGeneration=-1;
+		worker=thread(&AsyncBackgroundModel::Run, this);
+	}
+
+	~AsyncBackgroundModel(){
+		{
+			lock_guard<mutex> guard(lock);
+			stopping=true;
+		}
+		wake.notify_one();
+		worker.join();
+		delete model;
+	}
+
+	void Push(const Command &command){
+		{
+			unique_lock<mutex> guard(lock);
+			if (command.type==ADD){
+				drained.wait(guard, [this]{
+					return queuedFrames<maximumQueuedFrames;
+				});
+				++queuedFrames;
 			}
+			commands.push_back(command);
 		}
+		wake.notify_one();
 	}
-	row/=n;
-	col/=n;
 
-}
+	void Add(Mat img){
+		Command command;
+		command.type=ADD;
+		command.img=img.clone();
+		Push(command);
+	}
 
-void usleep(__int64 usec){ 
-    HANDLE timer; 
-    LARGE_INTEGER ft; 
+	void Clear(){
+		++generation;
+		Command command;
+		command.type=CLEAR;
+		Push(command);
+	}
+
+	void SetChromaticityBounds(double redLower, double redUpper, double greenLower, double greenUpper){
+		BackgroundModel::SetChromaticityBounds(redLower, redUpper, greenLower, greenUpper);
+		Command command;
+		command.type=SET_CHROMATICITY_BOUNDS;
+		command.redLower=redLower;
+		command.redUpper=redUpper;
+		command.greenLower=greenLower;
+		command.greenUpper=greenUpper;
+		Push(command);
+	}
+
+	//the worker moves the model and publishes its moved background, a model that can not be moved is cleared there as by Clear,
+	//so the backgrounds published before the translation are not returned either way
+	bool Translate(int dx, int dy){
+		++generation;
+		Command command;
+		command.type=TRANSLATE;
+		command.dx=dx;
+		command.dy=dy;
+		Push(command);
+		return true;
+	}
+
+	void Publish(int generation){
+		shared_ptr<PublishedBackground> next=make_shared<PublishedBackground>();
+		model->GetBackground(next->background);
+		next->minRow=model->minRow;
+		next->maxRow=model->maxRow;
+		next->minCol=model->minCol;
+		next->maxCol=model->maxCol;
+		next->generation=generation;
+		atomic_store(&published, shared_ptr<const PublishedBackground>(next));
+		fullGeneration=model->IsFull()==true ? generation : -1;
+	}
+
+	//result and the bounds are left as they are until a background was published after the last Clear
+	void GetBackground(Mat &result){
+		shared_ptr<const PublishedBackground> latest=atomic_load(&published);
+		if (latest==nullptr || latest->generation!=generation){
+			return;
+		}
+		result=latest->background;
+		minRow=latest->minRow;
+		maxRow=latest->maxRow;
+		minCol=latest->minCol;
+		maxCol=latest->maxCol;
+	}
 
-    ft.QuadPart = -(10*usec); // Convert to 100 nanosecond interval, negative value indicates relative time
+	bool IsFull() const{
+		return fullGeneration.load()==generation;
+	}
 
-    timer = CreateWaitableTimer(NULL, TRUE, NULL); 
-    SetWaitableTimer(timer, &ft, 0, NULL, NULL, 0); 
-    WaitForSingleObject(timer, INFINITE); 
-    CloseHandle(timer); 
-}
+	bool UpdatesEveryFrame() const{
+		return model->UpdatesEveryFrame();
+	}
 
-void Beep3(){
-	printf("\a");
-	usleep(750000);
-	printf("\a");
-	usleep(750000);
-	printf("\a");
-}
+	//waits until the worker executed every queued command
+	void Flush(){
+		unique_lock<mutex> guard(lock);
+		drained.wait(guard, [this]{
+			return commands.empty()==true && working==false;
+		});
+	}
 
-vector<Point> teamSelection;
-const char *teamSelectionWindowName = "i";
+	//the queued frames are added first, so the checkpoint holds every frame given to the model
+	bool Save(StateWriter &writer){
+		Flush();
+		return model->Save(writer);
+	}
 
-void TeamSelectionMouseCallback(int event, int x, int y, int flags, void* userdata) {
-	Point center;
-	Scalar color = Scalar(0, 0, 255);
-	int radius = 3;
+	//the loaded background is published at once, the worker is idle after Flush so the model can be used on this thread
+	bool Load(StateReader &reader){
+		Flush();
+		if (model->Load(reader)==false){
+			return false;
+		}
+		BackgroundModel::SetChromaticityBounds(model->redLower, model->redUpper, model->greenLower, model->greenUpper);
+		Publish(generation);
+		return true;
+	}
+
+	void Run(){
+		int workerGeneration=0;
+		while (true){
+			Command command;
+			{
+				unique_lock<mutex> guard(lock);
+				wake.wait(guard, [this]{
+					return stopping==true || commands.empty()==false;
+				});
+				if (commands.empty()==true){
+					return;
+				}
+				command=commands.front();
+				commands.pop_front();
+				if (command.type==ADD){
+					--queuedFrames;
+				}
+				working=true;
+			}
 
-	if (event == EVENT_LBUTTONDOWN || event == EVENT_MBUTTONDOWN || event == EVENT_RBUTTONDOWN) {
-		teamSelection.push_back(Point(x, y));
+			if (command.type==ADD){
+				model->Add(command.img);
+				Publish(workerGeneration);
+			} else if (command.type==TRANSLATE){
+				++workerGeneration;
+				if (model->Translate(command.dx, command.dy)==true){
+					Publish(workerGeneration);
+				} else{
+					fullGeneration=-1;
+					model->Clear();
+				}
+			} else if (command.type==CLEAR){
+				++workerGeneration;
+				fullGeneration=-1;
+				model->Clear();
+			} else{
+				model->SetChromaticityBounds(command.redLower, command.redUpper, command.greenLower, command.greenUpper);
+			}
 
-		center = Point(x, y);
-		circle(terrainSelectionImg, center, radius, color, -1);
-		imshow(teamSelectionWindowName, terrainSelectionImg);
+			{
+				lock_guard<mutex> guard(lock);
+				working=false;
+			}
+			drained.notify_all();
+		}
+	}
+};
+
+void GetBase(const char *path, char *base){
+	int l=strlen(path);
+	int start=0;
+	int end=-1;
+	for (int i=l-1;i>-1;--i){
+		if (end==-1 && path[i]=='.'){
+			end=i;
+		}
+		if (path[i]=='/' || path[i]=='\\'){
+			start=i+1;
+			break;
+		}
+	}
+
+	for (int i=start;i<end;++i){
+		base[i-start]=path[i];
 	}
+	base[end-start]='\0';
 
 }
 
-void SelectTeam() {
-	int selected = 0;	
-	Mat tmpImg = terrainSelectionImg.clone();
+void GetBackgroundCachePath(const char *videoPath, const char *backgroundsPath, int skip, int step, int take, char *path){
+	char base[1025];
+	GetBase(videoPath, base);
+	sprintf(path, "%s/%s_%d_%d_%d.png", backgroundsPath, base, skip, step, take);
+}
 
-	while (1) {
-		setMouseCallback(teamSelectionWindowName, TeamSelectionMouseCallback, NULL);
-		waitKey();
-		
-		if (teamSelection.size() != 4) {
-			teamSelection.clear();
-			tmpImg.copyTo(terrainSelectionImg);
-			imshow(teamSelectionWindowName, tmpImg);
+void GetBackgroundSmartly2(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/backgrounds/", bool write=false, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0){
+
+	char path[1025];
+	GetBackgroundCachePath(videoPath, backgroundsPath, skip, step, take, path);
+
+	FILE *input=fopen(path, "rb");
+	
+	if (input==NULL){
+		VideoCapture video=VideoCapture(videoPath);
+		GetBackground2(video, background, skip, step, take, redLower, redUpper, greenLower, greenUpper);
+		video.release();
+		if (write==true){
+			imwrite(path, background);
 		}
-		else break;		
+	} else{
+		fclose(input);
+		background=imread(path, 6);
 	}
 
-	tmpImg.release();
 }
 
-struct MyTracking {
-	vector<Point> contourPoints;
-	Mat rect;
-	Point center;
-	int team;
-	int area;
-	int visited;
-	MatND hist;
-};
+//the startup opens the video only once: the first frame is read, the background is built from the sample frames decoded by the same capture
+//(the first frame is reused if it is sampled) and the capture is then moved to the frame the tracking starts at
+struct VideoBootstrap{
+	VideoCapture video;
+	Mat firstImage;
+	//the index of the next frame the capture returns
+	int position;
 
-vector<MyTracking> myTracking, newMyTracking;
-int avgContourArea;
+	VideoBootstrap(){
+		position=0;
+	}
 
-struct HistData {
-	MatND histData;
-	int id;
-	Vec3b color;
-};
-vector<HistData> histData;
+	bool Open(const char *videoPath){
+		position=0;
+		if (video.open(videoPath)==false){
+			return false;
+		}
+		video>>firstImage;
+		if (firstImage.empty()){
+			return false;
+		}
+		position=1;
+		return true;
+	}
 
-bool analyse(Mat img, vector<vector<Point>> contours) {
-	avgContourArea = 0;
-	int channels[] = { 0, 1, 2 };
-	float h_ranges[] = { 0, 180 };
-	float s_ranges[] = { 0, 256 };
-	const float* ranges[] = { s_ranges, s_ranges, s_ranges };
-	int h_bins = 50; int s_bins = 50;
-	int histSize[] = { h_bins, s_bins, s_bins };
-	Mat hsvImg, rangeImg1, rangeImg2;
-	MatND histImg;
+	//the frames skip, skip+step, ..., skip+(take-1)*step, the same as GetBackground2, right after Open
+	void GetBackground(Mat &background, int skip=0, int step=30, int take=30, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, bool yAligned=false, int sampling=SAMPLE_GRAB){
 
-	int found = 0;
-	double inside;
-	for (int i = 0; i < contours.size(); ++i) {
-		avgContourArea += contourArea(contours[i]);
-		for (int j = 1; j < 3; ++j) {
-			inside = pointPolygonTest(contours[i], teamSelection[j], false);
-			if (inside > 0) {
-				++found;
-				cvtColor(img(boundingRect(contours[i])), hsvImg, COLOR_BGR2RGB);
-				calcHist(&hsvImg, 1, channels, Mat(), histImg, 2, histSize, ranges, true, false);
-				normalize(histImg, histImg, 0, 1, NORM_MINMAX, -1, Mat());
-				HistData tmpHistData;
-				tmpHistData.histData = histImg;
-				tmpHistData.id = j;
-				tmpHistData.color = img.at<Vec3b>(teamSelection[j]);
-				histData.push_back(tmpHistData);
+		BackgroundAccumulator accumulator;
+
+		for (int k=0;k<take;++k){
+			if (k==0 && skip==0 && firstImage.empty()==false){
+				accumulator.Add(firstImage, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+				continue;
 			}
-		}		
+			Mat img;
+			if (ReadSampledFrame(video, position, skip+k*step, img, sampling)==false){
+				break;
+			}
+			accumulator.Add(img, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, yAligned);
+		}
+
+		accumulator.GetBackground(background);
+
 	}
-	avgContourArea /= contours.size();
 
-	Moments m;
-	for (int i = 0; i < contours.size(); ++i) {		
-		if (contourArea(contours[i]) < avgContourArea*0.5) continue;			
-		MyTracking tmpData;
-		tmpData.area = contourArea(contours[i]);
-		tmpData.contourPoints = contours[i];
-		m = moments(contours[i], true);
-		tmpData.center = Point(m.m10 / m.m00, m.m01 / m.m00);
-		tmpData.visited = 0;
-		tmpData.rect = img(boundingRect(contours[i]));
-		
-		
-		cvtColor(tmpData.rect, hsvImg, COLOR_BGR2RGB);
-		calcHist(&hsvImg, 1, channels, Mat(), histImg, 2, histSize, ranges, true, false);
-		normalize(histImg, histImg, 0, 1, NORM_MINMAX, -1, Mat());
-		tmpData.hist = histImg;
-		
-		if (pointPolygonTest(contours[i], teamSelection[0], false) > 0) {
-			tmpData.team = 0; 
-			++found;
-		}		
-		else if (pointPolygonTest(contours[i], teamSelection[3], false) > 0) {
-			tmpData.team = 3; 
-			++found;
+	//the same as GetBackgroundSmartly2, but the frames are decoded by this capture
+	void GetBackgroundSmartly(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/backgrounds/", bool write=false, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, double previousSizeThreshold=2.0, int sampling=SAMPLE_GRAB){
+
+		char path[1025];
+		GetBackgroundCachePath(videoPath, backgroundsPath, skip, step, take, path);
+
+		FILE *input=fopen(path, "rb");
+
+		if (input==NULL){
+			GetBackground(background, skip, step, take, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, false, sampling);
+			if (write==true && background.empty()==false){
+				imwrite(path, background);
+			}
+		} else{
+			fclose(input);
+			background=imread(path, 6);
 		}
-		else {
-			/*double team1 = compareHist(histData[0].histData, histImg, 1);
-			double team2 = compareHist(histData[1].histData, histImg, 1);
-			printf("%d %d\n", team1, team2);
-			if (team1 < team2) tmpData.team = histData[0].id;
-			else tmpData.team = histData[1].id;*/
-			Scalar bgrL = (histData[0].color[0] - 1, histData[0].color[1] - 1, histData[0].color[2] - 1);
-			Scalar bgrU = (histData[0].color[0] + 1, histData[0].color[1] + 1, histData[0].color[2] + 1);
-			inRange(tmpData.rect, bgrL, bgrU, rangeImg1);
-			bgrL = (histData[1].color[0] - 1, histData[1].color[1] - 1, histData[1].color[2] - 1);
-			bgrU = (histData[1].color[0] + 1, histData[1].color[1] + 1, histData[1].color[2] + 1);
-			inRange(tmpData.rect, bgrL, bgrU, rangeImg2);
-			if (countNonZero(rangeImg1) < countNonZero(rangeImg2)) tmpData.team = histData[1].id;
-			else tmpData.team = histData[0].id;
+
+	}
+
+	//the next frame read is startFrame, the capture seeks to it and only if the backend does not land on startFrame,
+	//the video is reopened and the frames before startFrame are grabbed
+	bool Rewind(const char *videoPath, int startFrame=0){
+		if (position==startFrame){
+			return true;
 		}
-		
-		myTracking.push_back(tmpData);
+		if (video.set(CAP_PROP_POS_FRAMES, startFrame)==true && (int)video.get(CAP_PROP_POS_FRAMES)==startFrame){
+			position=startFrame;
+			return true;
+		}
+		video.release();
+		position=0;
+		if (video.open(videoPath)==false){
+			return false;
+		}
+		while (position<startFrame){
+			if (video.grab()==false){
+				return false;
+			}
+			++position;
+		}
+		return true;
 	}
+};
 
-	if (found == 4) return true;
-	else return false;
+//64-bit FNV-1a
+uint64 HashBytes(const void *data, size_t size, uint64 hash=14695981039346656037ULL){
+	const uchar *bytes=(const uchar *)data;
+	for (size_t i=0;i<size;++i){
+		hash^=bytes[i];
+		hash*=1099511628211ULL;
+	}
+	return hash;
 }
 
-void Test97() {
-	char videoPath[1024] = "C:/Users/etomiki/Desktop/Nogomet/Dinamo_vs._Rijeka_-_panorama_view.mp4";
-	//char videoPath[1024] = "C:/Users/etomiki/Desktop/Nogomet/Inter - Dinamo wide angle.mp4";	
+template<typename T>
+uint64 HashValue(const T &value, uint64 hash){
+	return HashBytes(&value, sizeof(T), hash);
+}
 
+template<typename T>
+uint64 HashPlane(const Plane<T> &plane, uint64 hash=14695981039346656037ULL){
+	hash=HashValue(plane.rows, hash);
+	hash=HashValue(plane.cols, hash);
+	return HashBytes(plane.Data(), (size_t)plane.rows*plane.cols*sizeof(T), hash);
+}
 
-	const char *drawnResultsPath = "C:/Users/etomiki/Desktop/Nogomet/labeled_images/";
-	char videoBase[1025];
-	GetBase(videoPath, videoBase);
+static bool SeekFile(FILE *file, long long offset, int origin){
+#ifdef _WIN32
+	return _fseeki64(file, offset, origin)==0;
+#else
+	return fseeko(file, (off_t)offset, origin)==0;
+#endif
+}
 
-	double f = 1.0;
+static long long TellFile(FILE *file){
+#ifdef _WIN32
+	return _ftelli64(file);
+#else
+	return (long long)ftello(file);
+#endif
+}
 
-	//double thresholdFactor=0.75;
-	double thresholdFactor = 0.8;
-	double threshold = thresholdFactor*1000.0;
-	double thresholdForPrevious = thresholdFactor*250.0;
+//moves the temporary file over path in one step, so path holds either the old or the new file and never neither of them
+static bool RenameOverFile(const char *temporaryPath, const char *path){
+#ifdef _WIN32
+	return MoveFileExA(temporaryPath, path, MOVEFILE_REPLACE_EXISTING)!=FALSE;
+#else
+	return rename(temporaryPath, path)==0;
+#endif
+}
 
-	//int maximumGroupsCount=30;
-	int maximumGroupsCount = 35;
+static bool TruncateFile(FILE *file, long long size){
+	fflush(file);
+#ifdef _WIN32
+	return _chsize_s(_fileno(file), size)==0;
+#else
+	return ftruncate(fileno(file), (off_t)size)==0;
+#endif
+}
 
-	int minimumGroupSize = 3;
-	int minimumGroupSizeAtFirstDetection = 5;
+//the size and three 64 KB chunks (at the start, in the middle and at the end) identify the video without reading all of it,
+//0 if the video can not be read
+uint64 HashVideoContent(const char *videoPath){
+	FILE *input=fopen(videoPath, "rb");
+	if (input==NULL){
+		return 0;
+	}
 
-	bool cameraMoved = false;
-	bool cameraWasMoving = false;
-	bool forceModelBuilding = false;
-	//double cameraMovedThreshold=0.1;
-	double cameraMovedThreshold = 0.2;
-	double pixelChangedThreshold = 5.0;
-	Mat lastGoodImage;
-	int cameraMovedStep = 20;
+	const long long chunkSize=1<<16;
+	long long size=SeekFile(input, 0, SEEK_END)==true ? TellFile(input) : -1;
+	if (size<0){
+		fclose(input);
+		return 0;
+	}
 
-	//int n=30;
-	int n = 20;
-	int skip = 0;
-	//int skip=50;
-	int step = 30;
-	int take = n;
+	uint64 hash=HashValue(size, 14695981039346656037ULL);
+	long long offsets[3]={0, size/2-chunkSize/2, size-chunkSize};
+	vector<uchar> chunk(chunkSize);
+	for (int i=0;i<3;++i){
+		long long offset=offsets[i]<0 ? 0 : offsets[i];
+		if (SeekFile(input, offset, SEEK_SET)==false){
+			fclose(input);
+			return 0;
+		}
+		size_t read=fread(&chunk[0], 1, chunkSize, input);
+		hash=HashBytes(&chunk[0], read, hash);
+	}
 
-	VideoCapture prevideo = VideoCapture(videoPath);
-	Mat preImg;
-	prevideo >> preImg;
-	prevideo.release();
+	fclose(input);
+	return hash;
+}
 
-	preImg.copyTo(lastGoodImage);
+//the whole file mapped read-only
+struct MappedFile{
+	const uchar *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+	MappedFile(){
+		data=NULL;
+		size=0;
+#ifdef _WIN32
+		file=INVALID_HANDLE_VALUE;
+		mapping=NULL;
+#endif
+	}
 
-	int rows = preImg.rows;
-	int cols = preImg.cols;
+	~MappedFile(){
+		Close();
+	}
 
-	preImg.copyTo(terrainSelectionImg);
-	int **terrainMask = SelectTerrainSmartly(videoPath, skip, step, take, "C:/Users/etomiki/Desktop/Nogomet/terrains/", true, f);
+	bool Open(const char *path){
+		Close();
+#ifdef _WIN32
+		file=CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file==INVALID_HANDLE_VALUE){
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (GetFileSizeEx(file, &fileSize)==FALSE || fileSize.QuadPart==0){
+			Close();
+			return false;
+		}
+		mapping=CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping==NULL){
+			Close();
+			return false;
+		}
+		data=(const uchar *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data==NULL){
+			Close();
+			return false;
+		}
+		size=(size_t)fileSize.QuadPart;
+#else
+		int descriptor=open(path, O_RDONLY);
+		if (descriptor==-1){
+			return false;
+		}
+		struct stat status;
+		if (fstat(descriptor, &status)!=0 || status.st_size==0){
+			close(descriptor);
+			return false;
+		}
+		void *mapped=mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		close(descriptor);
+		if (mapped==MAP_FAILED){
+			return false;
+		}
+		data=(const uchar *)mapped;
+		size=(size_t)status.st_size;
+#endif
+		return true;
+	}
 
-	Mat terrainMaskImg = Mat::zeros(rows, cols, CV_8UC1);
-	for (int i = 0; i<rows; ++i) {
-		for (int j = 0; j<cols; ++j) {
-			*(((uchar *)(terrainMaskImg.data)) + i*cols + j) = 255 * terrainMask[i][j];
+	void Close(){
+#ifdef _WIN32
+		if (data!=NULL){
+			UnmapViewOfFile(data);
+		}
+		if (mapping!=NULL){
+			CloseHandle(mapping);
 		}
+		if (file!=INVALID_HANDLE_VALUE){
+			CloseHandle(file);
+		}
+		mapping=NULL;
+		file=INVALID_HANDLE_VALUE;
+#else
+		if (data!=NULL){
+			munmap((void *)data, size);
+		}
+#endif
+		data=NULL;
+		size=0;
 	}
-	//imshow("terrain", terrainMaskImg);
-	
-	int keyPressed = waitKey(1);
+};
 
-	double redLower = 0.3450;
-	double redUpper = 0.3661;
-	double greenLower = 0.4600;
-	double greenUpper = 0.5075;
+//everything the startup produces before the first frame is tracked
+struct StartupArtifacts{
+	Mat background;
+	Plane<uchar> terrainMask;
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+};
 
-	double spreadFactor = 4.0;
+//the cache file is this header followed by the background (3 bytes per pixel) and the terrain mask (1 byte per pixel),
+//the version has to be increased whenever the layout or the way the artifacts are built changes
+const unsigned int startupArtifactsMagic=0x41545053;
+const int startupArtifactsVersion=3;
 
-	CalculateColorChromaticityBounds(preImg, terrainMaskImg, redLower, redUpper, greenLower, greenUpper, spreadFactor);
+struct StartupArtifactsHeader{
+	unsigned int magic;
+	int version;
+	uint64 key;
+	int rows;
+	int cols;
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+};
 
-	int chromaticityBoundsCalculationStep = 25;
-	int chromaticityBoundsCalculationCount = chromaticityBoundsCalculationStep;
+//the file is named after the key only, so artifacts built from the same video with the same parameters are found under any video path
+void GetStartupArtifactsPath(const char *artifactsPath, uint64 key, char *path){
+	sprintf(path, "%s/%016llx.artifacts", artifactsPath, (unsigned long long)key);
+}
 
-	double greenThreshold = 45;
+//false if there is no file for the key or it does not match the key, the version or the frame size, i.e. the artifacts have to be built
+bool LoadStartupArtifacts(const char *path, uint64 key, int rows, int cols, StartupArtifacts &artifacts){
+	MappedFile file;
+	if (file.Open(path)==false){
+		return false;
+	}
 
-	double previousSizeThreshold = 2.0;
+	StartupArtifactsHeader header;
+	if (file.size<sizeof(header)){
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(header));
+	if (header.magic!=startupArtifactsMagic || header.version!=startupArtifactsVersion || header.key!=key || header.rows!=rows || header.cols!=cols){
+		return false;
+	}
+	size_t pixels=(size_t)rows*cols;
+	if (file.size!=sizeof(header)+4*pixels){
+		return false;
+	}
 
-	int backgroundCount = 1;
-	int backgroundLimit = 30;
+	const uchar *data=file.data+sizeof(header);
+	artifacts.background.create(rows, cols, CV_8UC3);
+	memcpy(artifacts.background.data, data, 3*pixels);
+	artifacts.terrainMask.Create(rows, cols);
+	memcpy(artifacts.terrainMask.Data(), data+3*pixels, pixels);
 
-	int redetectStep = 2;
-	int redetectCount = redetectStep;
+	artifacts.redLower=header.redLower;
+	artifacts.redUpper=header.redUpper;
+	artifacts.greenLower=header.greenLower;
+	artifacts.greenUpper=header.greenUpper;
+	artifacts.minRow=header.minRow;
+	artifacts.maxRow=header.maxRow;
+	artifacts.minCol=header.minCol;
+	artifacts.maxCol=header.maxCol;
 
-	int scanningAttempts = 3;
+	return true;
+}
 
-	int allowedFramesOutsideOfTerrain = 300;
+//written to a temporary file which is then renamed, so a file under the final name is always complete
+bool SaveStartupArtifacts(const char *path, uint64 key, const StartupArtifacts &artifacts){
+	int rows=artifacts.terrainMask.rows;
+	int cols=artifacts.terrainMask.cols;
+	if (artifacts.background.rows!=rows || artifacts.background.cols!=cols || artifacts.background.type()!=CV_8UC3){
+		return false;
+	}
 
-	int backFramesToCheckForCloseTracked = 50;
-	int backFramesToCheckForStrongClosePushedOut = 50;
-	int backFramesToCheckForClosePushedOut = 150;
+	StartupArtifactsHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic=startupArtifactsMagic;
+	header.version=startupArtifactsVersion;
+	header.key=key;
+	header.rows=rows;
+	header.cols=cols;
+	header.redLower=artifacts.redLower;
+	header.redUpper=artifacts.redUpper;
+	header.greenLower=artifacts.greenLower;
+	header.greenUpper=artifacts.greenUpper;
+	header.minRow=artifacts.minRow;
+	header.maxRow=artifacts.maxRow;
+	header.minCol=artifacts.minCol;
+	header.maxCol=artifacts.maxCol;
+
+	char temporaryPath[1100];
+	sprintf(temporaryPath, "%s.tmp", path);
+	FILE *output=fopen(temporaryPath, "wb");
+	if (output==NULL){
+		return false;
+	}
+	bool written=fwrite(&header, sizeof(header), 1, output)==1;
+	for (int i=0;i<rows && written==true;++i){
+		written=fwrite(artifacts.background.ptr<uchar>(i), 3, cols, output)==(size_t)cols;
+	}
+	if (written==true){
+		written=fwrite(artifacts.terrainMask.Data(), 1, (size_t)rows*cols, output)==(size_t)rows*cols;
+	}
+	if (fclose(output)!=0){
+		written=false;
+	}
+	if (written==false){
+		remove(temporaryPath);
+		return false;
+	}
 
-	int trajectoryDrawingLength = 100;
+	return RenameOverFile(temporaryPath, path);
+}
 
-	double remainingFactor = 1.2;
+void GetBackgroundDistance(const Mat &img, const Mat &background, const BackgroundDistance &kernel, Plane<int> &distance, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
 
-	Mat background;
-	GetBackgroundSmartly2(videoPath, background, skip, step, take, "C:/Users/etomiki/Desktop/Nogomet/backgrounds/", true, redLower, redUpper, greenLower, greenUpper);
+	int rows=img.rows;
+	int cols=img.cols;
 
-	//double sameGroupFieldDistancePercentage=0.07;
-	//double sameGroupFieldDistancePercentage = backFramesToCheckForStrongClosePushedOut*0.0028;
-	//int sameGroupFieldDistance = background.cols*sameGroupFieldDistancePercentage;
-	//int sameGroupBackFramesForSpeed = 10;
+	if (minRow==-1){
+		minRow=0;
+	}
+	if (maxRow==-1){
+		maxRow=rows-1;
+	}
+	if (minCol==-1){
+		minCol=0;
+	}
+	if (maxCol==-1){
+		maxCol=cols-1;
+	}
 
-	int maximumWidth = cols*0.075;
-	int maximumHeight = rows*0.05;
+	ParallelForRows(minRow, maxRow+1, [&](int begin, int end){
+		for (int i=begin;i<end;++i){
+			kernel.Row(img.data+3*(i*cols+minCol), background.data+3*(i*cols+minCol), maxCol-minCol+1, distance[i]+minCol, NULL);
+		}
+	});
 
-	int **backgroundFlag = GetIntMatrix(rows, cols);
-	int **foregroundFlag = GetIntMatrix(rows, cols);
-	int **currentBackgroundFlag = GetIntMatrix(rows, cols);
-	UnionFind uf(rows*cols + 1);
+}
 
-	Mat img;
-	BackgroundFetcher5 *bf = new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
-	//BackgroundFetcher5 *bf=new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, true, 0);
+void GetBackgroundDistanceMask(const Mat &img, const Mat &background, const BackgroundDistance &kernel, double threshold, Plane<uchar> &mask, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
 
-	int minRow = -1;
-	int maxRow = -1;
-	int minCol = -1;
-	int maxCol = -1;
+	int rows=img.rows;
+	int cols=img.cols;
 
-	for (int i = 0; i<rows; ++i) {
-		for (int j = 0; j<cols; ++j) {
-			const Vec3b &point = *(((Vec3b *)(background.data)) + i*cols + j);
-			int s = point[0] + point[1] + point[2];
-			MinMaxRowCol(minRow, maxRow, minCol, maxCol, i, j, s);
-		}
+	if (minRow==-1){
+		minRow=0;
+	}
+	if (maxRow==-1){
+		maxRow=rows-1;
+	}
+	if (minCol==-1){
+		minCol=0;
+	}
+	if (maxCol==-1){
+		maxCol=cols-1;
 	}
 
-	int currentStep = 1;
-	int framesCount = 0;
-	Mat previous = Mat::zeros(0, 0, CV_8UC3);
-	int **flag = GetIntMatrix(rows, cols, true);
-	int **suddenlyChanged = GetIntMatrix(rows, cols, true);
+	int integerThreshold=BackgroundDistance::IntegerThreshold(threshold);
+	ParallelForRows(minRow, maxRow+1, [&](int begin, int end){
+		for (int i=begin;i<end;++i){
+			kernel.Row(img.data+3*(i*cols+minCol), background.data+3*(i*cols+minCol), maxCol-minCol+1, NULL, mask[i]+minCol, integerThreshold);
+		}
+	});
 
-	int spreadCount = 0;
-	int **spreadData = GetIntMatrix(rows, cols, true);
+}
 
-	GetForegroundFlag(preImg, background, terrainMask, threshold, greenThreshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+//common part of all GetForegroundFlag overloads, suddenlyChanged is reset wherever the pixel inside the terrain is not foreground
+//only the spans of the terrain inside of the ROI go through the kernel, the rest of the ROI is cleared
+void GetForegroundFlag(Mat img, Mat background, const SpanMask &terrain, const BackgroundDistance &kernel, double threshold, Plane<uchar> &flag, Plane<uchar> *suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
 
-	Mat testImgMine = Mat::zeros(rows, cols, CV_8UC1);
-	for (int i = 0; i < rows; ++i) {
-		for (int j = 0; j < cols; ++j) {
-			*(((uchar *)(testImgMine.data)) + i*cols + j) = 255 * flag[i][j];
-		}
+	int rows=img.rows;
+	int cols=img.cols;
+
+	if (minRow==-1){
+		minRow=0;
+	}
+	if (maxRow==-1){
+		maxRow=rows-1;
+	}
+	if (minCol==-1){
+		minCol=0;
+	}
+	if (maxCol==-1){
+		maxCol=cols-1;
 	}
-	Mat element = getStructuringElement(CV_SHAPE_ELLIPSE, Size(3, 3), Point(1, 1));
-	//morphologyEx(testImgMine, testImgMine, 3, element);
-	vector<vector<Point> > contours;
-	vector<Vec4i> hierarchy;
-	Mat imageCopy = testImgMine.clone();
-	findContours(imageCopy, contours, hierarchy, CV_RETR_EXTERNAL, CHAIN_APPROX_TC89_KCOS);
-	imshow("testImgMine", testImgMine);
 
-	/*vector<vector<Position> > groups;
-	GetGroups(flag, img.rows, img.cols, groups, uf, false, minRow, maxRow, minCol, maxCol);
+	if (maxCol<minCol){
+		return;
+	}
 
-	vector<TrackingData*> trackedGroups;
-	set<TrackingData*, TrackingData::DisposedComparison> disposedGroups;
+	int integerThreshold=BackgroundDistance::IntegerThreshold(threshold);
+	Span roi(minCol, maxCol+1);
 
-	for (int i = 0; i<groups.size(); ++i) {
-		trackedGroups.push_back(new TrackingData(groups[i]));
-	}
+	ParallelForRows(minRow, maxRow+1, [&](int begin, int end){
+		for (int i=begin;i<end;++i){
+			const Span *first=&roi;
+			const Span *last=&roi+1;
+			if (terrain.Empty()==false){
+				memset(flag[i]+minCol, 0, maxCol-minCol+1);
+				first=terrain.RowBegin(i);
+				last=terrain.RowEnd(i);
+			}
+			for (const Span *span=first;span!=last;++span){
+				int b=max(span->begin, minCol);
+				int e=min(span->end, maxCol+1);
+				if (e<=b){
+					continue;
+				}
+				kernel.Row(img.data+3*(i*cols+b), background.data+3*(i*cols+b), e-b, NULL, flag[i]+b, integerThreshold);
+				if (suddenlyChanged!=NULL){
+					for (int j=b;j<e;++j){
+						if (flag[i][j]==0){
+							(*suddenlyChanged)[i][j]=0;
+						}
+					}
+				}
+			}
+		}
+	});
 
-	int **visited = GetIntMatrix(rows, cols, true);
+}
 
-	TrackingData ***owners = GetTrackingDataPointerMatrix(rows, cols, true);*/
+void GetForegroundFlag(Mat img, Mat background, const Plane<uchar> &terrainMask, const BackgroundDistance &kernel, double threshold, Plane<uchar> &flag, Plane<uchar> *suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlag(img, background, terrainMask.Empty()==true ? SpanMask() : SpanMask(terrainMask), kernel, threshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+}
 
-	VideoCapture video = VideoCapture(videoPath);
+void GetForegroundFlag(Mat img, Mat background, const Plane<uchar> &terrainMask, double threshold, Plane<uchar> &flag, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlag(img, background, terrainMask, BackgroundDistance(), threshold, flag, NULL, minRow, maxRow, minCol, maxCol);
+}
 
-	Mat currentMask;
-	int currentMaskCounter = 1;
-	int currentMaskReset = 50;
+void GetForegroundFlag(Mat img, Mat background, const Plane<uchar> &terrainMask, double threshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlag(img, background, terrainMask, BackgroundDistance(), threshold, flag, &suddenlyChanged, minRow, maxRow, minCol, maxCol);
+}
 
-	int visitCount = 0;
+void GetForegroundFlag(Mat img, Mat background, const Plane<uchar> &terrainMask, double threshold, double greenThreshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlag(img, background, terrainMask, BackgroundDistance(greenThreshold), threshold, flag, &suddenlyChanged, minRow, maxRow, minCol, maxCol);
+}
 
-	while (true) {
-		++framesCount;
+void GetForegroundFlag(Mat img, Mat background, const SpanMask &terrain, double threshold, double greenThreshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlag(img, background, terrain, BackgroundDistance(greenThreshold), threshold, flag, &suddenlyChanged, minRow, maxRow, minCol, maxCol);
+}
 
-		cameraMoved = false;
+void GetForegroundFlagWithRespectToPreviousFrameAndBackground2(Mat img, Mat previous, Mat background, const Plane<uchar> &terrainMask, double threshold, double thresholdForPrevious, double greenThreshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	
+	if (suddenlyChanged.Empty()==true){
+		GetForegroundFlag(img, background, terrainMask, threshold, flag, minRow, maxRow, minCol, maxCol);
+	} else{
+		GetForegroundFlag(img, background, terrainMask, threshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+	}
 
-		Mat img;
-		video >> img;
+	int rows=img.rows;
+	int cols=img.cols;
 
-		if (img.empty()) {
-			break;
-		}
+	if (minRow==-1){
+		minRow=0;
+	}
+	if (maxRow==-1){
+		maxRow=rows-1;
+	}
+	if (minCol==-1){
+		minCol=0;
+	}
+	if (maxCol==-1){
+		maxCol=cols-1;
+	}
 
-		if (previous.rows != 0) {
-			double difference = CalculateApproximateDifference2(img, previous, cameraMovedStep, terrainMask, pixelChangedThreshold);
-			//printf("%lf\n", difference);
-			if (cameraMovedThreshold<difference) {
-				printf("%lf\n", difference);
-				if (cameraWasMoving == false) {
-					previous.copyTo(lastGoodImage);
+	ChromaticityClassifier classifier(redLower, redUpper, greenLower, greenUpper);
+	BackgroundDistance previousDistance(greenThreshold, 0, false);
+
+	for (int i=minRow;i<=maxRow;++i){
+		for (int j=minCol;j<=maxCol;++j){
+			if (flag[i][j]!=0){
+				Vec3b backgroundPoint=*(((Vec3b *)(background.data))+i*cols+j);
+				if (backgroundPoint[0]!=0 || backgroundPoint[1]!=0 || backgroundPoint[2]){
+					const Vec3b point=*(((Vec3b *)(img.data))+i*cols+j);
+					const Vec3b previousPoint=*(((Vec3b *)(previous.data))+i*cols+j);
+				
+					int d=previousDistance.Distance(&point[0], &previousPoint[0]);
+					
+					if (thresholdForPrevious<d){
+						suddenlyChanged[i][j]=1;
+					}
+					//if (suddenlyChanged[i][j]==0){
+					if (suddenlyChanged[i][j]==0 && IsForegroundPixel2(point, classifier)==false){
+						flag[i][j]=0;
+					}
 				}
-				cameraWasMoving = true;
-				//the line below is to disable possible usage of terrain for factors recalculation in a potentially critical moment when the terrain selection may not be valid anymore
-				++chromaticityBoundsCalculationCount;
 			}
-			else {
-				if (cameraWasMoving == true) {
-					printf("Camera moved.\n");
+		}
+	}
 
-					double difference = CalculateApproximateDifference2(img, lastGoodImage, cameraMovedStep, terrainMask, pixelChangedThreshold);
+}
 
-					if (difference <= cameraMovedThreshold) {
-						printf("However, it returned to the beginning again.");
-					}
-					else {
-						Beep3();
+//same result as GetForegroundFlagWithRespectToPreviousFrameAndBackground2 with suddenlyChanged, but background, img and previous are read only once
+//every span of the terrain is first run through the distance and chromaticity kernels into small buffers that stay in the cache and then combined
+void GetForegroundFlagWithRespectToPreviousFrameAndBackground3(Mat img, Mat previous, Mat background, const SpanMask &terrain, double threshold, double thresholdForPrevious, double greenThreshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
 
-						img.copyTo(terrainSelectionImg);
-						terrainMask = SelectTerrain(f);
-						CreateMaskFromFlags(terrainMask, terrainMaskImg, rows, cols);
-						imshow("terrain", terrainMaskImg);
+	int rows=img.rows;
+	int cols=img.cols;
 
-						if (terrainSelectionActionsPerformed == true) {
-							cameraMoved = true;
+	if (minRow==-1){
+		minRow=0;
+	}
+	if (maxRow==-1){
+		maxRow=rows-1;
+	}
+	if (minCol==-1){
+		minCol=0;
+	}
+	if (maxCol==-1){
+		maxCol=cols-1;
+	}
 
-							forceModelBuilding = true;
-							printf("Clearing background.\n");
-							bf->Clear();
-							//delete bf;
-							//bf=new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
+	int n=maxCol-minCol+1;
+	if (n<=0){
+		return;
+	}
 
-							currentMaskCounter = 1;
-						}
-					}
+	ChromaticityClassifier classifier(redLower, redUpper, greenLower, greenUpper);
+	BackgroundDistance backgroundDistance;
+	BackgroundDistance previousDistance(greenThreshold, 0, false);
+	int integerThreshold=BackgroundDistance::IntegerThreshold(threshold);
+	int integerThresholdForPrevious=BackgroundDistance::IntegerThreshold(thresholdForPrevious);
+	Span roi(minCol, maxCol+1);
+
+	ParallelForRows(minRow, maxRow+1, [&](int begin, int end){
+		vector<int> previousRow(n);
+		vector<uchar> grassRow(n);
+
+		for (int i=begin;i<end;++i){
+			const Span *first=&roi;
+			const Span *last=&roi+1;
+			if (terrain.Empty()==false){
+				memset(flag[i]+minCol, 0, n);
+				first=terrain.RowBegin(i);
+				last=terrain.RowEnd(i);
+			}
+
+			for (const Span *span=first;span!=last;++span){
+				int b=max(span->begin, minCol);
+				int e=min(span->end, maxCol+1);
+				if (e<=b){
+					continue;
 				}
 
-				img.copyTo(lastGoodImage);
-				cameraWasMoving = false;
-			}
-		}
-		--currentMaskCounter;
-		if (currentMaskCounter == 0) {
-			currentMaskCounter = currentMaskReset;
+				const uchar *imgRow=img.data+3*(i*cols+b);
+				uchar *flagRow=flag[i]+b;
+				uchar *suddenlyChangedRow=suddenlyChanged[i]+b;
 
-			bool combineWithPrevious = false;
-			GetFilledBackgroundMask2(img, &currentBackgroundFlag, uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, combineWithPrevious);
-			int initialRow = 0;
-			int initialCol = 0;
-			if (cameraMoved == true) {
-				CalculateCenter(currentMask, initialRow, initialCol);
+				backgroundDistance.Row(imgRow, background.data+3*(i*cols+b), e-b, NULL, flagRow, integerThreshold);
+				previousDistance.Row(imgRow, previous.data+3*(i*cols+b), e-b, &previousRow[0], NULL);
+				classifier.ClassifyRow(imgRow, &grassRow[0], e-b);
+
+				for (int j=0;j<e-b;++j){
+					if (flagRow[j]==0){
+						suddenlyChangedRow[j]=0;
+						continue;
+					}
+					if (integerThresholdForPrevious<previousRow[j]){
+						suddenlyChangedRow[j]=1;
+					}
+					if (suddenlyChangedRow[j]==0){
+						//the same as IsForegroundPixel2 with its default green threshold
+						const uchar *point=imgRow+3*j;
+						bool foreground=point[0]+point[1]+point[2]!=0 && (grassRow[j]==0 || point[1]<=35);
+						if (foreground==false){
+							flagRow[j]=0;
+						}
+					}
+				}
 			}
-			CreateMaskFromFlags(currentBackgroundFlag, currentMask, rows, cols);
-			//imshow("cm", currentMask);
 		}
+	});
 
-		--currentStep;
-		if (currentStep == 0 || forceModelBuilding == true) {
-			if (forceModelBuilding == false) {
-				currentStep = step;
-			}
+}
 
-			bf->Add(img);
+void GetForegroundFlagWithRespectToPreviousFrameAndBackground3(Mat img, Mat previous, Mat background, const Plane<uchar> &terrainMask, double threshold, double thresholdForPrevious, double greenThreshold, Plane<uchar> &flag, Plane<uchar> &suddenlyChanged, double redLower=0.3450, double redUpper=0.3661, double greenLower=0.4600, double greenUpper=0.5075, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	GetForegroundFlagWithRespectToPreviousFrameAndBackground3(img, previous, background, terrainMask.Empty()==true ? SpanMask() : SpanMask(terrainMask), threshold, thresholdForPrevious, greenThreshold, flag, suddenlyChanged, redLower, redUpper, greenLower, greenUpper, minRow, maxRow, minCol, maxCol);
+}
 
-			if (bf->size == n || forceModelBuilding == true) {
-				bf->GetBackground(background);
-				minRow = bf->minRow;
-				maxRow = bf->maxRow;
-				minCol = bf->minCol;
-				maxCol = bf->maxCol;
-			}
-			if (bf->size == n) {
-				forceModelBuilding = false;
-				currentStep = step;
-			}
-		}
+//statistics of one 4-connected foreground component, touchesBorder is set if any of its pixels is on the border of the image
+struct ComponentStats{
+	//the label of the component in the label plane
+	int label;
+	int area;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+	long long rowSum;
+	long long colSum;
+	bool touchesBorder;
 
-		/*++spreadCount;
-		++visitCount;
-		vector<bool> isTaken;
-		set<TrackingData*, TrackingData::DisposedComparison> currentlyDisposedGroups;
-		for (int gi = 0; gi<trackedGroups.size(); ++gi) {
+	ComponentStats():label(0), area(0), minRow(-1), maxRow(-1), minCol(-1), maxCol(-1), rowSum(0), colSum(0), touchesBorder(false){}
 
-			Position seedPosition;
-			Spread(trackedGroups[gi]->positions, img, background, terrainMask, greenThreshold, flag, spreadData, visited, spreadCount, visitCount, seedPosition, false);
+	void Add(int i, int j, bool border){
+		++area;
+		MinMaxRowColWithCount(minRow, maxRow, minCol, maxCol, i, j);
+		rowSum+=i;
+		colSum+=j;
+		touchesBorder|=border;
+	}
 
-			bool takeIt = Visit(trackedGroups[gi], img, background, terrainMask, greenThreshold, visited, visitCount, seedPosition, scanningAttempts, threshold, minimumGroupSize, owners, false, maximumWidth, maximumHeight, remainingFactor);
+	void Merge(const ComponentStats &other){
+		area+=other.area;
+		MergeMinMaxRowCol(minRow, maxRow, minCol, maxCol, other.minRow, other.maxRow, other.minCol, other.maxCol);
+		rowSum+=other.rowSum;
+		colSum+=other.colSum;
+		touchesBorder|=other.touchesBorder;
+	}
 
-			isTaken.push_back(takeIt);
+	double CentroidRow() const{
+		return rowSum/(double)area;
+	}
 
-		}
+	double CentroidCol() const{
+		return colSum/(double)area;
+	}
+};
 
-		for (int gi = 0; gi<isTaken.size(); ++gi) {
-			if (isTaken[gi] == false && trackedGroups[gi]->pushedOut == false) {
+//two pass labeling of the 4-connected components of flag==1 over bands of rows run on the thread pool:
+//every band is labeled on its own, the bands are merged along their first rows and the labels are then resolved in parallel
+//the root of every component is its first pixel in raster order, so the labels 1..components.size() follow the raster order
+struct ComponentLabeler{
+	Plane<int> parent;
+	vector<ComponentStats> components;
 
-				vector<Position> positions;
-				GetWiderAreaPositions(trackedGroups[gi], positions, rows, cols, 25, 3);
+	//only modifies the parents of the pixels in the same band as x, except during the serial merging of the bands
+	int Find(int x){
+		while (parent.Data()[x]!=x){
+			parent.Data()[x]=parent.Data()[parent.Data()[x]];
+			x=parent.Data()[x];
+		}
+		return x;
+	}
 
-				Position seedPosition;
-				Spread(positions, img, background, terrainMask, greenThreshold, flag, spreadData, visited, spreadCount, visitCount, seedPosition, false);
+	int FindWithoutCompression(int x) const{
+		while (parent.Data()[x]!=x){
+			x=parent.Data()[x];
+		}
+		return x;
+	}
 
-				bool takeIt = Visit(trackedGroups[gi], img, background, terrainMask, greenThreshold, visited, visitCount, seedPosition, scanningAttempts, threshold, minimumGroupSize, owners, false, maximumWidth, maximumHeight, remainingFactor);
+	void Union(int x, int y){
+		int px=Find(x);
+		int py=Find(y);
+		if (px<py){
+			parent.Data()[py]=px;
+		} else if (py<px){
+			parent.Data()[px]=py;
+		}
+	}
 
-				if (takeIt == false && trackedGroups[gi]->pushedOut == true) {
-					trackedGroups[gi]->pushedOut = false;
-				}
+	//labels are 0 for the background and for everything outside of the ROI, returns the number of components
+	int Label(const Plane<uchar> &flag, Plane<int> &labels, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+		int rows=flag.rows;
+		int cols=flag.cols;
 
-				isTaken[gi] = takeIt;
+		if (minRow==-1){
+			minRow=0;
+		}
+		if (maxRow==-1){
+			maxRow=rows-1;
+		}
+		if (minCol==-1){
+			minCol=0;
+		}
+		if (maxCol==-1){
+			maxCol=cols-1;
+		}
 
-				if (takeIt == true) {
-					//printf("%d %d taken after wider area rescanning\n", framesCount, gi);
-				}
+		if (parent.rows!=rows || parent.cols!=cols){
+			parent.Create(rows, cols);
+		}
+		if (labels.rows!=rows || labels.cols!=cols){
+			labels.Create(rows, cols);
+		}
+		components.clear();
 
+		for (int i=0;i<rows;++i){
+			if (i<minRow || maxRow<i){
+				memset(labels[i], 0, cols*sizeof(int));
 			}
+		}
+		if (maxRow<minRow || maxCol<minCol){
+			return 0;
+		}
 
-			if (isTaken[gi] == true) {
-				if (trackedGroups[gi]->previous.size() >= 2) {
-					BoundingBox before = trackedGroups[gi]->previous[trackedGroups[gi]->previous.size() - 2];
-					BoundingBox after = trackedGroups[gi]->previous[trackedGroups[gi]->previous.size() - 1];
-					int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
-					int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+		int bandsCount=min(GetThreadPool().threadsCount*2, (maxRow-minRow+1+15)/16);
+		if (bandsCount<1){
+			bandsCount=1;
+		}
+		vector<int> bandStart(bandsCount+1);
+		for (int b=0;b<=bandsCount;++b){
+			bandStart[b]=minRow+(int)((long long)(maxRow-minRow+1)*b/bandsCount);
+		}
 
-					if (areaAfter * 3<areaBefore) {
-						//printf("%d Alert!\n", framesCount);
-						redetectCount = 1;
+		//the first pass, every band on its own
+		ParallelForRows(0, bandsCount, [&](int begin, int end){
+			for (int b=begin;b<end;++b){
+				for (int i=bandStart[b];i<bandStart[b+1];++i){
+					memset(labels[i], 0, cols*sizeof(int));
+					for (int j=minCol;j<=maxCol;++j){
+						if (flag[i][j]==1){
+							int p=i*cols+j;
+							parent.Data()[p]=p;
+							if (j>minCol && flag[i][j-1]==1){
+								Union(p, p-1);
+							}
+							if (i>bandStart[b] && flag[i-1][j]==1){
+								Union(p, p-cols);
+							}
+						}
 					}
 				}
 			}
-		}
+		}, 1);
 
-		//checking if a group is too long fully outside of the terrain
-		for (int i = 0; i<isTaken.size(); ++i) {
-			if (isTaken[i] == true) {
-				int inside = CountPositionsInsideTerrain(trackedGroups[i]->positions, terrainMaskImg);
-				if (inside == 0) {
-					++trackedGroups[i]->framesOutsideOfTerrain;
-					if (allowedFramesOutsideOfTerrain<trackedGroups[i]->framesOutsideOfTerrain) {
-						trackedGroups[i]->framesOutsideOfTerrain = 0;
-						isTaken[i] = false;
-					}
+		for (int b=1;b<bandsCount;++b){
+			int i=bandStart[b];
+			for (int j=minCol;j<=maxCol;++j){
+				if (flag[i][j]==1 && flag[i-1][j]==1){
+					Union(i*cols+j, (i-1)*cols+j);
 				}
 			}
 		}
 
-		vector<TrackingData*> newTrackedGroups;
-		for (int i = 0; i<isTaken.size(); ++i) {
-			if (isTaken[i] == true) {
-				trackedGroups[i]->lastFrame = framesCount;
-				newTrackedGroups.push_back(trackedGroups[i]);
+		//only the roots get their labels, band after band in raster order
+		vector<int> firstLabel(bandsCount+1, 1);
+		ParallelForRows(0, bandsCount, [&](int begin, int end){
+			for (int b=begin;b<end;++b){
+				int rootsCount=0;
+				for (int i=bandStart[b];i<bandStart[b+1];++i){
+					for (int j=minCol;j<=maxCol;++j){
+						int p=i*cols+j;
+						if (flag[i][j]==1 && parent.Data()[p]==p){
+							++rootsCount;
+						}
+					}
+				}
+				firstLabel[b+1]=rootsCount;
 			}
-			else {
-				currentlyDisposedGroups.insert(trackedGroups[i]);
+		}, 1);
+		for (int b=0;b<bandsCount;++b){
+			firstLabel[b+1]+=firstLabel[b];
+		}
+		components.resize(firstLabel[bandsCount]-1);
+		for (int k=0;k<components.size();++k){
+			components[k].label=k+1;
+		}
+
+		ParallelForRows(0, bandsCount, [&](int begin, int end){
+			for (int b=begin;b<end;++b){
+				int label=firstLabel[b];
+				for (int i=bandStart[b];i<bandStart[b+1];++i){
+					for (int j=minCol;j<=maxCol;++j){
+						int p=i*cols+j;
+						if (flag[i][j]==1 && parent.Data()[p]==p){
+							labels[i][j]=label++;
+						}
+					}
+				}
 			}
-			trackedGroups[i]->isTracked = isTaken[i];
-		}*/
+		}, 1);
+
+		//the components starting in a band are counted directly, the ones that started in an earlier band are counted apart and merged afterwards
+		vector<vector<pair<int, ComponentStats> > > continued(bandsCount);
+		ParallelForRows(0, bandsCount, [&](int begin, int end){
+			for (int b=begin;b<end;++b){
+				vector<pair<int, ComponentStats> > &bandContinued=continued[b];
+				int last=-1;
+				for (int i=bandStart[b];i<bandStart[b+1];++i){
+					for (int j=minCol;j<=maxCol;++j){
+						if (flag[i][j]!=1){
+							continue;
+						}
+						int p=i*cols+j;
+						int root=parent.Data()[p]==p ? p : FindWithoutCompression(p);
+						int label=labels.Data()[root];
+						if (root!=p){
+							labels[i][j]=label;
+						}
+						bool border=i==0 || j==0 || i==rows-1 || j==cols-1;
+						if (firstLabel[b]<=label){
+							components[label-1].Add(i, j, border);
+						} else{
+							if (last==-1 || bandContinued[last].first!=label){
+								last=-1;
+								for (int k=0;k<bandContinued.size();++k){
+									if (bandContinued[k].first==label){
+										last=k;
+										break;
+									}
+								}
+								if (last==-1){
+									last=bandContinued.size();
+									bandContinued.push_back(make_pair(label, ComponentStats()));
+								}
+							}
+							bandContinued[last].second.Add(i, j, border);
+						}
+					}
+				}
+			}
+		}, 1);
 
-		if (--chromaticityBoundsCalculationCount == 0) {
-			chromaticityBoundsCalculationCount = chromaticityBoundsCalculationStep;
-			CalculateColorChromaticityBounds(img, terrainMaskImg, redLower, redUpper, greenLower, greenUpper, spreadFactor);
-			bf->redLower = redLower;
-			bf->redUpper = redUpper;
-			bf->greenLower = greenLower;
-			bf->greenUpper = greenUpper;
+		for (int b=0;b<bandsCount;++b){
+			for (int k=0;k<continued[b].size();++k){
+				components[continued[b][k].first-1].Merge(continued[b][k].second);
+			}
 		}
-		
-		//vector<TrackingData*> newlyFoundGroups;
-		if (--redetectCount == 0) {
-			redetectCount = redetectStep;
 
-			if (previous.rows == 0) {
-				GetForegroundFlag(img, background, terrainMask, threshold, greenThreshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
-			}
-			else {
-				GetForegroundFlagWithRespectToPreviousFrameAndBackground2(img, previous, background, terrainMask, threshold, thresholdForPrevious, greenThreshold, flag, suddenlyChanged, redLower, redUpper, greenLower, greenUpper, minRow, maxRow, minCol, maxCol);
-			}
+		return components.size();
+	}
+};
 
-			for (int i = 0; i < rows; ++i) {
-				for (int j = 0; j < cols; ++j) {
-					*(((uchar *)(testImgMine.data)) + i*cols + j) = 255 * flag[i][j];
-				}
-			}
-			Mat imageCopy = testImgMine.clone();
-			morphologyEx(testImgMine, testImgMine, 3, element);
-			imshow("testImgMine", testImgMine);			
-			morphologyEx(imageCopy, imageCopy, 4, element);
-			findContours(imageCopy, contours, hierarchy, CV_RETR_EXTERNAL, CHAIN_APPROX_TC89_KCOS);
-						
-			imshow("testImgMineNew", imageCopy);
+//the stats of the components that do not touch the border of the image, in the raster order of their first pixels,
+//the pixels of a group are the ones with its label in labels; a component with any pixel on the border of the image is dropped as a whole,
+//the labeler and the planes are kept by the caller so nothing is allocated once their sizes are reached
+void GetGroups(const Plane<uchar> &flag, vector<ComponentStats> &groups, ComponentLabeler &labeler, Plane<int> &labels, int minRow=-1, int maxRow=-1, int minCol=-1, int maxCol=-1){
+	int componentsCount=labeler.Label(flag, labels, minRow, maxRow, minCol, maxCol);
 
-			/*
-			vector<vector<Position>> groups;
-			GetGroups(flag, img.rows, img.cols, groups, uf, false, minRow, maxRow, minCol, maxCol);
+	groups.clear();
+	for (int k=0;k<componentsCount;++k){
+		if (labeler.components[k].touchesBorder==false){
+			groups.push_back(labeler.components[k]);
+		}
+	}
+}
 
-			for (int gi = 0; gi<groups.size(); ++gi) {
-				const vector<Position> &group = groups[gi];
+enum BoundingBoxType{
+	NORMAL=0,
+	PUSHED_OUT=1,
+	PUSHER=2,
+	FILLED=4
+};
 
-				bool take = true;
-				for (int i = 0; i<group.size(); ++i) {
-					if (visited[group[i].row][group[i].col] == visitCount) {
-						take = false;
-						break;
-					}
-				}
+struct BoundingBox{
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+	int frame;
+	int type;
+	Vec3b meanColor;
+	BoundingBox(int minRow=0, int maxRow=0, int minCol=0, int maxCol=0, int frame=0, int type=0, Vec3b meanColor=Vec3b(0, 0, 0)):minRow(minRow), maxRow(maxRow), minCol(minCol), maxCol(maxCol), frame(frame), type(type), meanColor(meanColor){}
+};
 
-				//if (take==true && group.size()>=minimumGroupSize){
-				if (take == true && group.size() >= minimumGroupSizeAtFirstDetection) {
-					TrackingData *newGroup = new TrackingData(group);
-					newGroup->isTracked = true;
-					newlyFoundGroups.push_back(newGroup);
-					//isRescanned.push_back(false);
-				}
-			}
-			*/
+void GetBoundingBox(const vector<Position> &points, int &minRow, int &maxRow, int &minCol, int &maxCol){
+	int n=points.size();
+	if (n==0){
+		return;
+	}
+	minRow=points[0].row;
+	maxRow=minRow;
+	minCol=points[0].col;
+	maxCol=minCol;
+	for (int i=0;i<n;++i){
+		int cr=points[i].row;
+		int cc=points[i].col;
+		if (cr<minRow){
+			minRow=cr;
+		}
+		if (maxRow<cr){
+			maxRow=cr;
 		}
+		if (cc<minCol){
+			minCol=cc;
+		}
+		if (maxCol<cc){
+			maxCol=cc;
+		}
+				
+	}
+	
+}
 
-		/*for (int i = 0; i<newTrackedGroups.size(); ++i) {
-			newTrackedGroups[i]->CalculateMeanColor(img);
-			newTrackedGroups[i]->CalculateMeanPosition();
-		}*/
+BoundingBox GetBoundingBox(const vector<Position> &points){
+	int n=points.size();
+	if (n==0){
+		return BoundingBox(-1, -1, -1, -1);
+	}
+	int minRow=points[0].row;
+	int maxRow=minRow;
+	int minCol=points[0].col;
+	int maxCol=minCol;
+	for (int i=0;i<n;++i){
+		int cr=points[i].row;
+		int cc=points[i].col;
+		if (cr<minRow){
+			minRow=cr;
+		}
+		if (maxRow<cr){
+			maxRow=cr;
+		}
+		if (cc<minCol){
+			minCol=cc;
+		}
+		if (maxCol<cc){
+			maxCol=cc;
+		}
+				
+	}
+	
+	return BoundingBox(minRow, maxRow, minCol, maxCol);
+}
 
-		/*
-		if (newlyFoundGroups.size()>0) {
-			for (int i = 0; i<newlyFoundGroups.size(); ++i) {
-				newlyFoundGroups[i]->CalculateMeanColor(img);
-				newlyFoundGroups[i]->CalculateMeanPosition();
+void DrawRectangle(Mat &img, int minRow, int maxRow, int minCol, int maxCol, int size=-1){
+	double height=maxRow-minRow;
+	double width=maxCol-minCol;
 
-				TrackingData *add = newlyFoundGroups[i];
+	Scalar drawColor=Scalar(0, 0, 255);
+	if (height*1.5<width || width*10<height || (size!=-1 && size*5<height*width)){
+		drawColor=Scalar(255, 0, 0);
+	}
 
-				//STATISTICS for reconnecting rules
-				//first, determine close groups
-				vector<pair<int, TrackingData*> > closeTracked;
-				for (int j = 0; j<newTrackedGroups.size(); ++j) {
-					TrackingData *tracked = newTrackedGroups[j];
-					if (tracked->meanPosition.row != -1) {
-						int dr = newlyFoundGroups[i]->meanPosition.row - tracked->meanPosition.row;
-						dr *= dr;
-						int dc = newlyFoundGroups[i]->meanPosition.col - tracked->meanPosition.col;
-						dc *= dc;
-						int d = dr + dc;
-						if (d <= sameGroupFieldDistance*sameGroupFieldDistance) {
-							closeTracked.push_back(make_pair(d, tracked));
-						}
-					}
-				}
+	rectangle(img, Point(minCol, minRow), Point(maxCol, maxRow), drawColor);
+}
 
-				auto closeComparison = [](const pair<int, TrackingData *> &p1, const pair<int, TrackingData *> &p2) {if (p1.first<p2.first) { return true; }if (p2.first<p1.first) { return false; }return p2.second->lastFrame<p1.second->lastFrame; };
-				sort(closeTracked.begin(), closeTracked.end(), closeComparison);
+void DrawRectangles(Mat &img, const vector<BoundingBox> &boundingBoxes){
 
-				//then check whether the closest group has shrunk (lately)
-				bool sizeShrinked = false;
-				bool sizeShrinkedLately = false;
-				if (closeTracked.size()>0 && closeTracked[0].second->previous.size()>0) {
-					BoundingBox before = closeTracked[0].second->previous[closeTracked[0].second->previous.size() - 1];
-					BoundingBox after = GetBoundingBox(closeTracked[0].second->positions);
-					int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
-					int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+	for (int i=0;i<boundingBoxes.size();++i){
+		int minRow=boundingBoxes[i].minRow;
+		int maxRow=boundingBoxes[i].maxRow;
+		int minCol=boundingBoxes[i].minCol;
+		int maxCol=boundingBoxes[i].maxCol;
+		
+		DrawRectangle(img, minRow, maxRow, minCol, maxCol, -1);
+	}
 
-					if (areaAfter*1.5<areaBefore) {
-						sizeShrinked = true;
-					}
+}
 
-					if (sizeShrinked == true) {
-						sizeShrinkedLately = true;
-					}
-					else {
-						int stop = closeTracked[0].second->previous.size() - backFramesToCheckForCloseTracked;
-						if (stop<0) {
-							stop = 0;
-						}
-						for (int j = closeTracked[0].second->previous.size() - 1; j>stop; --j) {
-							BoundingBox before = closeTracked[0].second->previous[j - 1];
-							BoundingBox after = GetBoundingBox(closeTracked[0].second->positions);
+Mat terrainSelectionImg;
+vector<Position> terrainSelectionPositions;
+//the last selected terrain polygon in the coordinates of the frame
+vector<Point> terrainSelectionPolygon;
+Position terrainSelectionPointerPoint;
+const char *terrainSelectionWindowName = "terrain_selection";
+bool terrainSelectionActionsPerformed = false;
+bool terrainSelectionMouseDown = false;
+int terrainSelectionX = 0;
+int terrainSelectionY = 0;
+bool terrainSelectionMovePerformed = false;
 
-							int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
-							int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+bool LineIntersectionExists(double p0_x, double p0_y, double p1_x, double p1_y, double p2_x, double p2_y, double p3_x, double p3_y){
+    
+	double s1_x=p1_x-p0_x;
+	double s1_y=p1_y-p0_y;
+    double s2_x=p3_x-p2_x;
+	double s2_y=p3_y-p2_y;
 
-							if (areaAfter*1.5<areaBefore) {
-								sizeShrinkedLately = true;
-								break;
-							}
-						}
-					}
-				}
+    double s=(-s1_y*(p0_x-p2_x)+s1_x*(p0_y-p2_y))/(-s2_x*s1_y+s1_x*s2_y);
+    double t=(s2_x*(p0_y-p2_y)-s2_y*(p0_x-p2_x))/(-s2_x*s1_y+s1_x*s2_y);
 
-				//next, determine the closest disposed groups
-				vector<pair<int, TrackingData*> > closeDisposed;
-				for (auto si = disposedGroups.rbegin(); si != disposedGroups.rend(); ++si) {
-					TrackingData *disposed = *si;
-					if (framesCount - disposed->lastFrame>backFramesToCheckForStrongClosePushedOut) {
+    if (s>=0 && s<=1 && t>=0 && t<=1){
+        return true;
+    }
+
+    return false;
+}
+
+void TerrainSelectionMouseCallback(int event, int x, int y, int flags, void* userdata){
+	
+	int radius=10;
+	int radiusIdx=-1;
+
+	for (int i=0;i<terrainSelectionPositions.size();++i){
+		int x2=terrainSelectionPositions[i].col;
+		int y2=terrainSelectionPositions[i].row;
+
+		int d=(x-x2)*(x-x2)+(y-y2)*(y-y2);
+		if (d<=radius*radius){
+			radiusIdx=i;
+			break;
+		}
+	}
+
+	if (event==EVENT_LBUTTONDOWN || event==EVENT_MBUTTONDOWN || event==EVENT_RBUTTONDOWN){
+		terrainSelectionMouseDown=true;
+		terrainSelectionMovePerformed=false;
+	}
+
+	bool disregardUp=false;
+	if (event==EVENT_LBUTTONUP || event==EVENT_MBUTTONUP || event==EVENT_RBUTTONUP){
+		terrainSelectionMouseDown=false;
+		disregardUp=terrainSelectionMovePerformed;
+		terrainSelectionMovePerformed=false;
+	}
+
+	if (event==EVENT_LBUTTONUP && disregardUp==false){
+		if (radiusIdx!=-1){
+			
+			terrainSelectionActionsPerformed=true;
+			int n=terrainSelectionPositions.size();
+			bool collision=false;
+			for (int i=radiusIdx;i<n-3;++i){
+				for (int j=i+2;j<n-1;++j){
+					if (LineIntersectionExists(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row, terrainSelectionPositions[i+1].col, terrainSelectionPositions[i+1].row, terrainSelectionPositions[j].col, terrainSelectionPositions[j].row, terrainSelectionPositions[j+1].col, terrainSelectionPositions[j+1].row)==true){
+						collision=true;
 						break;
 					}
-					if (disposed->meanPosition.row != -1) {
-						int dr = newlyFoundGroups[i]->meanPosition.row - disposed->meanPosition.row;
-						int dc = newlyFoundGroups[i]->meanPosition.col - disposed->meanPosition.col;
-						dr *= dr;
-						dc *= dc;
-						int d = dr + dc;
-						int backFrames = sameGroupBackFramesForSpeed;
-						if (disposed->previous.size()<backFrames) {
-							backFrames = disposed->previous.size();
-						}
-						if (backFrames<2) {
-							continue;
-						}
-						int sdr = 0;
-						int sdc = 0;
-						int lastRow = disposed->previous[disposed->previous.size() - backFrames].maxRow;
-						int lastCol = (disposed->previous[disposed->previous.size() - backFrames].maxCol - disposed->previous[disposed->previous.size() - backFrames].minCol) / 2;
-						int estimatedMaximalDistance = 0;
-						for (int i = disposed->previous.size() - backFrames + 1; i<disposed->previous.size(); ++i) {
-							int currentRow = disposed->previous[i].maxRow;
-							int currentCol = (disposed->previous[i].maxCol - disposed->previous[i].minCol) / 2;
-							int sdr = lastRow - currentRow;
-							int sdc = lastCol - currentCol;
-							estimatedMaximalDistance += sqrt(sdr*sdr + sdc*sdc);
-							lastRow = currentRow;
-							lastCol = currentCol;
-						}
-						estimatedMaximalDistance /= backFrames - 1;
-						estimatedMaximalDistance *= framesCount - disposed->lastFrame;
-						d = sqrt(d);
-						if (d <= 1.5*estimatedMaximalDistance) {
-							closeDisposed.push_back(make_pair(d, disposed));
-						}
+				}
+			}
+			
+			if (collision==false){
+				Position add=terrainSelectionPositions[radiusIdx];
+				if (radiusIdx>0){
+					for (int i=0;i<terrainSelectionPositions.size()-radiusIdx;++i){
+						terrainSelectionPositions[i]=terrainSelectionPositions[i+radiusIdx];
 					}
+					terrainSelectionPositions.resize(terrainSelectionPositions.size()-radiusIdx);
+					radiusIdx=0;
 				}
-				sort(closeDisposed.begin(), closeDisposed.end(), closeComparison);
+				terrainSelectionPositions.push_back(add);
+			}
+		} else{
+			terrainSelectionPositions.push_back(Position(y, x));
+		}
+
+	} else if (event==EVENT_RBUTTONUP && disregardUp==false){
+
+		terrainSelectionActionsPerformed=true;
+		terrainSelectionPositions.pop_back();
+		
+	} else if (event==EVENT_MBUTTONUP && disregardUp==false){
+		
+		terrainSelectionActionsPerformed=true;
+		terrainSelectionPositions.clear();
+
+	} else if (event==EVENT_MOUSEMOVE){
+		
+		if (terrainSelectionMouseDown==true){
+			int dx=x-terrainSelectionX;
+			int dy=y-terrainSelectionY;
+			for (int i=0;i<terrainSelectionPositions.size();++i){
+				terrainSelectionPositions[i].col+=dx;
+				terrainSelectionPositions[i].row+=dy;
+			}
+			terrainSelectionMovePerformed=true;
+			terrainSelectionActionsPerformed=true;
+		}
+		terrainSelectionPointerPoint=Position(y, x);
+		terrainSelectionX=x;
+		terrainSelectionY=y;
+	}
+
+	Mat img;
+	terrainSelectionImg.copyTo(img);
+
+	for (int i=1;i<terrainSelectionPositions.size();++i){
+		Point previous=Point(terrainSelectionPositions[i-1].col, terrainSelectionPositions[i-1].row);
+		Point current=Point(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row);
+		line(img, previous, current, Scalar(0, 0, 255));
+	}
+
+	if (terrainSelectionPositions.size()>0 && terrainSelectionMouseDown==false){
+		Point previous=Point(terrainSelectionPositions[terrainSelectionPositions.size()-1].col, terrainSelectionPositions[terrainSelectionPositions.size()-1].row);
+		Point current=Point(terrainSelectionPointerPoint.col, terrainSelectionPointerPoint.row);
+		line(img, previous, current, Scalar(0, 0, 255));
+	}
+
+	for (int i=0;i<terrainSelectionPositions.size();++i){
+		Point center=Point(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row);
+		Scalar color=Scalar(0, 0, 255);
+		if (i==radiusIdx && i!=terrainSelectionPositions.size()-1 && terrainSelectionPositions.size()-i>2){
+			color=Scalar(255, 0, 0);
+		}
+		circle(img, center, radius, color);
+	}
+
+	imshow(terrainSelectionWindowName, img);
+
+}
+
+//keeps only the largest region of the terrain and fills its holes: the even-odd fill of a selection whose edges cross
+//has holes and separate parts, the terrain is a single region without holes either way
+void CleanUpSelectedTerrain(Plane<uchar> &flag, UnionFind &uf){
+	int rows=flag.rows;
+	int cols=flag.cols;
+
+	uf.Clear();
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (flag[i][j]==1){
+				uf.Add(i*cols+j);
+				if (i>0 && flag[i-1][j]==1){
+					uf.Union(i*cols+j, (i-1)*cols+j);
+				}
+				if (j>0 && flag[i][j-1]==1){
+					uf.Union(i*cols+j, i*cols+j-1);
+				}
+			}
+		}
+	}
+
+	//the sizes are only valid at the roots, of equal largest regions the one whose root was added first is kept
+	int largestRoot=-1;
+	for (int k=0;k<uf.added.size();++k){
+		int i=uf.added[k];
+		if (uf.parent[i]==i && (largestRoot==-1 || uf.size[largestRoot]<uf.size[i])){
+			largestRoot=i;
+		}
+	}
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (flag[i][j]==1 && uf.Find(i*cols+j)!=largestRoot){
+				flag[i][j]=0;
+			}
+		}
+	}
+
+	int border=rows*cols;
+	uf.Clear();
+	uf.Add(border);
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (flag[i][j]==0){
+				uf.Add(i*cols+j);
+				if (i==0 || j==0 || i==rows-1 || j==cols-1){
+					uf.Union(i*cols+j, border);
+				}
+				if (i>0 && flag[i-1][j]==0){
+					uf.Union(i*cols+j, (i-1)*cols+j);
+				}
+				if (j>0 && flag[i][j-1]==0){
+					uf.Union(i*cols+j, i*cols+j-1);
+				}
+			}
+		}
+	}
+
+	int borderRoot=uf.Find(border);
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (flag[i][j]==0 && uf.Find(i*cols+j)!=borderRoot){
+				flag[i][j]=1;
+			}
+		}
+	}
+}
+
+//the terrain mask of a selected or stored polygon, the same for both
+void RasterizeTerrainPolygon(const vector<Point> &polygon, int rows, int cols, Plane<uchar> &terrainMask){
+	SpanMask terrainSpans;
+	terrainSpans.FromPolygon(polygon, rows, cols);
+	terrainSpans.ToPlane(terrainMask);
+	UnionFind uf(rows*cols+1);
+	CleanUpSelectedTerrain(terrainMask, uf);
+}
+
+//one "column row" line per point of the polygon
+bool SaveTerrainPolygon(const char *path, const vector<Point> &polygon){
+	FILE *output=fopen(path, "w");
+	if (output==NULL){
+		return false;
+	}
+	for (int i=0;i<polygon.size();++i){
+		fprintf(output, "%d %d\n", polygon[i].x, polygon[i].y);
+	}
+	return fclose(output)==0;
+}
+
+bool LoadTerrainPolygon(const char *path, vector<Point> &polygon){
+	FILE *input=fopen(path, "r");
+	if (input==NULL){
+		return false;
+	}
+	polygon.clear();
+	int x, y;
+	while (fscanf(input, "%d %d", &x, &y)==2){
+		polygon.push_back(Point(x, y));
+	}
+	fclose(input);
+	return polygon.size()>=3;
+}
+
+//finds the terrain without any interaction: the filled grass component of every added frame is averaged over the frames with
+//exponential forgetting, the pixels inside of it in most of the recent frames are the terrain and its outer contour is simplified to a polygon
+struct TerrainDetector{
+	//the weight of the newest frame in the average
+	double smoothing;
+	//the largest distance of the polygon from the contour as a part of the contour length
+	double simplification;
+	double previousSizeThreshold;
+	Plane<float> coverage;
+	Plane<uchar> flag;
+	//owned by the detector, so the detector can not be copied
+	unique_ptr<UnionFind> uf;
+	int addedCount;
+
+	TerrainDetector(double smoothing=0.2, double simplification=0.005, double previousSizeThreshold=2.0):smoothing(smoothing), simplification(simplification), previousSizeThreshold(previousSizeThreshold){
+		addedCount=0;
+	}
+
+	//the frames added before are forgotten, e.g. after the camera moved to another part of the pitch
+	void Reset(){
+		addedCount=0;
+	}
+
+	void Add(const Mat &img, double redLower, double redUpper, double greenLower, double greenUpper){
+		int rows=img.rows;
+		int cols=img.cols;
+		if (uf==nullptr){
+			flag.Create(rows, cols);
+			coverage.Create(rows, cols, true);
+			uf.reset(new UnionFind(rows*cols+1));
+		}
+
+		GetFilledBackgroundMask2(img, flag, *uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, false);
+
+		float alpha=addedCount==0 ? 1.0f : (float)smoothing;
+		ParallelForRows(0, rows, [&](int begin, int end){
+			for (int i=begin;i<end;++i){
+				float *c=coverage[i];
+				const uchar *f=flag[i];
+				for (int j=0;j<cols;++j){
+					c[j]+=alpha*(f[j]-c[j]);
+				}
+			}
+		});
+		++addedCount;
+	}
+
+	//the camera moved by (dx, dy), the uncovered pixels were not seen as grass yet
+	void Translate(int dx, int dy){
+		if (coverage.Empty()==false){
+			TranslateMat(coverage.mat, dx, dy);
+		}
+	}
+
+	//the polygon around the largest region covered in at least half of the recent frames and the terrain mask inside of it,
+	//false if no frame was added or no such region was found
+	bool GetTerrain(vector<Point> &polygon, Plane<uchar> &terrainMask) const{
+		if (addedCount==0){
+			return false;
+		}
+		int rows=coverage.rows;
+		int cols=coverage.cols;
+
+		Mat covered(rows, cols, CV_8UC1);
+		for (int i=0;i<rows;++i){
+			const float *c=coverage[i];
+			uchar *row=covered.ptr<uchar>(i);
+			for (int j=0;j<cols;++j){
+				row[j]=0.5f<=c[j] ? 255 : 0;
+			}
+		}
+
+		vector<vector<Point> > contours;
+		findContours(covered, contours, CV_RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+		int largest=-1;
+		double largestArea=0;
+		for (int i=0;i<contours.size();++i){
+			double area=contourArea(contours[i]);
+			if (largestArea<area){
+				largestArea=area;
+				largest=i;
+			}
+		}
+		if (largest==-1){
+			return false;
+		}
+
+		approxPolyDP(contours[largest], polygon, simplification*arcLength(contours[largest], true), true);
+		if (polygon.size()<3){
+			return false;
+		}
+		SpanMask terrainSpans;
+		terrainSpans.FromPolygon(polygon, rows, cols);
+		terrainSpans.ToPlane(terrainMask);
+		return true;
+	}
+
+	bool Save(StateWriter &writer) const{
+		writer.WriteValue(addedCount);
+		writer.WritePlane(coverage);
+		return writer.failed==false;
+	}
+
+	bool Load(StateReader &reader){
+		reader.ReadValue(addedCount);
+		reader.ReadPlane(coverage);
+		if (reader.failed==true){
+			return false;
+		}
+		uf.reset();
+		if (coverage.Empty()==false){
+			flag.Create(coverage.rows, coverage.cols);
+			uf.reset(new UnionFind(coverage.rows*coverage.cols+1));
+		}
+		return true;
+	}
+};
+
+Plane<uchar> SelectTerrain(double f=1.0){
+	int rows=terrainSelectionImg.rows;
+	int cols=terrainSelectionImg.cols;
+	
+	resize(terrainSelectionImg, terrainSelectionImg, Size(terrainSelectionImg.cols/f, terrainSelectionImg.rows/f));
+
+	terrainSelectionActionsPerformed=false;
+	terrainSelectionMouseDown=false;
+	terrainSelectionMovePerformed=false;
+
+	bool selected=false;
+
+	while(selected==false){
+		imshow(terrainSelectionWindowName, terrainSelectionImg);
+		setMouseCallback(terrainSelectionWindowName, TerrainSelectionMouseCallback, NULL);
+		waitKey();
+		if (terrainSelectionPositions.size()<3 || terrainSelectionPositions[0].row!=terrainSelectionPositions[terrainSelectionPositions.size()-1].row || terrainSelectionPositions[0].col!=terrainSelectionPositions[terrainSelectionPositions.size()-1].col){
+			terrainSelectionPositions.clear();
+		} else{
+			selected=true;
+		}
+	}
+
+	for (int i=0;i<terrainSelectionPositions.size();++i){
+		terrainSelectionPositions[i].row/=f;
+		terrainSelectionPositions[i].col/=f;
+	}
+
+	//the selection only checks the edges it closes for crossings, so the filled polygon is cleaned up
+	terrainSelectionPolygon.clear();
+	for (int i=0;i<terrainSelectionPositions.size();++i){
+		terrainSelectionPolygon.push_back(Point(terrainSelectionPositions[i].col, terrainSelectionPositions[i].row));
+	}
+	Plane<uchar> terrainMask;
+	RasterizeTerrainPolygon(terrainSelectionPolygon, rows, cols, terrainMask);
+
+	/*
+	int move[4][2]={
+				{-1, 0},
+				{0, 1},
+				{1, 0},
+				{0, -1}
+			};
+	queue<Position> q1;
+	q1.push(Position(0, 0));
+	terrainMask[0][0]=2;
+	while(q1.empty()==false){
+		int row=q1.front().row;
+		int col=q1.front().col;
+		q1.pop();
+
+		for (int i=0;i<4;++i){
+			int row2=row+move[i][0];
+			int col2=col+move[i][1];
+			if (row2>=0 && row2<rows && col2>0 && col2<cols && terrainMask[row2][col2]==0){
+				terrainMask[row2][col2]=2;
+				q1.push(Position(row2, col2));
+			}
+		}
+	}
+
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (terrainMask[i][j]==0){
+				terrainMask[i][j]=1;
+			} else if (terrainMask[i][j]==2){
+				terrainMask[i][j]=0;
+			}
+		}
+	}
+	*/
+
+	destroyWindow(terrainSelectionWindowName);
+
+	return terrainMask;
+}
+
+void GetTerrainCachePath(const char *videoPath, const char *backgroundsPath, int skip, int step, int take, char *path){
+	char base[1025];
+	GetBase(videoPath, base);
+	sprintf(path, "%s/%s_%d_%d_%d.png", backgroundsPath, base, skip, step, take);
+}
+
+//true if SelectTerrainSmartly would read the terrain selected before instead of asking for it
+bool TerrainSelectionExists(const char *videoPath, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/terrains/"){
+	char path[1100];
+	GetTerrainCachePath(videoPath, backgroundsPath, skip, step, take, path);
+	FILE *input=fopen(path, "rb");
+	if (input==NULL){
+		return false;
+	}
+	fclose(input);
+	return true;
+}
+
+Plane<uchar> SelectTerrainSmartly(const char *videoPath, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/terrains/", bool write=false, double f=1.0){
+	char path[1100];
+	GetTerrainCachePath(videoPath, backgroundsPath, skip, step, take, path);
+
+	int rows=terrainSelectionImg.rows;
+	int cols=terrainSelectionImg.cols;
+
+	FILE *input=fopen(path, "rb");
+	
+	Plane<uchar> terrainMask;
+	if (input==NULL){
+		terrainMask=SelectTerrain(f);
+		if (write==true){
+			Mat img;
+			CreateMaskFromFlags(terrainMask, img);
+			imwrite(path, img);
+			char polygonPath[1100];
+			sprintf(polygonPath, "%s.polygon", path);
+			SaveTerrainPolygon(polygonPath, terrainSelectionPolygon);
+		}
+	} else{
+		fclose(input);
+		Mat img=imread(path, 6);
+		terrainMask.Create(rows, cols, true);
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				uchar value=*(((uchar *)(img.data))+i*cols+j);
+				if (value==0){
+					terrainMask[i][j]=0;
+				} else{
+					terrainMask[i][j]=1;
+				}
+			}
+		}
+	}
+
+	return terrainMask;
+}
+
+Plane<uchar> SelectTerrainSmartly(const char *videoPath, Mat &background, int skip=0, int step=30, int take=30, const char *backgroundsPath="D:/terrains/", bool write=false, double f=1.0){
+	return SelectTerrainSmartly(videoPath, skip, step, take, backgroundsPath, write, f);
+}
+
+struct TrackingData{
+	struct DisposedComparison{
+		bool operator ()(const TrackingData *t1, const TrackingData *t2) const {
+			if (t1->lastFrame<t2->lastFrame){
+				return true;
+			}
+			if (t2->lastFrame<t1->lastFrame){
+				return false;
+			}
+			if (t1->id<t2->id){
+				return true;
+			}
+			if (t2->id<t1->id){
+				return false;
+			}
+			return t1<t2;
+		}
+	};
+	int id;
+	vector<Position> positions;
+	vector<BoundingBox> previous;
+	int lastFrame;
+	bool pushedOut;
+	TrackingData *pushedOutBy;
+	bool isTracked;
+	Vec3b meanColor;
+	Position meanPosition;
+	set<TrackingData*, DisposedComparison> pushedOutGroups;
+	int framesOutsideOfTerrain;
+	TrackingData(vector<Position> positions=vector<Position>(), vector<BoundingBox> previous=vector<BoundingBox>(), int lastFrame=-1, bool pushedOut=false, bool isTracked=true, int framesOutsideOfTerrain=0):positions(positions), previous(previous), lastFrame(lastFrame), pushedOut(pushedOut), isTracked(isTracked), id(createdGroupsCount++), framesOutsideOfTerrain(framesOutsideOfTerrain){
+		pushedOutBy=nullptr;
+		meanColor=Vec3b(0, 0, 0);
+		meanPosition=Position(-1, -1);
+	}
+	void RemovePushedOutBy(){
+		if (pushedOutBy!=nullptr){
+			auto found=pushedOutBy->pushedOutGroups.find(this);
+			if (found!=pushedOutBy->pushedOutGroups.end()){
+				pushedOutBy->pushedOutGroups.erase(found);
+			}
+		}
+		pushedOutBy=nullptr;
+		pushedOut=false;
+	}
+	void SetPushedByOutBySmartly(TrackingData *pusher, bool copyPushedOutGroups=false){
+		RemovePushedOutBy();
+		pushedOutBy=pusher;
+		if (pusher!=nullptr){
+			pusher->pushedOutGroups.insert(this);
+			pushedOut=true;
+		} else{
+			pushedOut=false;
+		}
+		if (copyPushedOutGroups==true && pusher!=nullptr){
+			for (auto si=pushedOutGroups.cbegin();si!=pushedOutGroups.cend();++si){
+				(*si)->pushedOutBy=pusher;
+				pusher->pushedOutGroups.insert(*si);
+			}
+			pushedOutGroups.clear();
+		}
+	}
+	void ClearPushedOutGropusSmartly(){
+		for (auto si=pushedOutGroups.cbegin();si!=pushedOutGroups.cend();++si){
+			(*si)->pushedOut=false;
+			(*si)->pushedOutBy=nullptr;
+		}
+		pushedOutGroups.clear();
+	}
+	void CalculateMeanColor(const Mat &img){
+		int rows=img.rows;
+		int cols=img.cols;
+
+		int count=0;
+		Vec3d mean(0.0, 0.0, 0.0);
+		for (int i=0;i<positions.size();++i){
+			int r=positions[i].row;
+			int c=positions[i].col;
+			if (r>=0 && r<rows && c>=0 && c<cols){
+				mean+=*(((Vec3b *)(img.data))+r*cols+c);
+				++count;
+			}
+		}
+		if (count==0){
+			meanColor=Vec3b(0, 0, 0);
+		} else{
+			meanColor=mean/count;
+		}
+	}
+	void CalculateMeanPosition(){
+		
+		int n=positions.size();
+		if (n==0){
+			meanPosition=Position(-1, -1);
+			return;
+		}
+		int row=0;
+		int col=0;
+		for (int i=0;i<n;++i){
+			row+=positions[i].row;
+			col+=positions[i].col;
+		}
+		meanPosition=Position(row/n, col/n);
+	}
+private:
+	static int createdGroupsCount;
+};
+
+int TrackingData::createdGroupsCount=0;
+
+TrackingData*** GetTrackingDataPointerMatrix(int rows, int cols, bool setToNull=false){
+	
+	TrackingData ***matrix=new TrackingData**[rows];
+	for (int i=0;i<rows;++i){
+		matrix[i]=new TrackingData*[cols];
+		if (setToNull==true){
+			for (int j=0;j<cols;++j){
+				matrix[i][j]=nullptr;
+			}
+		}
+	}
+
+	return matrix;
+}
+
+void FreeTrackingDataPointerMatrix(TrackingData ***matrix, int rows){
+	
+	for (int i=0;i<rows;++i){
+		delete[] matrix[i];
+	}
+
+	delete[] matrix;
+}
+
+int move8[8][2]={
+				{-1, 0},
+				{-1, 1},
+				{0, 1},
+				{1, 1},
+				{1, 0},
+				{1, -1},
+				{0, -1},
+				{-1, -1}
+			};
+
+void Spread(const vector<Position> &group, const Mat &img, const Mat &background, const Plane<uchar> &terrainMask, double greenThreshold, Plane<int> &flag, Plane<int> &spreadData, Plane<int> &visited, int spreadCount, int visitCount, Position &seedPosition, bool insideTerrain=true){
+	
+	int rows=img.rows;
+	int cols=img.cols;
+
+	BackgroundDistance kernel(greenThreshold);
+
+	for (int i=0;i<group.size();++i){
+		int row=group[i].row;
+		int col=group[i].col;
+		if ((insideTerrain==false || terrainMask.Empty()==true || terrainMask[row][col]!=0) && visited[row][col]!=visitCount){
+			int d=kernel.Distance(img.data+3*(row*cols+col), background.data+3*(row*cols+col));
+			if (d>=0){
+				flag[row][col]=spreadCount;
+				spreadData[row][col]=d;
+			}
+		}
+	}
+
+	double md=-1;
+	int mdIdx=0;
+	for (int i=0;i<group.size();++i){
+		if ((insideTerrain==false || terrainMask.Empty()==true || terrainMask[group[i].row][group[i].col]!=0) && flag[group[i].row][group[i].col]==spreadCount){
+			Vec3b point=*(((Vec3b *)(img.data))+group[i].row*cols+group[i].col);
+			double d=spreadData[group[i].row][group[i].col];
+			for (int k=0;k<8;++k){
+				int nr=group[i].row+move8[k][0];
+				int nc=group[i].col+move8[k][1];
+				if (nr>=0 && nr<rows && nc>=0 && nc<cols && flag[nr][nc]==spreadCount){
+					d+=spreadData[nr][nc];
+				}
+			}
+			if (md<d || md==-1){
+				md=d;
+				mdIdx=i;
+			}
+		}
+	}
+	
+	seedPosition=group[mdIdx];
+
+}
+
+bool Visit(TrackingData *trackedGroup, const Mat &img, const Mat &background, const Plane<uchar> &terrainMask, double greenThreshold, Plane<int> &visited, int visitCount, const Position &seedPosition, int scanningAttempts, double threshold, int minimumGroupSize, TrackingData ***owners=nullptr, bool insideTerrain=true, int maximumWidth=-1, int maximumHeight=-1, double remainingFactor=1.2){
+	
+	bool takeIt=false;
+	
+	int rows=img.rows;
+	int cols=img.cols;
+	
+	int currentScanningAttempts=scanningAttempts;
+	double currentThreshold=threshold;
+
+	BackgroundDistance kernel(greenThreshold, 5);
+
+	while(currentScanningAttempts-->0){
+				
+		int remaining=remainingFactor*trackedGroup->positions.size();
+
+		vector<Position> newPositions;
+
+		int minRow=seedPosition.row;
+		int maxRow=seedPosition.row;
+		int minCol=seedPosition.col;
+		int maxCol=seedPosition.col;
+
+		queue<Position> q1;
+		TrackingData *touchedOwner=nullptr;
+		bool touchedOther=false;
+		if (visited[seedPosition.row][seedPosition.col]==visitCount){
+			touchedOther=true;
+			if (owners!=nullptr){
+				touchedOwner=owners[seedPosition.row][seedPosition.col];
+			}
+		} else{
+			visited[seedPosition.row][seedPosition.col]=visitCount;
+			newPositions.push_back(seedPosition);
+			q1.push(seedPosition);
+		}
+		while(q1.empty()==false && remaining>0){
+			Position p=q1.front();
+			q1.pop();
+
+			for (int i=0;i<8;++i){
+				int row=p.row+move8[i][0];
+				int col=p.col+move8[i][1];
+				if (row<0 || col<0 || row>rows-1 || col>cols-1){
+					continue;
+				}
+				if (visited[row][col]==visitCount){
+					if (row!=seedPosition.row && col!=seedPosition.col){
+						touchedOther=true;
+						if (owners!=nullptr){
+							touchedOwner=owners[row][col];
+						}
+					}
+					continue;
+				}
+					
+				int d=kernel.Distance(img.data+3*(row*cols+col), background.data+3*(row*cols+col));
+				if ((insideTerrain==false || terrainMask.Empty()==true || terrainMask[row][col]!=0) && d>=0 && currentThreshold<d){
+					int currentMinRow=minRow;
+					int currentMaxRow=maxRow;
+					int currentMinCol=minCol;
+					int currentMaxCol=maxCol;
+
+					MinMaxRowCol(currentMinRow, currentMaxRow, currentMinCol, currentMaxCol, row, col);
+					if ((maximumHeight==-1 || currentMaxRow-currentMinRow+1<=maximumHeight) && (maximumWidth==-1 || currentMaxCol-currentMinCol+1<=maximumWidth)){
+						minRow=currentMinRow;
+						maxRow=currentMaxRow;
+						minCol=currentMinCol;
+						maxCol=currentMaxCol;
+						--remaining;
+						visited[row][col]=visitCount;
+						newPositions.push_back(Position(row, col));
+						q1.push(Position(row, col));
+					}
+				}
+				
+			}
+
+		}
+
+		if (newPositions.size()>=minimumGroupSize){
+			vector<Position> &positions=trackedGroup->positions;
+			//positions.clear();
+			positions=newPositions;
+			takeIt=true;
+			
+			trackedGroup->pushedOut=false;
+			trackedGroup->SetPushedByOutBySmartly(nullptr);
+
+			if (owners!=nullptr){
+				for (int i=0;i<positions.size();++i){
+					owners[positions[i].row][positions[i].col]=trackedGroup;
+				}
+			}
+			if (currentScanningAttempts<scanningAttempts-1){
+				//rescanned=true;
+				//printf("%d %d Success after rescanning (%d)!\n", framesCount, gi, scanningAttempts-1-currentScanningAttempts);
+			} else{
+				//rescanned=false;
+			}
+
+			break;
+		} else{
+			for (int i=0;i<newPositions.size();++i){
+				visited[newPositions[i].row][newPositions[i].col]=visitCount-1;
+			}
+			trackedGroup->pushedOut=touchedOther;
+			
+			if (touchedOther==false){
+				currentThreshold*=0.8;
+			} else{
+
+				trackedGroup->SetPushedByOutBySmartly(touchedOwner);
+				break;
+			}
+		}
+	}
+
+	return takeIt;
+}
+
+void GetWiderAreaPositions(TrackingData *trackedGroup, vector<Position> &positions, int rows, int cols, int previousLookSize=15, double enlargementFactor=3.0){
+	BoundingBox boundingBox=GetBoundingBox(trackedGroup->positions);
+	int dx=boundingBox.maxCol-boundingBox.minCol+1;
+	int dy=boundingBox.maxRow-boundingBox.minRow+1;
+
+	int back=trackedGroup->previous.size()-previousLookSize;
+	if (back<0){
+		back=0;
+	}
+	
+	//printf("%d %d      ", dx, dy);
+	for (int i=back;i<trackedGroup->previous.size();++i){
+		BoundingBox previous=trackedGroup->previous[i];
+		int cdx=previous.maxCol-previous.minCol+1;
+		int cdy=previous.maxRow-previous.minRow+1;
+		if (dx<cdx){
+			dx=cdx;
+		}
+		if (dy<cdy){
+			dy=cdy;
+		}
+	}
+	
+	//printf("%d %d\n", dx, dy);
+
+	int startRow=boundingBox.minRow-dx*enlargementFactor;
+	if (startRow<0){
+		startRow=0;
+	}
+	int endRow=boundingBox.maxRow+dx*enlargementFactor;
+	if (endRow>=rows){
+		endRow=rows-1;
+	}
+	int startCol=boundingBox.minCol-dy*enlargementFactor;
+	if (startCol<0){
+		startCol=0;
+	}
+	int endCol=boundingBox.maxCol+dy*enlargementFactor;
+	if (endCol>=cols){
+		endCol=cols-1;
+	}
+	for (int row=startRow;row<=endRow;++row){
+		for (int col=startCol;col<=endCol;++col){
+			positions.push_back(Position(row, col));
+		}
+	}
+				
+}
+
+void AddMissingPrevious(TrackingData *tracked, BoundingBox start, BoundingBox end, int n){
+	
+	for (int i=0;i<n;++i){
+		BoundingBox boundingBox=BoundingBox(((n-i-1)*start.minRow+(i+1)*end.minRow)/n, ((n-i-1)*start.maxRow+(i+1)*end.maxRow)/n, ((n-i-1)*start.minCol+(i+1)*end.minCol)/n, ((n-i-1)*start.maxCol+(i+1)*end.maxCol)/n);
+		boundingBox.type=BoundingBoxType::FILLED;
+		tracked->previous.push_back(boundingBox);
+	}
+
+}
+
+void DrawTrajectories(Mat &img2, const vector<TrackingData*> &trackedGroups, int trajectoryDrawingLength, Scalar color=Scalar(0, 0, 255)){
+
+	for (int gi=0;gi<trackedGroups.size();++gi){
+		TrackingData *trackedGroup=trackedGroups[gi];
+		int stop=trackedGroup->previous.size()-trajectoryDrawingLength;
+		if (stop<0){
+			stop=0;
+		}
+		
+		for (int i=trackedGroup->previous.size()-1;i>stop;--i){
+			line(img2, Point((trackedGroup->previous[i].maxCol+trackedGroup->previous[i].minCol)/2, trackedGroup->previous[i].maxRow), Point((trackedGroup->previous[i-1].maxCol+trackedGroup->previous[i-1].minCol)/2, trackedGroup->previous[i-1].maxRow), color);
+		}
+	}
+
+}
+
+void ReconnectGroups(TrackingData *add, TrackingData *newlyFoundGroup, const Mat &img, int framesCount, TrackingData *takePrevious=nullptr){
+	
+	//AddMissingPrevious(add, add->previous[add->previous.size()-1], GetBoundingBox(newlyFoundGroup->positions), framesCount-add->lastFrame);
+	if (takePrevious!=nullptr){
+		for (int j=takePrevious->previous.size()-framesCount+add->lastFrame+1;j<takePrevious->previous.size();++j){
+			BoundingBox boundingBox=takePrevious->previous[j];
+			boundingBox.type=BoundingBoxType::FILLED;
+			add->previous.push_back(boundingBox);
+		}
+	} else{
+		if (add->previous.size()>0){
+			AddMissingPrevious(add, add->previous[add->previous.size()-1], GetBoundingBox(newlyFoundGroup->positions), framesCount-add->lastFrame-1);
+		}
+	}
+
+	add->isTracked=true;
+	add->pushedOut=false;
+	add->SetPushedByOutBySmartly(nullptr);
+	add->lastFrame=framesCount;
+	add->positions=newlyFoundGroup->positions;
+	add->CalculateMeanColor(img);
+	add->CalculateMeanPosition();
+
+	add->ClearPushedOutGropusSmartly();
+	
+}
+
+int CountPositionsInsideTerrain(const vector<Position> &positions, const Mat &terrain){
+	int count=0;
+
+	int rows=terrain.rows;
+	int cols=terrain.cols;
+
+	for (int i=0;i<positions.size();++i){
+		int row=positions[i].row;
+		int col=positions[i].col;
+		if (*(((uchar *)(terrain.data))+row*cols+col)!=0){
+			++count;
+		}
+	}
+
+	return count;
+}
+
+template<typename T>
+T CalculateMean(const vector<T> &data){
+	T m=0;
+
+	int n=data.size();
+	for (int i=0;i<n;++i){
+		m+=data[i];
+	}
+	m/=n;
+	
+	return m;
+}
+
+template<typename T>
+T CalculateStandardDeviation(const vector<T> &data, T m){
+	
+	T std=0;
+
+	int n=data.size();
+	for (int i=0;i<n;++i){
+		T d=data[i]-m;
+		std+=d*d;
+	}
+	std=sqrt(std/(n-1));
+
+	return std;
+}
+
+template<typename T>
+T CalculateStandardDeviation(const vector<T> &data){
+	return CalculateStandardDeviation(data, CalculateMean(data));
+}
+
+void CalculateColorChromaticityBounds(const Mat &source, const Mat &mask, double &redLower, double &redUpper, double &greenLower, double &greenUpper, double spreadFactor=2.0){
+	
+	Vec3d meanColor=Vec3d(0.0, 0.0, 0.0);
+	vector<double> channels[3];
+
+	Mat img;
+	source.convertTo(img, CV_64F);
+
+	int rows=img.rows;
+	int cols=img.cols;
+
+	vector<double> red;
+	vector<double> green;
+	
+	int n=0;
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (*(((const uchar *)(mask.data))+i*cols+j)!=0){
+				Vec3d &point=*(((Vec3d *)(img.data))+i*cols+j);
+				double s=point[0]+point[1]+point[2];
+				if (s>0){
+					red.push_back(point[2]/s);
+					green.push_back(point[1]/s);
+				}
+			}
+		}
+	}
+
+	double redMean=CalculateMean(red);
+	double greenMean=CalculateMean(green);
+
+	double redStd=CalculateStandardDeviation(red, redMean);
+	double greenStd=CalculateStandardDeviation(green, greenMean);
+	
+	redLower=redMean-spreadFactor*redStd;
+	redUpper=redMean+spreadFactor*redStd;
+	greenLower=greenMean-spreadFactor*greenStd;
+	greenUpper=greenMean+spreadFactor*greenStd;
+}
+
+//the mean and the variance of the red and the green chromaticity of the terrain, estimated while the frames come:
+//every frame adds every rowStep-th row of the terrain starting at a rotating row, so all rows are visited once in rowStep frames,
+//and the earlier samples are weighted down by forgetting per frame, nothing is allocated after construction
+struct ChromaticityEstimator{
+	int rowStep;
+	double forgetting;
+	int firstRow;
+	double weight;
+	double redMean;
+	double greenMean;
+	//the weighted sums of the squared distances from the means
+	double redM2;
+	double greenM2;
+
+	ChromaticityEstimator(int rowStep=25, double forgetting=0.02):rowStep(max(rowStep, 1)), forgetting(forgetting){
+		Reset();
+	}
+
+	void Reset(){
+		firstRow=0;
+		weight=0;
+		redMean=0;
+		greenMean=0;
+		redM2=0;
+		greenM2=0;
+	}
+
+	//the samples of a row are summed around the current means and merged in at once, which keeps the sums small
+	void Add(const Mat &img, const SpanMask &terrainSpans, bool everyRow=false){
+		int rows=img.rows;
+		int cols=img.cols;
+		bool masked=terrainSpans.Empty()==false;
+
+		if (weight!=0){
+			double keep=1.0-forgetting;
+			weight*=keep;
+			redM2*=keep;
+			greenM2*=keep;
+		}
+
+		int step=everyRow==true ? 1 : rowStep;
+		int begin=everyRow==true ? 0 : firstRow;
+		for (int i=begin;i<rows;i+=step){
+			const Vec3b *row=img.ptr<Vec3b>(i);
+			int n=0;
+			double redSum=0, redSquares=0;
+			double greenSum=0, greenSquares=0;
+			int spansCount=masked==true ? terrainSpans.rowStart[i+1]-terrainSpans.rowStart[i] : 1;
+			for (int k=0;k<spansCount;++k){
+				int spanBegin=0, spanEnd=cols;
+				if (masked==true){
+					const Span &span=terrainSpans.spans[terrainSpans.rowStart[i]+k];
+					spanBegin=span.begin;
+					spanEnd=span.end;
+				}
+				for (int j=spanBegin;j<spanEnd;++j){
+					const Vec3b &point=row[j];
+					int s=point[0]+point[1]+point[2];
+					if (s>0){
+						double inverse=1.0/s;
+						double red=point[2]*inverse-redMean;
+						double green=point[1]*inverse-greenMean;
+						redSum+=red;
+						redSquares+=red*red;
+						greenSum+=green;
+						greenSquares+=green*green;
+						++n;
+					}
+				}
+			}
+			if (n!=0){
+				//the row has the means redMean+redSum/n and greenMean+greenSum/n, merged as in the parallel variance algorithm
+				double total=weight+n;
+				double redDelta=redSum/n;
+				double greenDelta=greenSum/n;
+				redM2+=redSquares-redSum*redDelta+redDelta*redDelta*weight*n/total;
+				greenM2+=greenSquares-greenSum*greenDelta+greenDelta*greenDelta*weight*n/total;
+				redMean+=redDelta*n/total;
+				greenMean+=greenDelta*n/total;
+				weight=total;
+			}
+		}
+		if (everyRow==false){
+			firstRow=(firstRow+1)%rowStep;
+		}
+	}
+
+	//the same bounds as CalculateColorChromaticityBounds, false if nothing was added yet
+	bool GetBounds(double &redLower, double &redUpper, double &greenLower, double &greenUpper, double spreadFactor=2.0) const{
+		if (weight<=1){
+			return false;
+		}
+		double redStd=sqrt(redM2/weight);
+		double greenStd=sqrt(greenM2/weight);
+		redLower=redMean-spreadFactor*redStd;
+		redUpper=redMean+spreadFactor*redStd;
+		greenLower=greenMean-spreadFactor*greenStd;
+		greenUpper=greenMean+spreadFactor*greenStd;
+		return true;
+	}
+
+	bool Save(StateWriter &writer) const{
+		writer.WriteValue(firstRow);
+		writer.WriteValue(weight);
+		writer.WriteValue(redMean);
+		writer.WriteValue(greenMean);
+		writer.WriteValue(redM2);
+		writer.WriteValue(greenM2);
+		return writer.failed==false;
+	}
+
+	bool Load(StateReader &reader){
+		reader.ReadValue(firstRow);
+		reader.ReadValue(weight);
+		reader.ReadValue(redMean);
+		reader.ReadValue(greenMean);
+		reader.ReadValue(redM2);
+		reader.ReadValue(greenM2);
+		return reader.failed==false && 0<=firstRow && firstRow<rowStep;
+	}
+};
+
+double CalculateApproximateDifference2(const Mat &img1, const Mat &img2, int step=10, const Plane<uchar> &terrainMask=Plane<uchar>(), double threshold=5.0){
+	int rows=img1.rows;
+	int cols=img1.cols;
+
+	if (rows!=img2.rows || cols!=img2.cols){
+		return -1;
+	}
+
+	//the sampled rows are split into tiles, the counts are integers so their sum does not depend on the tiles
+	atomic<int> n(0);
+	atomic<int> count(0);
+	ParallelForRows(0, (rows+step-1)/step, [&](int begin, int end){
+		int tileN=0;
+		int tileCount=0;
+		for (int i=begin*step;i<end*step && i<rows;i+=step){
+			for (int j=0;j<cols;j+=step){
+				if (terrainMask.Empty()==true || terrainMask[i][j]!=0){
+					for (int k=0;k<3;++k){
+						double dd=(*(((Vec3b *)(img1.data))+i*cols+j))[k]-(*(((Vec3b *)(img2.data))+i*cols+j))[k];
+						if (dd<0){
+							dd=-dd;
+						}
+						if (threshold<dd){
+							++tileCount;
+							break;
+						}
+					}
+					++tileN;
+				}
+			}
+		}
+		n+=tileN;
+		count+=tileCount;
+	}, 1);
+
+	return count.load()/(float)n.load();
+}
+
+//the same samples as with the terrain given as a plane, but only the ones inside of the spans are visited
+double CalculateApproximateDifference2(const Mat &img1, const Mat &img2, int step, const SpanMask &terrain, double threshold=5.0){
+	if (terrain.Empty()==true){
+		return CalculateApproximateDifference2(img1, img2, step, Plane<uchar>(), threshold);
+	}
+
+	int rows=img1.rows;
+	int cols=img1.cols;
+
+	if (rows!=img2.rows || cols!=img2.cols){
+		return -1;
+	}
+
+	atomic<int> n(0);
+	atomic<int> count(0);
+	ParallelForRows(0, (rows+step-1)/step, [&](int begin, int end){
+		int tileN=0;
+		int tileCount=0;
+		for (int i=begin*step;i<end*step && i<rows;i+=step){
+			for (const Span *span=terrain.RowBegin(i);span!=terrain.RowEnd(i);++span){
+				for (int j=(span->begin+step-1)/step*step;j<span->end;j+=step){
+					const uchar *p1=img1.data+3*(i*cols+j);
+					const uchar *p2=img2.data+3*(i*cols+j);
+					for (int k=0;k<3;++k){
+						if (threshold<abs(p1[k]-p2[k])){
+							++tileCount;
+							break;
+						}
+					}
+					++tileN;
+				}
+			}
+		}
+		n+=tileN;
+		count+=tileCount;
+	}, 1);
+
+	return count.load()/(float)n.load();
+}
+
+//the global translation between two frames, a point (x, y) of from is at (x+dx, y+dy) in to; it is found by phase correlation
+//of the frames downscaled by scale, false if the correlation peak is too weak for the change to be a translation
+bool EstimateCameraTranslation(const Mat &from, const Mat &to, int &dx, int &dy, int scale=4, double minimumResponse=0.05){
+	Size size(max(from.cols/scale, 1), max(from.rows/scale, 1));
+	Mat small[2];
+	const Mat *frames[2]={&from, &to};
+	for (int k=0;k<2;++k){
+		Mat gray;
+		resize(*frames[k], small[k], size, 0, 0, INTER_AREA);
+		cvtColor(small[k], gray, COLOR_BGR2GRAY);
+		gray.convertTo(small[k], CV_32F);
+	}
+	Mat window;
+	createHanningWindow(window, size, CV_32F);
+
+	double response=0;
+	Point2d shift=phaseCorrelate(small[0], small[1], window, &response);
+	if (response<minimumResponse){
+		return false;
+	}
+	dx=cvRound(shift.x*from.cols/size.width);
+	dy=cvRound(shift.y*from.rows/size.height);
+	return true;
+}
+
+//moves the background model, the background and the terrain by the translation of the camera between lastGoodImage and img,
+//false if the change is not a translation of at most maximumTranslation of the frame size, e.g. a zoom or a cut to another camera,
+//so the model has to be rebuilt; the translation is accepted only if the moved lastGoodImage matches img inside of the moved terrain
+bool CompensateCameraMotion(const Mat &lastGoodImage, const Mat &img, BackgroundModel *bf, Mat &background, Plane<uchar> &terrainMask, SpanMask &terrainSpans, int &minRow, int &maxRow, int &minCol, int &maxCol, double maximumTranslation, int cameraMovedStep, double pixelChangedThreshold, double cameraMovedThreshold, int *translationX=NULL, int *translationY=NULL){
+	int rows=img.rows;
+	int cols=img.cols;
+
+	int dx, dy;
+	if (EstimateCameraTranslation(lastGoodImage, img, dx, dy)==false){
+		return false;
+	}
+	if (maximumTranslation*cols<abs(dx) || maximumTranslation*rows<abs(dy)){
+		return false;
+	}
+
+	Mat moved=lastGoodImage;
+	TranslateMat(moved, dx, dy);
+	Plane<uchar> movedTerrain;
+	if (terrainMask.Empty()==true){
+		movedTerrain.Create(rows, cols);
+		movedTerrain.mat.setTo(Scalar(1));
+	} else{
+		movedTerrain.rows=terrainMask.rows;
+		movedTerrain.cols=terrainMask.cols;
+		movedTerrain.mat=terrainMask.mat;
+	}
+	TranslateMat(movedTerrain.mat, dx, dy);
+	SpanMask movedSpans(movedTerrain);
+	if (movedSpans.Area()==0 || cameraMovedThreshold<CalculateApproximateDifference2(img, moved, cameraMovedStep, movedSpans, pixelChangedThreshold)){
+		return false;
+	}
+
+	if (bf->Translate(dx, dy)==false){
+		return false;
+	}
+	if (background.empty()==false){
+		TranslateMat(background, dx, dy);
+	}
+	TranslateMinMaxRowCol(minRow, maxRow, minCol, maxCol, dx, dy, rows, cols);
+	if (terrainMask.Empty()==false){
+		terrainMask=movedTerrain;
+		terrainSpans=movedSpans;
+	}
+
+	if (translationX!=NULL){
+		*translationX=dx;
+	}
+	if (translationY!=NULL){
+		*translationY=dy;
+	}
+	return true;
+}
+
+void CalculateCenter(const Mat &img, int &row, int &col){
+	
+	int rows=img.rows;
+	int cols=img.cols;
+
+	int n=0;
+	row=0;
+	col=0;
+	for (int i=0;i<rows;++i){
+		for (int j=0;j<cols;++j){
+			if (*(((uchar *)(img.data))+i*cols+j)!=0){
+				row+=i;
+				col+=j;
+				++n;
+			}
+		}
+	}
+	row/=n;
+	col/=n;
+
+}
+
+#ifdef _WIN32
+void usleep(__int64 usec){ 
+    HANDLE timer; 
+    LARGE_INTEGER ft; 
+
+    ft.QuadPart = -(10*usec); // Convert to 100 nanosecond interval, negative value indicates relative time
+
+    timer = CreateWaitableTimer(NULL, TRUE, NULL); 
+    SetWaitableTimer(timer, &ft, 0, NULL, NULL, 0); 
+    WaitForSingleObject(timer, INFINITE); 
+    CloseHandle(timer); 
+}
+#endif
+
+void Beep3(){
+	printf("\a");
+	usleep(750000);
+	printf("\a");
+	usleep(750000);
+	printf("\a");
+}
+
+vector<Point> teamSelection;
+const char *teamSelectionWindowName = "i";
+
+void TeamSelectionMouseCallback(int event, int x, int y, int flags, void* userdata) {
+	Point center;
+	Scalar color = Scalar(0, 0, 255);
+	int radius = 3;
+
+	if (event == EVENT_LBUTTONDOWN || event == EVENT_MBUTTONDOWN || event == EVENT_RBUTTONDOWN) {
+		teamSelection.push_back(Point(x, y));
+
+		center = Point(x, y);
+		circle(terrainSelectionImg, center, radius, color, -1);
+		imshow(teamSelectionWindowName, terrainSelectionImg);
+	}
+
+}
+
+void SelectTeam() {
+	int selected = 0;	
+	Mat tmpImg = terrainSelectionImg.clone();
+
+	while (1) {
+		setMouseCallback(teamSelectionWindowName, TeamSelectionMouseCallback, NULL);
+		waitKey();
+		
+		if (teamSelection.size() != 4) {
+			teamSelection.clear();
+			tmpImg.copyTo(terrainSelectionImg);
+			imshow(teamSelectionWindowName, tmpImg);
+		}
+		else break;		
+	}
+
+	tmpImg.release();
+}
+
+struct MyTracking {
+	vector<Point> contourPoints;
+	Mat rect;
+	Point center;
+	int team;
+	int area;
+	int visited;
+	MatND hist;
+};
+
+vector<MyTracking> myTracking, newMyTracking;
+int avgContourArea;
+
+struct HistData {
+	MatND histData;
+	int id;
+	Vec3b color;
+};
+vector<HistData> histData;
+
+bool analyse(Mat img, vector<vector<Point>> contours) {
+	avgContourArea = 0;
+	int channels[] = { 0, 1, 2 };
+	float h_ranges[] = { 0, 180 };
+	float s_ranges[] = { 0, 256 };
+	const float* ranges[] = { s_ranges, s_ranges, s_ranges };
+	int h_bins = 50; int s_bins = 50;
+	int histSize[] = { h_bins, s_bins, s_bins };
+	Mat hsvImg, rangeImg1, rangeImg2;
+	MatND histImg;
+
+	int found = 0;
+	double inside;
+	for (int i = 0; i < contours.size(); ++i) {
+		avgContourArea += contourArea(contours[i]);
+		for (int j = 1; j < 3; ++j) {
+			inside = pointPolygonTest(contours[i], teamSelection[j], false);
+			if (inside > 0) {
+				++found;
+				cvtColor(img(boundingRect(contours[i])), hsvImg, COLOR_BGR2RGB);
+				calcHist(&hsvImg, 1, channels, Mat(), histImg, 2, histSize, ranges, true, false);
+				normalize(histImg, histImg, 0, 1, NORM_MINMAX, -1, Mat());
+				HistData tmpHistData;
+				tmpHistData.histData = histImg;
+				tmpHistData.id = j;
+				tmpHistData.color = img.at<Vec3b>(teamSelection[j]);
+				histData.push_back(tmpHistData);
+			}
+		}		
+	}
+	avgContourArea /= contours.size();
+
+	Moments m;
+	for (int i = 0; i < contours.size(); ++i) {		
+		if (contourArea(contours[i]) < avgContourArea*0.5) continue;			
+		MyTracking tmpData;
+		tmpData.area = contourArea(contours[i]);
+		tmpData.contourPoints = contours[i];
+		m = moments(contours[i], true);
+		tmpData.center = Point(m.m10 / m.m00, m.m01 / m.m00);
+		tmpData.visited = 0;
+		tmpData.rect = img(boundingRect(contours[i]));
+		
+		
+		cvtColor(tmpData.rect, hsvImg, COLOR_BGR2RGB);
+		calcHist(&hsvImg, 1, channels, Mat(), histImg, 2, histSize, ranges, true, false);
+		normalize(histImg, histImg, 0, 1, NORM_MINMAX, -1, Mat());
+		tmpData.hist = histImg;
+		
+		if (pointPolygonTest(contours[i], teamSelection[0], false) > 0) {
+			tmpData.team = 0; 
+			++found;
+		}		
+		else if (pointPolygonTest(contours[i], teamSelection[3], false) > 0) {
+			tmpData.team = 3; 
+			++found;
+		}
+		else {
+			/*double team1 = compareHist(histData[0].histData, histImg, 1);
+			double team2 = compareHist(histData[1].histData, histImg, 1);
+			printf("%d %d\n", team1, team2);
+			if (team1 < team2) tmpData.team = histData[0].id;
+			else tmpData.team = histData[1].id;*/
+			Scalar bgrL = (histData[0].color[0] - 1, histData[0].color[1] - 1, histData[0].color[2] - 1);
+			Scalar bgrU = (histData[0].color[0] + 1, histData[0].color[1] + 1, histData[0].color[2] + 1);
+			inRange(tmpData.rect, bgrL, bgrU, rangeImg1);
+			bgrL = (histData[1].color[0] - 1, histData[1].color[1] - 1, histData[1].color[2] - 1);
+			bgrU = (histData[1].color[0] + 1, histData[1].color[1] + 1, histData[1].color[2] + 1);
+			inRange(tmpData.rect, bgrL, bgrU, rangeImg2);
+			if (countNonZero(rangeImg1) < countNonZero(rangeImg2)) tmpData.team = histData[1].id;
+			else tmpData.team = histData[0].id;
+		}
+		
+		myTracking.push_back(tmpData);
+	}
+
+	if (found == 4) return true;
+	else return false;
+}
+
+void Test97() {
+	char videoPath[1024] = "C:/Users/etomiki/Desktop/Nogomet/Dinamo_vs._Rijeka_-_panorama_view.mp4";
+	//char videoPath[1024] = "C:/Users/etomiki/Desktop/Nogomet/Inter - Dinamo wide angle.mp4";	
+
+
+	const char *drawnResultsPath = "C:/Users/etomiki/Desktop/Nogomet/labeled_images/";
+	char videoBase[1025];
+	GetBase(videoPath, videoBase);
+
+	double f = 1.0;
+
+	//double thresholdFactor=0.75;
+	double thresholdFactor = 0.8;
+	double threshold = thresholdFactor*1000.0;
+	double thresholdForPrevious = thresholdFactor*250.0;
+
+	//int maximumGroupsCount=30;
+	int maximumGroupsCount = 35;
+
+	int minimumGroupSize = 3;
+	int minimumGroupSizeAtFirstDetection = 5;
+
+	bool cameraMoved = false;
+	bool cameraWasMoving = false;
+	bool forceModelBuilding = false;
+	//double cameraMovedThreshold=0.1;
+	double cameraMovedThreshold = 0.2;
+	double pixelChangedThreshold = 5.0;
+	//if it is on, a pan is followed by moving the background instead of selecting the terrain and rebuilding the background
+	bool cameraMotionCompensation = false;
+	double maximumCameraTranslation = 0.25;
+	Mat lastGoodImage;
+	int cameraMovedStep = 20;
+
+	//int n=30;
+	int n = 20;
+	int skip = 0;
+	//int skip=50;
+	int step = 30;
+	int take = n;
+
+	//the video is opened once, the background is built and the loop runs on the same capture
+	VideoBootstrap bootstrap;
+	if (bootstrap.Open(videoPath) == false) {
+		printf("Could not read %s.\n", videoPath);
+		return;
+	}
+	Mat preImg = bootstrap.firstImage;
+
+	preImg.copyTo(lastGoodImage);
+
+	int rows = preImg.rows;
+	int cols = preImg.cols;
+
+	double redLower = 0.3450;
+	double redUpper = 0.3661;
+	double greenLower = 0.4600;
+	double greenUpper = 0.5075;
+
+	double spreadFactor = 4.0;
+
+	double previousSizeThreshold = 2.0;
+
+	//if it is on, the terrain is found from the grass instead of being selected, at the start and after the camera moves,
+	//a terrain selected and saved before is used instead of it
+	const char *terrainsPath = "C:/Users/etomiki/Desktop/Nogomet/terrains/";
+	bool automaticTerrain = false;
+	if (automaticTerrain == true && TerrainSelectionExists(videoPath, skip, step, take, terrainsPath) == true) {
+		automaticTerrain = false;
+	}
+	TerrainDetector terrainDetector(0.2, 0.005, previousSizeThreshold);
+	vector<Point> terrainPolygon;
+
+	Plane<uchar> terrainMask;
+	if (automaticTerrain == true) {
+		terrainDetector.Add(preImg, redLower, redUpper, greenLower, greenUpper);
+	}
+	if (automaticTerrain == false || terrainDetector.GetTerrain(terrainPolygon, terrainMask) == false) {
+		preImg.copyTo(terrainSelectionImg);
+		terrainMask = SelectTerrainSmartly(videoPath, skip, step, take, terrainsPath, true, f);
+	}
+
+	Mat terrainMaskImg = terrainMask.View();
+	SpanMask terrainSpans(terrainMask);
+	//imshow("terrain", terrainMaskImg);
+	
+	int keyPressed = waitKey(1);
+
+	int chromaticityBoundsCalculationStep = 25;
+	int chromaticityBoundsCalculationCount = chromaticityBoundsCalculationStep;
+
+	//the grass is sampled every frame from every chromaticityBoundsCalculationStep-th row, the bounds are applied every chromaticityBoundsCalculationStep frames
+	ChromaticityEstimator chromaticity(chromaticityBoundsCalculationStep, 0.02);
+	chromaticity.Add(preImg, terrainSpans, true);
+	chromaticity.GetBounds(redLower, redUpper, greenLower, greenUpper, spreadFactor);
+	RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+
+	double greenThreshold = 45;
+
+	int backgroundCount = 1;
+	int backgroundLimit = 30;
+
+	int redetectStep = 2;
+	int redetectCount = redetectStep;
+
+	int scanningAttempts = 3;
+
+	int allowedFramesOutsideOfTerrain = 300;
+
+	int backFramesToCheckForCloseTracked = 50;
+	int backFramesToCheckForStrongClosePushedOut = 50;
+	int backFramesToCheckForClosePushedOut = 150;
+
+	int trajectoryDrawingLength = 100;
+
+	double remainingFactor = 1.2;
+
+	Mat background;
+	bootstrap.GetBackgroundSmartly(videoPath, background, skip, step, take, "C:/Users/etomiki/Desktop/Nogomet/backgrounds/", true, redLower, redUpper, greenLower, greenUpper);
+
+	//double sameGroupFieldDistancePercentage=0.07;
+	//double sameGroupFieldDistancePercentage = backFramesToCheckForStrongClosePushedOut*0.0028;
+	//int sameGroupFieldDistance = background.cols*sameGroupFieldDistancePercentage;
+	//int sameGroupBackFramesForSpeed = 10;
+
+	int maximumWidth = cols*0.075;
+	int maximumHeight = rows*0.05;
+
+	Plane<uchar> currentBackgroundFlag(rows, cols);
+	UnionFind uf(rows*cols + 1);
+
+	//the model is updated on its own thread if it is on, the frames every step then do not stall the loop but the results depend on the timing
+	bool asynchronousBackground = false;
+
+	Mat img;
+	BackgroundModel *bf = new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
+	if (asynchronousBackground == true) {
+		bf = new AsyncBackgroundModel(bf);
+	}
+	//BackgroundFetcher5 *bf=new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, true, 0);
+
+	int minRow = -1;
+	int maxRow = -1;
+	int minCol = -1;
+	int maxCol = -1;
+
+	for (int i = 0; i<rows; ++i) {
+		for (int j = 0; j<cols; ++j) {
+			const Vec3b &point = *(((Vec3b *)(background.data)) + i*cols + j);
+			int s = point[0] + point[1] + point[2];
+			MinMaxRowCol(minRow, maxRow, minCol, maxCol, i, j, s);
+		}
+	}
+
+	int currentStep = 1;
+	int framesCount = 0;
+	Mat previous = Mat::zeros(0, 0, CV_8UC3);
+	Plane<uchar> flag(rows, cols, true);
+	Plane<uchar> suddenlyChanged(rows, cols, true);
+
+	int spreadCount = 0;
+	Plane<int> spreadFlag(rows, cols, true);
+	Plane<int> spreadData(rows, cols, true);
+
+	GetForegroundFlag(preImg, background, terrainSpans, threshold, greenThreshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+
+	//the flags are 0/1 so they are scaled only for displaying
+	Mat testImgMine;
+	Mat element = getStructuringElement(CV_SHAPE_ELLIPSE, Size(3, 3), Point(1, 1));
+	//morphologyEx(flag.View(), testImgMine, 3, element);
+	vector<vector<Point> > contours;
+	vector<Vec4i> hierarchy;
+	Mat imageCopy = flag.View().clone();
+	findContours(imageCopy, contours, hierarchy, CV_RETR_EXTERNAL, CHAIN_APPROX_TC89_KCOS);
+	imshow("testImgMine", flag.View()*255);
+
+	/*vector<vector<Position> > groups;
+	GetGroups(flag, img.rows, img.cols, groups, uf, false, minRow, maxRow, minCol, maxCol);
+
+	vector<TrackingData*> trackedGroups;
+	set<TrackingData*, TrackingData::DisposedComparison> disposedGroups;
+
+	for (int i = 0; i<groups.size(); ++i) {
+		trackedGroups.push_back(new TrackingData(groups[i]));
+	}
+
+	Plane<int> visited(rows, cols, true);
+
+	TrackingData ***owners = GetTrackingDataPointerMatrix(rows, cols, true);*/
+
+	if (bootstrap.Rewind(videoPath, 0) == false) {
+		printf("Could not move %s to the first frame.\n", videoPath);
+		delete bf;
+		return;
+	}
+	VideoCapture &video = bootstrap.video;
+
+	Mat currentMask;
+	int currentMaskCounter = 1;
+	int currentMaskReset = 50;
+
+	int visitCount = 0;
+
+	while (true) {
+		++framesCount;
+
+		cameraMoved = false;
+
+		Mat img;
+		video >> img;
+
+		if (img.empty()) {
+			break;
+		}
+
+		if (previous.rows != 0) {
+			double difference = CalculateApproximateDifference2(img, previous, cameraMovedStep, terrainSpans, pixelChangedThreshold);
+			//printf("%lf\n", difference);
+			if (cameraMovedThreshold<difference) {
+				printf("%lf\n", difference);
+				if (cameraWasMoving == false) {
+					previous.copyTo(lastGoodImage);
+				}
+				cameraWasMoving = true;
+				//the line below is to disable possible usage of terrain for factors recalculation in a potentially critical moment when the terrain selection may not be valid anymore
+				++chromaticityBoundsCalculationCount;
+			}
+			else {
+				if (cameraWasMoving == true) {
+					printf("Camera moved.\n");
+
+					double difference = CalculateApproximateDifference2(img, lastGoodImage, cameraMovedStep, terrainSpans, pixelChangedThreshold);
+
+					int dx, dy;
+					if (difference <= cameraMovedThreshold) {
+						printf("However, it returned to the beginning again.");
+					}
+					else if (cameraMotionCompensation == true && CompensateCameraMotion(lastGoodImage, img, bf, background, terrainMask, terrainSpans, minRow, maxRow, minCol, maxCol, maximumCameraTranslation, cameraMovedStep, pixelChangedThreshold, cameraMovedThreshold, &dx, &dy) == true) {
+						//a pan is followed without selecting the terrain again
+						printf("The background was moved by (%d, %d).\n", dx, dy);
+						terrainMaskImg = terrainMask.View();
+						terrainDetector.Translate(dx, dy);
+					}
+					else {
+						//the terrain is found again in the new view, it is selected by hand only if nothing was found
+						bool detected = false;
+						if (automaticTerrain == true) {
+							terrainDetector.Reset();
+							terrainDetector.Add(img, redLower, redUpper, greenLower, greenUpper);
+							Plane<uchar> detectedMask;
+							detected = terrainDetector.GetTerrain(terrainPolygon, detectedMask);
+							if (detected == true) {
+								terrainMask = detectedMask;
+							}
+						}
+						if (detected == false) {
+							Beep3();
+
+							img.copyTo(terrainSelectionImg);
+							terrainMask = SelectTerrain(f);
+						}
+						terrainMaskImg = terrainMask.View();
+						terrainSpans.FromPlane(terrainMask);
+						imshow("terrain", terrainMaskImg*255);
+
+						if (detected == true || terrainSelectionActionsPerformed == true) {
+							cameraMoved = true;
+
+							forceModelBuilding = true;
+							printf("Clearing background.\n");
+							bf->Clear();
+							//delete bf;
+							//bf=new BackgroundFetcher5(n, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold);
+
+							currentMaskCounter = 1;
+						}
+					}
+				}
+
+				img.copyTo(lastGoodImage);
+				cameraWasMoving = false;
+			}
+		}
+		--currentMaskCounter;
+		if (currentMaskCounter == 0) {
+			currentMaskCounter = currentMaskReset;
+
+			bool combineWithPrevious = false;
+			GetFilledBackgroundMask2(img, currentBackgroundFlag, uf, redLower, redUpper, greenLower, greenUpper, previousSizeThreshold, combineWithPrevious);
+			int initialRow = 0;
+			int initialCol = 0;
+			if (cameraMoved == true) {
+				CalculateCenter(currentMask, initialRow, initialCol);
+			}
+			//a copy, the flag plane is overwritten by the next GetFilledBackgroundMask2 before CalculateCenter reads the previous mask
+			currentBackgroundFlag.View().copyTo(currentMask);
+			//imshow("cm", currentMask);
+		}
+
+		--currentStep;
+		if (currentStep == 0 || forceModelBuilding == true) {
+			if (forceModelBuilding == false) {
+				currentStep = step;
+			}
+
+			bf->Add(img);
+
+			if (bf->IsFull() == true || forceModelBuilding == true) {
+				bf->GetBackground(background);
+				minRow = bf->minRow;
+				maxRow = bf->maxRow;
+				minCol = bf->minCol;
+				maxCol = bf->maxCol;
+			}
+			if (bf->IsFull() == true) {
+				forceModelBuilding = false;
+				currentStep = step;
+			}
+		}
+
+		/*++spreadCount;
+		++visitCount;
+		vector<bool> isTaken;
+		set<TrackingData*, TrackingData::DisposedComparison> currentlyDisposedGroups;
+		for (int gi = 0; gi<trackedGroups.size(); ++gi) {
+
+			Position seedPosition;
+			Spread(trackedGroups[gi]->positions, img, background, terrainMask, greenThreshold, spreadFlag, spreadData, visited, spreadCount, visitCount, seedPosition, false);
+
+			bool takeIt = Visit(trackedGroups[gi], img, background, terrainMask, greenThreshold, visited, visitCount, seedPosition, scanningAttempts, threshold, minimumGroupSize, owners, false, maximumWidth, maximumHeight, remainingFactor);
+
+			isTaken.push_back(takeIt);
+
+		}
+
+		for (int gi = 0; gi<isTaken.size(); ++gi) {
+			if (isTaken[gi] == false && trackedGroups[gi]->pushedOut == false) {
+
+				vector<Position> positions;
+				GetWiderAreaPositions(trackedGroups[gi], positions, rows, cols, 25, 3);
+
+				Position seedPosition;
+				Spread(positions, img, background, terrainMask, greenThreshold, spreadFlag, spreadData, visited, spreadCount, visitCount, seedPosition, false);
+
+				bool takeIt = Visit(trackedGroups[gi], img, background, terrainMask, greenThreshold, visited, visitCount, seedPosition, scanningAttempts, threshold, minimumGroupSize, owners, false, maximumWidth, maximumHeight, remainingFactor);
+
+				if (takeIt == false && trackedGroups[gi]->pushedOut == true) {
+					trackedGroups[gi]->pushedOut = false;
+				}
+
+				isTaken[gi] = takeIt;
+
+				if (takeIt == true) {
+					//printf("%d %d taken after wider area rescanning\n", framesCount, gi);
+				}
+
+			}
+
+			if (isTaken[gi] == true) {
+				if (trackedGroups[gi]->previous.size() >= 2) {
+					BoundingBox before = trackedGroups[gi]->previous[trackedGroups[gi]->previous.size() - 2];
+					BoundingBox after = trackedGroups[gi]->previous[trackedGroups[gi]->previous.size() - 1];
+					int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
+					int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+
+					if (areaAfter * 3<areaBefore) {
+						//printf("%d Alert!\n", framesCount);
+						redetectCount = 1;
+					}
+				}
+			}
+		}
+
+		//checking if a group is too long fully outside of the terrain
+		for (int i = 0; i<isTaken.size(); ++i) {
+			if (isTaken[i] == true) {
+				int inside = CountPositionsInsideTerrain(trackedGroups[i]->positions, terrainMaskImg);
+				if (inside == 0) {
+					++trackedGroups[i]->framesOutsideOfTerrain;
+					if (allowedFramesOutsideOfTerrain<trackedGroups[i]->framesOutsideOfTerrain) {
+						trackedGroups[i]->framesOutsideOfTerrain = 0;
+						isTaken[i] = false;
+					}
+				}
+			}
+		}
+
+		vector<TrackingData*> newTrackedGroups;
+		for (int i = 0; i<isTaken.size(); ++i) {
+			if (isTaken[i] == true) {
+				trackedGroups[i]->lastFrame = framesCount;
+				newTrackedGroups.push_back(trackedGroups[i]);
+			}
+			else {
+				currentlyDisposedGroups.insert(trackedGroups[i]);
+			}
+			trackedGroups[i]->isTracked = isTaken[i];
+		}*/
+
+		bool boundsStep = false;
+		if (--chromaticityBoundsCalculationCount == 0) {
+			chromaticityBoundsCalculationCount = chromaticityBoundsCalculationStep;
+			boundsStep = true;
+			if (automaticTerrain == true) {
+				terrainDetector.Add(img, redLower, redUpper, greenLower, greenUpper);
+				Plane<uchar> detected;
+				if (terrainDetector.GetTerrain(terrainPolygon, detected) == true) {
+					terrainMask = detected;
+					terrainMaskImg = terrainMask.View();
+					terrainSpans.FromPlane(terrainMask);
+				}
+			}
+		}
+		if (cameraWasMoving == false) {
+			chromaticity.Add(img, terrainSpans);
+		}
+		if (boundsStep == true && chromaticity.GetBounds(redLower, redUpper, greenLower, greenUpper, spreadFactor) == true) {
+			RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+			bf->SetChromaticityBounds(redLower, redUpper, greenLower, greenUpper);
+		}
+		
+		//vector<TrackingData*> newlyFoundGroups;
+		if (--redetectCount == 0) {
+			redetectCount = redetectStep;
+
+			if (previous.rows == 0) {
+				GetForegroundFlag(img, background, terrainSpans, threshold, greenThreshold, flag, suddenlyChanged, minRow, maxRow, minCol, maxCol);
+			}
+			else {
+				GetForegroundFlagWithRespectToPreviousFrameAndBackground3(img, previous, background, terrainSpans, threshold, thresholdForPrevious, greenThreshold, flag, suddenlyChanged, redLower, redUpper, greenLower, greenUpper, minRow, maxRow, minCol, maxCol);
+			}
+
+			Mat imageCopy;
+			morphologyEx(flag.View(), testImgMine, 3, element);
+			imshow("testImgMine", testImgMine*255);
+			morphologyEx(flag.View(), imageCopy, 4, element);
+			findContours(imageCopy, contours, hierarchy, CV_RETR_EXTERNAL, CHAIN_APPROX_TC89_KCOS);
+						
+			imshow("testImgMineNew", imageCopy*255);
+
+			/*
+			vector<vector<Position>> groups;
+			GetGroups(flag, img.rows, img.cols, groups, uf, false, minRow, maxRow, minCol, maxCol);
+
+			for (int gi = 0; gi<groups.size(); ++gi) {
+				const vector<Position> &group = groups[gi];
+
+				bool take = true;
+				for (int i = 0; i<group.size(); ++i) {
+					if (visited[group[i].row][group[i].col] == visitCount) {
+						take = false;
+						break;
+					}
+				}
+
+				//if (take==true && group.size()>=minimumGroupSize){
+				if (take == true && group.size() >= minimumGroupSizeAtFirstDetection) {
+					TrackingData *newGroup = new TrackingData(group);
+					newGroup->isTracked = true;
+					newlyFoundGroups.push_back(newGroup);
+					//isRescanned.push_back(false);
+				}
+			}
+			*/
+		}
+
+		/*for (int i = 0; i<newTrackedGroups.size(); ++i) {
+			newTrackedGroups[i]->CalculateMeanColor(img);
+			newTrackedGroups[i]->CalculateMeanPosition();
+		}*/
+
+		/*
+		if (newlyFoundGroups.size()>0) {
+			for (int i = 0; i<newlyFoundGroups.size(); ++i) {
+				newlyFoundGroups[i]->CalculateMeanColor(img);
+				newlyFoundGroups[i]->CalculateMeanPosition();
+
+				TrackingData *add = newlyFoundGroups[i];
+
+				//STATISTICS for reconnecting rules
+				//first, determine close groups
+				vector<pair<int, TrackingData*> > closeTracked;
+				for (int j = 0; j<newTrackedGroups.size(); ++j) {
+					TrackingData *tracked = newTrackedGroups[j];
+					if (tracked->meanPosition.row != -1) {
+						int dr = newlyFoundGroups[i]->meanPosition.row - tracked->meanPosition.row;
+						dr *= dr;
+						int dc = newlyFoundGroups[i]->meanPosition.col - tracked->meanPosition.col;
+						dc *= dc;
+						int d = dr + dc;
+						if (d <= sameGroupFieldDistance*sameGroupFieldDistance) {
+							closeTracked.push_back(make_pair(d, tracked));
+						}
+					}
+				}
+
+				auto closeComparison = [](const pair<int, TrackingData *> &p1, const pair<int, TrackingData *> &p2) {if (p1.first<p2.first) { return true; }if (p2.first<p1.first) { return false; }return p2.second->lastFrame<p1.second->lastFrame; };
+				sort(closeTracked.begin(), closeTracked.end(), closeComparison);
+
+				//then check whether the closest group has shrunk (lately)
+				bool sizeShrinked = false;
+				bool sizeShrinkedLately = false;
+				if (closeTracked.size()>0 && closeTracked[0].second->previous.size()>0) {
+					BoundingBox before = closeTracked[0].second->previous[closeTracked[0].second->previous.size() - 1];
+					BoundingBox after = GetBoundingBox(closeTracked[0].second->positions);
+					int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
+					int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+
+					if (areaAfter*1.5<areaBefore) {
+						sizeShrinked = true;
+					}
+
+					if (sizeShrinked == true) {
+						sizeShrinkedLately = true;
+					}
+					else {
+						int stop = closeTracked[0].second->previous.size() - backFramesToCheckForCloseTracked;
+						if (stop<0) {
+							stop = 0;
+						}
+						for (int j = closeTracked[0].second->previous.size() - 1; j>stop; --j) {
+							BoundingBox before = closeTracked[0].second->previous[j - 1];
+							BoundingBox after = GetBoundingBox(closeTracked[0].second->positions);
+
+							int areaBefore = (before.maxRow - before.minRow + 1)*(before.maxCol - before.minCol + 1);
+							int areaAfter = (after.maxRow - after.minRow + 1)*(after.maxCol - after.minCol + 1);
+
+							if (areaAfter*1.5<areaBefore) {
+								sizeShrinkedLately = true;
+								break;
+							}
+						}
+					}
+				}
+
+				//next, determine the closest disposed groups
+				vector<pair<int, TrackingData*> > closeDisposed;
+				for (auto si = disposedGroups.rbegin(); si != disposedGroups.rend(); ++si) {
+					TrackingData *disposed = *si;
+					if (framesCount - disposed->lastFrame>backFramesToCheckForStrongClosePushedOut) {
+						break;
+					}
+					if (disposed->meanPosition.row != -1) {
+						int dr = newlyFoundGroups[i]->meanPosition.row - disposed->meanPosition.row;
+						int dc = newlyFoundGroups[i]->meanPosition.col - disposed->meanPosition.col;
+						dr *= dr;
+						dc *= dc;
+						int d = dr + dc;
+						int backFrames = sameGroupBackFramesForSpeed;
+						if (disposed->previous.size()<backFrames) {
+							backFrames = disposed->previous.size();
+						}
+						if (backFrames<2) {
+							continue;
+						}
+						int sdr = 0;
+						int sdc = 0;
+						int lastRow = disposed->previous[disposed->previous.size() - backFrames].maxRow;
+						int lastCol = (disposed->previous[disposed->previous.size() - backFrames].maxCol - disposed->previous[disposed->previous.size() - backFrames].minCol) / 2;
+						int estimatedMaximalDistance = 0;
+						for (int i = disposed->previous.size() - backFrames + 1; i<disposed->previous.size(); ++i) {
+							int currentRow = disposed->previous[i].maxRow;
+							int currentCol = (disposed->previous[i].maxCol - disposed->previous[i].minCol) / 2;
+							int sdr = lastRow - currentRow;
+							int sdc = lastCol - currentCol;
+							estimatedMaximalDistance += sqrt(sdr*sdr + sdc*sdc);
+							lastRow = currentRow;
+							lastCol = currentCol;
+						}
+						estimatedMaximalDistance /= backFrames - 1;
+						estimatedMaximalDistance *= framesCount - disposed->lastFrame;
+						d = sqrt(d);
+						if (d <= 1.5*estimatedMaximalDistance) {
+							closeDisposed.push_back(make_pair(d, disposed));
+						}
+					}
+				}
+				sort(closeDisposed.begin(), closeDisposed.end(), closeComparison);
+
+				//RULE
+				//check for trajectories connecting when the disposed group closest to the current newly found group was pushed out by the closest tracked group
+				if (closeDisposed.size()>0) {
+					//if (closeTracked[0].second->pushedOutGroups.find(closeDisposed[0].second)!=closeTracked[0].second->pushedOutGroups.end()){
+					if (closeTracked.size()>0 && closeDisposed[0].second->pushedOut == true && closeDisposed[0].second->pushedOutBy == closeTracked[0].second && (sizeShrinked == true || sizeShrinkedLately == true)) {
+						//if (closeDisposed[0].second->pushedOut==true && closeDisposed[0].second->pushedOutBy==closeTracked[0].second){
+						add = closeDisposed[0].second;
+						disposedGroups.erase(disposedGroups.find(add));
+
+						ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, closeTracked[0].second);
+					}
+				}
+
+				//RULE
+				//check for the closest disposed group that was not pushed out and that is significantly closer than other similar groups
+				//somewhat unstable and therefore currently disabled
+				if (add == newlyFoundGroups[i] && closeDisposed.size()>0) {
+
+					if (closeDisposed[0].second->pushedOut == false && (closeDisposed.size() == 1 || closeDisposed[0].first * 5 <= closeDisposed[1].first)) {
+						add = closeDisposed[0].second;
+						disposedGroups.erase(disposedGroups.find(add));
+
+						ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, nullptr);
+					}
+				}
+
+				if (add == newlyFoundGroups[i] && closeTracked.size()>0 && (closeTracked.size() == 1 || closeTracked[0].first * 3 <= closeTracked[1].first) && (closeTracked[0].second->pushedOutGroups.size()>0) && currentlyDisposedGroups.find(*(closeTracked[0].second->pushedOutGroups.begin())) == currentlyDisposedGroups.end() && framesCount - (*(closeTracked[0].second->pushedOutGroups.begin()))->lastFrame <= backFramesToCheckForClosePushedOut) {
+					add = *(closeTracked[0].second->pushedOutGroups.begin());
+					disposedGroups.erase(disposedGroups.find(add));
+
+					ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, nullptr);
+				}
+				//
+
+				//AFTER ALL RULES
+				//adding the new (or old) group to the list of new tracked groups
+				if (add != nullptr) {
+					newTrackedGroups.push_back(add);
+				}
+
+			}
+
+		}
+		*/
+
+		/*trackedGroups = newTrackedGroups;
+		
+		if (maximumGroupsCount<trackedGroups.size()) {
+			sort(trackedGroups.begin(), trackedGroups.end(), [](const TrackingData *d1, const TrackingData *d2) {return d1->positions.size()*d1->previous.size()>d2->positions.size()*d2->previous.size(); });
+			trackedGroups.resize(maximumGroupsCount);
+		}
+
+		for (auto si = currentlyDisposedGroups.cbegin(); si != currentlyDisposedGroups.cend(); ++si) {
+			disposedGroups.insert(*si);
+		}
+
+		vector<BoundingBox> boundingBoxes;
+		for (int gi = 0; gi<trackedGroups.size(); ++gi) {
+			BoundingBox boundingBox = GetBoundingBox(trackedGroups[gi]->positions);
+			boundingBox.frame = framesCount;
+			boundingBox.type = BoundingBoxType::NORMAL;
+			boundingBox.meanColor = trackedGroups[gi]->meanColor;
+			trackedGroups[gi]->previous.push_back(boundingBox);
+			trackedGroups[gi]->lastFrame = framesCount;
+			boundingBoxes.push_back(boundingBox);
+		}
+
+		for (auto si = currentlyDisposedGroups.cbegin(); si != currentlyDisposedGroups.cend(); ++si) {
+			TrackingData *currentlyDisposedGroup = *si;
+			if (currentlyDisposedGroup->pushedOut == true) {
+				if (currentlyDisposedGroup->previous.size()>0) {
+					currentlyDisposedGroup->previous[currentlyDisposedGroup->previous.size() - 1].type |= BoundingBoxType::PUSHED_OUT;
+					if (currentlyDisposedGroup->pushedOutBy != nullptr && currentlyDisposedGroup->pushedOutBy->previous.size()>0) {
+						currentlyDisposedGroup->pushedOutBy->previous[currentlyDisposedGroup->pushedOutBy->previous.size() - 1].type |= BoundingBoxType::PUSHER;
+					}
+				}
+			}
+		}
+		*/
+
+		img.copyTo(previous);
+		//Mat img2;
+		//img.copyTo(img2);
+		img.copyTo(img);
+
+		//DrawTrajectories(img2, trackedGroups, trajectoryDrawingLength);
+		//DrawRectangles(img2, boundingBoxes);
+
+		resize(img, img, Size(img.cols / f, img.rows / f));
+		//resize(img2, img2, Size(img2.cols / f, img2.rows / f));
+
+		/*char framesCountText[17];
+		sprintf(framesCountText, "%d", framesCount);
+		putText(img2, framesCountText, Point(125, 50), CV_FONT_HERSHEY_PLAIN, 4, Scalar(0, 0, 255));*/
+
+		Mat displayBackground;
+		resize(background, displayBackground, Size(background.cols / f, background.rows / f));
+		
+		keyPressed = waitKey(1);
+		if (keyPressed == 'd' || keyPressed == 'D') {
+			//while (1) {				
+				img.copyTo(terrainSelectionImg);
+				drawContours(terrainSelectionImg, contours, -1, Scalar(0, 255, 255));
+				teamSelection.clear();
+				SelectTeam();
+
+				if (!analyse(img, contours)) printf("problem");
+				printf("%d\n", histData[0].id);
+				printf("%d\n", histData[1].id);
+				Mat z = Mat::zeros(50, 50, CV_8UC3);
+				for (int i = 0; i < myTracking.size(); ++i) {
+					printf("%d\n", myTracking[i].team);
+					imshow("testing_r", z);
+					imshow("testing_r", myTracking[i].rect);
+					waitKey();
+				}
+
+				for (int i = 0; i < myTracking.size(); ++i) {
+					if (myTracking[i].team == 0 || myTracking[i].team == 1) polylines(img, myTracking[i].contourPoints, true, Scalar(0, 0, 255), 1, 8);
+					else polylines(img, myTracking[i].contourPoints, true, Scalar(255, 0, 0), 1, 8);
+				}
+				imshow("i", img);
+				keyPressed = waitKey();
+				//if (keyPressed == 13) break;
+			//}			
+		}
+		else drawContours(img, contours, -1, Scalar(0, 255, 255));
+
+		imshow("i", img);
+		imshow("b", displayBackground);
+		//imshow("i2", img2);
+
+		
+
+		img.release();
+		//foreground.release();
+		//img2.release();
+		if (framesCount == 300) {
+			//break;
+		}
+	}
+
+
+	delete bf;
+
+
+	//FreeTrackingDataPointerMatrix(owners, rows);
+}
+
+struct TrackingParameters{
+	double thresholdFactor;
+	int maximumGroupsCount;
+	int minimumGroupSize;
+	int minimumGroupSizeAtFirstDetection;
+
+	double cameraMovedThreshold;
+	double pixelChangedThreshold;
+	int cameraMovedStep;
+	//off by default so the results of the existing runs do not change, if it is on the background is moved with the camera
+	//after it moved if the change is a translation of at most maximumCameraTranslation of the frame size, otherwise it is rebuilt
+	bool cameraMotionCompensation;
+	double maximumCameraTranslation;
+
+	int n;
+	int skip;
+	int step;
+	int take;
+
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	double spreadFactor;
+	//the chromaticity is sampled every frame from every chromaticityBoundsCalculationStep-th row and the bounds are applied every chromaticityBoundsCalculationStep frames,
+	//the weight of the earlier frames is lowered by chromaticityForgetting per frame (see ChromaticityEstimator)
+	int chromaticityBoundsCalculationStep;
+	double chromaticityForgetting;
+
+	double greenThreshold;
+	double previousSizeThreshold;
+	int redetectStep;
+	//off by default so the detections do not change, if it is on the objects are the 4-connected components of the foreground flags
+	//found by GetGroups inside of the bounds of the background instead of the contours of their morphological gradient,
+	//the components touching the border of the frame and the ones smaller than minimumGroupSize are dropped
+	bool componentDetection;
+	//the engine given to CreateBackgroundModel
+	string backgroundEngine;
+	//the learning rate of the engines updated every frame, 0 means 1/n
+	double learningRate;
+	//the background model is updated on its own thread and the detection uses the latest finished background,
+	//which makes the results depend on the timing
+	bool asynchronousBackground;
+
+	//the terrain mask image (0 outside of the terrain), the whole frame is used if it is empty
+	string terrainPath;
+	//the terrain polygon as written by SaveTerrainPolygon, used if terrainPath is empty
+	string terrainPolygonPath;
+	//off by default so the whole frame is used without terrainPath and terrainPolygonPath, if it is on the terrain is found by TerrainDetector instead,
+	//updated every chromaticityBoundsCalculationStep frames and found again after the camera moved
+	bool automaticTerrain;
+	//the directory where GetBackgroundSmartly2 caches the backgrounds, nothing is cached if it is empty,
+	//not used with artifactsPath since its files are found by the name of the video only
+	string backgroundsPath;
+	//the directory of the startup artifacts cache (see GetStartupArtifactsKey), nothing is cached if it is empty
+	string artifactsPath;
+	//the file the state of the tracker is written to every checkpointStep frames, no checkpoints are written if either is empty or 0
+	string checkpointPath;
+	int checkpointStep;
+	//the tracking continues from the checkpoint if it matches the video and the parameters
+	bool resume;
+	//the directory of the replay index, a snapshot of the tracker is written to it every replayIndexStep frames,
+	//so a replay tracks at most replayIndexStep frames again, see ReplayIndex for their size
+	string replayIndexPath;
+	int replayIndexStep;
+	//if it is not -1, the tracker is restored at this frame (counted from startFrame) from the replay index and the tracking continues from there
+	int replayFrame;
+	//the detections of a replay are written here instead of to detectionsPath, nothing is written if it is empty
+	string replayDetectionsPath;
+	//one of FrameSampling, how the frames between the ones the initial background is built from are skipped
+	int backgroundSampling;
+	//more than 1 splits the frames of the initial background between this many captures decoding in parallel
+	int backgroundCaptures;
+	//every detected object is written as "frame x y width height" if it is not empty
+	string detectionsPath;
+	//the frame the tracking starts at, the frames before it are only used for the initial background
+	int startFrame;
+	//0 means the whole video
+	int maximumFrames;
+	//the number of frames in flight in the threaded pipeline, 0 processes the frames one after another on a single thread
+	int pipelineDepth;
+	//the number of threads the loops over rows run on, 0 uses all cores
+	int threadsCount;
+
+	TrackingParameters(){
+		thresholdFactor=0.8;
+		maximumGroupsCount=35;
+		minimumGroupSize=3;
+		minimumGroupSizeAtFirstDetection=5;
+
+		cameraMovedThreshold=0.2;
+		pixelChangedThreshold=5.0;
+		cameraMovedStep=20;
+		cameraMotionCompensation=false;
+		maximumCameraTranslation=0.25;
+		automaticTerrain=false;
+
+		n=20;
+		skip=0;
+		step=30;
+		take=n;
+
+		redLower=0.3450;
+		redUpper=0.3661;
+		greenLower=0.4600;
+		greenUpper=0.5075;
+		spreadFactor=4.0;
+		chromaticityBoundsCalculationStep=25;
+		chromaticityForgetting=0.02;
+
+		greenThreshold=45;
+		previousSizeThreshold=2.0;
+		redetectStep=2;
+		componentDetection=false;
+		backgroundEngine="mean";
+		learningRate=0;
+		asynchronousBackground=false;
+
+		backgroundSampling=SAMPLE_GRAB;
+		backgroundCaptures=1;
+
+		checkpointStep=0;
+		resume=false;
+		replayIndexStep=0;
+		replayFrame=-1;
+
+		startFrame=0;
+		maximumFrames=0;
+		pipelineDepth=8;
+		threadsCount=0;
+	}
+
+	double Threshold() const{
+		return thresholdFactor*1000.0;
+	}
+
+	double ThresholdForPrevious() const{
+		return thresholdFactor*250.0;
+	}
+
+	bool Set(const char *name, const char *value){
+		if (strcmp(name, "thresholdFactor")==0){
+			thresholdFactor=atof(value);
+		} else if (strcmp(name, "maximumGroupsCount")==0){
+			maximumGroupsCount=atoi(value);
+		} else if (strcmp(name, "minimumGroupSize")==0){
+			minimumGroupSize=atoi(value);
+		} else if (strcmp(name, "minimumGroupSizeAtFirstDetection")==0){
+			minimumGroupSizeAtFirstDetection=atoi(value);
+		} else if (strcmp(name, "cameraMovedThreshold")==0){
+			cameraMovedThreshold=atof(value);
+		} else if (strcmp(name, "pixelChangedThreshold")==0){
+			pixelChangedThreshold=atof(value);
+		} else if (strcmp(name, "cameraMovedStep")==0){
+			cameraMovedStep=atoi(value);
+		} else if (strcmp(name, "cameraMotionCompensation")==0){
+			cameraMotionCompensation=atoi(value)!=0;
+		} else if (strcmp(name, "maximumCameraTranslation")==0){
+			maximumCameraTranslation=atof(value);
+		} else if (strcmp(name, "n")==0){
+			n=atoi(value);
+		} else if (strcmp(name, "skip")==0){
+			skip=atoi(value);
+		} else if (strcmp(name, "step")==0){
+			step=atoi(value);
+		} else if (strcmp(name, "take")==0){
+			take=atoi(value);
+		} else if (strcmp(name, "redLower")==0){
+			redLower=atof(value);
+		} else if (strcmp(name, "redUpper")==0){
+			redUpper=atof(value);
+		} else if (strcmp(name, "greenLower")==0){
+			greenLower=atof(value);
+		} else if (strcmp(name, "greenUpper")==0){
+			greenUpper=atof(value);
+		} else if (strcmp(name, "spreadFactor")==0){
+			spreadFactor=atof(value);
+		} else if (strcmp(name, "chromaticityBoundsCalculationStep")==0){
+			chromaticityBoundsCalculationStep=atoi(value);
+		} else if (strcmp(name, "chromaticityForgetting")==0){
+			chromaticityForgetting=atof(value);
+		} else if (strcmp(name, "greenThreshold")==0){
+			greenThreshold=atof(value);
+		} else if (strcmp(name, "previousSizeThreshold")==0){
+			previousSizeThreshold=atof(value);
+		} else if (strcmp(name, "redetectStep")==0){
+			redetectStep=atoi(value);
+		} else if (strcmp(name, "componentDetection")==0){
+			componentDetection=atoi(value)!=0;
+		} else if (strcmp(name, "backgroundEngine")==0){
+			backgroundEngine=value;
+		} else if (strcmp(name, "learningRate")==0){
+			learningRate=atof(value);
+		} else if (strcmp(name, "asynchronousBackground")==0){
+			asynchronousBackground=atoi(value)!=0;
+		} else if (strcmp(name, "backgroundSampling")==0){
+			backgroundSampling=atoi(value);
+		} else if (strcmp(name, "backgroundCaptures")==0){
+			backgroundCaptures=atoi(value);
+		} else if (strcmp(name, "terrainPath")==0){
+			terrainPath=value;
+		} else if (strcmp(name, "terrainPolygonPath")==0){
+			terrainPolygonPath=value;
+		} else if (strcmp(name, "automaticTerrain")==0){
+			automaticTerrain=atoi(value)!=0;
+		} else if (strcmp(name, "backgroundsPath")==0){
+			backgroundsPath=value;
+		} else if (strcmp(name, "artifactsPath")==0){
+			artifactsPath=value;
+		} else if (strcmp(name, "checkpointPath")==0){
+			checkpointPath=value;
+		} else if (strcmp(name, "checkpointStep")==0){
+			checkpointStep=atoi(value);
+		} else if (strcmp(name, "resume")==0){
+			resume=atoi(value)!=0;
+		} else if (strcmp(name, "replayIndexPath")==0){
+			replayIndexPath=value;
+		} else if (strcmp(name, "replayIndexStep")==0){
+			replayIndexStep=atoi(value);
+		} else if (strcmp(name, "replayFrame")==0){
+			replayFrame=atoi(value);
+		} else if (strcmp(name, "replayDetectionsPath")==0){
+			replayDetectionsPath=value;
+		} else if (strcmp(name, "detectionsPath")==0){
+			detectionsPath=value;
+		} else if (strcmp(name, "startFrame")==0){
+			startFrame=atoi(value);
+		} else if (strcmp(name, "maximumFrames")==0){
+			maximumFrames=atoi(value);
+		} else if (strcmp(name, "pipelineDepth")==0){
+			pipelineDepth=atoi(value);
+		} else if (strcmp(name, "threadsCount")==0){
+			threadsCount=atoi(value);
+		} else{
+			return false;
+		}
+		return true;
+	}
+};
+
+//every line of the file is "name value", empty lines and lines starting with # are skipped
+bool LoadTrackingParameters(const char *path, TrackingParameters &parameters){
+	FILE *input=fopen(path, "r");
+	if (input==NULL){
+		return false;
+	}
+
+	bool takeSet=false;
+	char line[2049];
+	int lineNumber=0;
+	while (fgets(line, sizeof(line), input)!=NULL){
+		++lineNumber;
+		char name[1025];
+		char value[1025];
+		if (sscanf(line, " %1024s %1024[^\r\n]", name, value)!=2 || name[0]=='#'){
+			continue;
+		}
+		if (parameters.Set(name, value)==false){
+			printf("Unknown parameter %s in line %d of %s.\n", name, lineNumber, path);
+		} else if (strcmp(name, "take")==0){
+			takeSet=true;
+		}
+	}
+	fclose(input);
+
+	//the same as in Test97, take follows n unless it is given explicitly
+	if (takeSet==false){
+		parameters.take=parameters.n;
+	}
+
+	return true;
+}
+
+//everything the detection needs from the background part, it is published for every frame
+//the background and the terrain are never changed in place once published, new ones are allocated instead
+struct BackgroundSnapshot{
+	Mat background;
+	Plane<uchar> terrainMask;
+	SpanMask terrainSpans;
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+};
+
+//the background part of Test97: camera movement checks, the background model and the chromaticity bounds
+struct BackgroundMaintainer{
+	TrackingParameters parameters;
+	int rows;
+	int cols;
+
+	Plane<uchar> terrainMask;
+	Mat terrainMaskImg;
+	SpanMask terrainSpans;
+	//the terrain is found by terrainDetector instead of being given
+	bool automaticTerrain;
+	TerrainDetector terrainDetector;
+
+	double redLower;
+	double redUpper;
+	double greenLower;
+	double greenUpper;
+	int chromaticityBoundsCalculationCount;
+	ChromaticityEstimator chromaticity;
+
+	BackgroundModel *bf;
+	Mat background;
+	int minRow;
+	int maxRow;
+	int minCol;
+	int maxCol;
+	int currentStep;
+	bool forceModelBuilding;
+
+	bool cameraWasMoving;
+	Mat lastGoodImage;
+	Mat previous;
+
+	BackgroundMaintainer(const TrackingParameters &parameters):parameters(parameters), terrainDetector(0.2, 0.005, parameters.previousSizeThreshold), chromaticity(parameters.chromaticityBoundsCalculationStep, parameters.chromaticityForgetting){
+		rows=0;
+		cols=0;
+		automaticTerrain=parameters.automaticTerrain==true && parameters.terrainPath.empty()==true && parameters.terrainPolygonPath.empty()==true;
+		redLower=parameters.redLower;
+		redUpper=parameters.redUpper;
+		greenLower=parameters.greenLower;
+		greenUpper=parameters.greenUpper;
+		chromaticityBoundsCalculationCount=parameters.chromaticityBoundsCalculationStep;
+		bf=NULL;
+		minRow=-1;
+		maxRow=-1;
+		minCol=-1;
+		maxCol=-1;
+		currentStep=1;
+		forceModelBuilding=false;
+		cameraWasMoving=false;
+	}
+
+	~BackgroundMaintainer(){
+		delete bf;
+	}
+
+	//an empty terrain mask means that the terrain is found automatically or that the whole frame is the terrain,
+	//the chromaticity bounds are kept if they were loaded from the cache
+	void Initialize(const Mat &firstImage, const Plane<uchar> &terrain, bool calculateBounds=true){
+		rows=firstImage.rows;
+		cols=firstImage.cols;
+
+		//the first frame is added with the initial bounds even if the terrain was cached, so the detector is the same either way
+		if (automaticTerrain==true){
+			terrainDetector.Add(firstImage, parameters.redLower, parameters.redUpper, parameters.greenLower, parameters.greenUpper);
+		}
+
+		vector<Point> polygon;
+		if (terrain.Empty()==false){
+			terrainMask=terrain;
+		} else if (automaticTerrain==false || terrainDetector.GetTerrain(polygon, terrainMask)==false){
+			terrainMask.Create(rows, cols);
+			terrainMask.View().setTo(Scalar(1));
+		}
+		terrainMaskImg=terrainMask.View();
+		terrainSpans.FromPlane(terrainMask);
+
+		firstImage.copyTo(lastGoodImage);
+
+		//the whole first frame is added even if the bounds were cached, so the estimator is the same either way
+		chromaticity.Add(firstImage, terrainSpans, true);
+		if (calculateBounds==true){
+			chromaticity.GetBounds(redLower, redUpper, greenLower, greenUpper, parameters.spreadFactor);
+		}
+		RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+
+		bf=CreateBackgroundModel(parameters.backgroundEngine, parameters.n, redLower, redUpper, greenLower, greenUpper, parameters.previousSizeThreshold, parameters.learningRate);
+		if (bf==NULL){
+			printf("Unknown background engine %s, using mean.\n", parameters.backgroundEngine.c_str());
+			bf=CreateBackgroundModel("mean", parameters.n, redLower, redUpper, greenLower, greenUpper, parameters.previousSizeThreshold);
+		}
+		if (parameters.asynchronousBackground==true){
+			bf=new AsyncBackgroundModel(bf);
+		}
+	}
+
+	void SetBackground(const Mat &initialBackground, int minRow, int maxRow, int minCol, int maxCol){
+		background=initialBackground;
+		this->minRow=minRow;
+		this->maxRow=maxRow;
+		this->minCol=minCol;
+		this->maxCol=maxCol;
+	}
+
+	void SetBackground(const Mat &initialBackground){
+		background=initialBackground;
+		GetBackgroundBounds(background, minRow, maxRow, minCol, maxCol);
+	}
+
+	void Update(const Mat &img, int frame){
+		if (previous.rows!=0){
+			double difference=CalculateApproximateDifference2(img, previous, parameters.cameraMovedStep, terrainSpans, parameters.pixelChangedThreshold);
+			if (parameters.cameraMovedThreshold<difference){
+				if (cameraWasMoving==false){
+					previous.copyTo(lastGoodImage);
+				}
+				cameraWasMoving=true;
+				//the terrain may not be valid while the camera is moving so it is not detected again
+				++chromaticityBoundsCalculationCount;
+			} else{
+				if (cameraWasMoving==true){
+					double difference=CalculateApproximateDifference2(img, lastGoodImage, parameters.cameraMovedStep, terrainSpans, parameters.pixelChangedThreshold);
+					if (parameters.cameraMovedThreshold<difference){
+						int dx, dy;
+						if (parameters.cameraMotionCompensation==true && CompensateCameraMotion(lastGoodImage, img, bf, background, terrainMask, terrainSpans, minRow, maxRow, minCol, maxCol, parameters.maximumCameraTranslation, parameters.cameraMovedStep, parameters.pixelChangedThreshold, parameters.cameraMovedThreshold, &dx, &dy)==true){
+							printf("Camera moved at frame %d by (%d, %d), moving the background.\n", frame, dx, dy);
+							terrainMaskImg=terrainMask.View();
+							terrainDetector.Translate(dx, dy);
+						} else{
+							printf("Camera moved at frame %d, rebuilding the background.\n", frame);
+							forceModelBuilding=true;
+							bf->Clear();
+							if (automaticTerrain==true){
+								terrainDetector.Reset();
+								DetectTerrain(img);
+							}
+						}
+					}
+				}
+				img.copyTo(lastGoodImage);
+				cameraWasMoving=false;
+			}
+		}
+
+		--currentStep;
+		if (currentStep==0 || forceModelBuilding==true || bf->UpdatesEveryFrame()==true){
+			if (forceModelBuilding==false){
+				currentStep=parameters.step;
+			}
+
+			bf->Add(img);
+
+			if (bf->IsFull()==true || forceModelBuilding==true){
+				bf->GetBackground(background);
+				minRow=bf->minRow;
+				maxRow=bf->maxRow;
+				minCol=bf->minCol;
+				maxCol=bf->maxCol;
+			}
+			if (bf->IsFull()==true){
+				forceModelBuilding=false;
+				currentStep=parameters.step;
+			}
+		}
+
+		bool boundsStep=false;
+		if (--chromaticityBoundsCalculationCount==0){
+			chromaticityBoundsCalculationCount=parameters.chromaticityBoundsCalculationStep;
+			boundsStep=true;
+			if (automaticTerrain==true){
+				DetectTerrain(img);
+			}
+		}
+
+		//the terrain may not be valid while the camera is moving so it is not used for the bounds
+		if (cameraWasMoving==false){
+			chromaticity.Add(img, terrainSpans);
+		}
+		//the estimate is given to the model only every chromaticityBoundsCalculationStep frames, so the grass table built for it is used until then
+		if (boundsStep==true && chromaticity.GetBounds(redLower, redUpper, greenLower, greenUpper, parameters.spreadFactor)==true){
+			RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+			bf->SetChromaticityBounds(redLower, redUpper, greenLower, greenUpper);
+		}
+
+		img.copyTo(previous);
+	}
+
+	//adds the frame to the terrain detector and takes the terrain from it, the terrain is a new plane so the snapshots keep theirs
+	void DetectTerrain(const Mat &img){
+		terrainDetector.Add(img, redLower, redUpper, greenLower, greenUpper);
+		vector<Point> polygon;
+		Plane<uchar> detected;
+		if (terrainDetector.GetTerrain(polygon, detected)==true){
+			terrainMask=detected;
+			terrainMaskImg=terrainMask.View();
+			terrainSpans.FromPlane(terrainMask);
+		}
+	}
+
+	//the terrain is saved as well, it is moved with the camera
+	bool Save(StateWriter &writer){
+		terrainDetector.Save(writer);
+		writer.WritePlane(terrainMask);
+		writer.WriteValue(redLower);
+		writer.WriteValue(redUpper);
+		writer.WriteValue(greenLower);
+		writer.WriteValue(greenUpper);
+		writer.WriteValue(chromaticityBoundsCalculationCount);
+		chromaticity.Save(writer);
+		writer.WriteMat(background);
+		writer.WriteValue(minRow);
+		writer.WriteValue(maxRow);
+		writer.WriteValue(minCol);
+		writer.WriteValue(maxCol);
+		writer.WriteValue(currentStep);
+		writer.WriteValue(forceModelBuilding);
+		writer.WriteValue(cameraWasMoving);
+		writer.WriteMat(lastGoodImage);
+		writer.WriteMat(previous);
+		return bf->Save(writer) && writer.failed==false;
+	}
+
+	//Initialize has to be called first, so the model exists
+	bool Load(StateReader &reader){
+		if (terrainDetector.Load(reader)==false){
+			return false;
+		}
+		reader.ReadPlane(terrainMask);
+		if (reader.failed==true || terrainMask.rows!=rows || terrainMask.cols!=cols){
+			return false;
+		}
+		terrainMaskImg=terrainMask.View();
+		terrainSpans.FromPlane(terrainMask);
+		reader.ReadValue(redLower);
+		reader.ReadValue(redUpper);
+		reader.ReadValue(greenLower);
+		reader.ReadValue(greenUpper);
+		reader.ReadValue(chromaticityBoundsCalculationCount);
+		if (chromaticity.Load(reader)==false){
+			return false;
+		}
+		reader.ReadMat(background);
+		reader.ReadValue(minRow);
+		reader.ReadValue(maxRow);
+		reader.ReadValue(minCol);
+		reader.ReadValue(maxCol);
+		reader.ReadValue(currentStep);
+		reader.ReadValue(forceModelBuilding);
+		reader.ReadValue(cameraWasMoving);
+		reader.ReadMat(lastGoodImage);
+		reader.ReadMat(previous);
+		if (reader.failed==true || background.rows!=rows || background.cols!=cols){
+			return false;
+		}
+		if (bf->Load(reader)==false){
+			return false;
+		}
+		//the table of the initial bounds was requested by Initialize, the restored bounds need their own
+		RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+		return true;
+	}
+
+	//the published part of the state for the replay snapshots: the background model itself is left out, so after LoadReplayState
+	//the model is empty and the restored background is used until the model is full again; the last good image is the previous frame
+	//unless the camera is moving, the images are compressed
+	bool SaveReplayState(StateWriter &writer){
+		terrainDetector.Save(writer);
+		writer.WriteCompressedMat(terrainMask.View());
+		writer.WriteValue(redLower);
+		writer.WriteValue(redUpper);
+		writer.WriteValue(greenLower);
+		writer.WriteValue(greenUpper);
+		writer.WriteValue(chromaticityBoundsCalculationCount);
+		chromaticity.Save(writer);
+		writer.WriteCompressedMat(background);
+		writer.WriteValue(minRow);
+		writer.WriteValue(maxRow);
+		writer.WriteValue(minCol);
+		writer.WriteValue(maxCol);
+		writer.WriteValue(currentStep);
+		writer.WriteValue(cameraWasMoving);
+		writer.WriteCompressedMat(cameraWasMoving==true ? lastGoodImage : Mat());
+		writer.WriteCompressedMat(previous);
+		return writer.failed==false;
+	}
+
+	//Initialize has to be called first, so the model exists
+	bool LoadReplayState(StateReader &reader){
+		if (terrainDetector.Load(reader)==false){
+			return false;
+		}
+		reader.ReadCompressedPlane(terrainMask);
+		if (reader.failed==true || terrainMask.rows!=rows || terrainMask.cols!=cols){
+			return false;
+		}
+		terrainMaskImg=terrainMask.View();
+		terrainSpans.FromPlane(terrainMask);
+		reader.ReadValue(redLower);
+		reader.ReadValue(redUpper);
+		reader.ReadValue(greenLower);
+		reader.ReadValue(greenUpper);
+		reader.ReadValue(chromaticityBoundsCalculationCount);
+		if (chromaticity.Load(reader)==false){
+			return false;
+		}
+		reader.ReadCompressedMat(background);
+		reader.ReadValue(minRow);
+		reader.ReadValue(maxRow);
+		reader.ReadValue(minCol);
+		reader.ReadValue(maxCol);
+		reader.ReadValue(currentStep);
+		reader.ReadValue(cameraWasMoving);
+		reader.ReadCompressedMat(lastGoodImage);
+		reader.ReadCompressedMat(previous);
+		if (reader.failed==true || background.rows!=rows || background.cols!=cols || background.type()!=CV_8UC3 || previous.rows!=rows || previous.cols!=cols || previous.type()!=CV_8UC3){
+			return false;
+		}
+		if (cameraWasMoving==false){
+			previous.copyTo(lastGoodImage);
+		} else if (lastGoodImage.rows!=rows || lastGoodImage.cols!=cols || lastGoodImage.type()!=CV_8UC3){
+			return false;
+		}
+		if (currentStep<1 || parameters.step<currentStep){
+			currentStep=1;
+		}
+		forceModelBuilding=false;
+		bf->Clear();
+		bf->SetChromaticityBounds(redLower, redUpper, greenLower, greenUpper);
+		RequestGrassTable(redLower, redUpper, greenLower, greenUpper);
+		return true;
+	}
+
+	void GetSnapshot(BackgroundSnapshot &snapshot) const{
+		snapshot.background=background;
+		snapshot.terrainMask=terrainMask;
+		snapshot.terrainSpans=terrainSpans;
+		snapshot.redLower=redLower;
+		snapshot.redUpper=redUpper;
+		snapshot.greenLower=greenLower;
+		snapshot.greenUpper=greenUpper;
+		snapshot.minRow=minRow;
+		snapshot.maxRow=maxRow;
+		snapshot.minCol=minCol;
+		snapshot.maxCol=maxCol;
+	}
+};
+
+//the detection part of Test97, it only needs the frames and the published background snapshots
+struct ForegroundDetector{
+	TrackingParameters parameters;
+
+	Mat previous;
+	Plane<uchar> flag;
+	Plane<uchar> suddenlyChanged;
+	int redetectCount;
+	Mat element;
+	vector<vector<Point> > contours;
+	ComponentLabeler labeler;
+	Plane<int> labels;
+	vector<ComponentStats> groups;
+	//the bounding boxes of the objects found by the last detection
+	vector<Rect> detections;
+
+	ForegroundDetector(const TrackingParameters &parameters):parameters(parameters){
+		redetectCount=parameters.redetectStep;
+		element=getStructuringElement(CV_SHAPE_ELLIPSE, Size(3, 3), Point(1, 1));
+	}
+
+	void Initialize(int rows, int cols){
+		flag.Create(rows, cols, true);
+		suddenlyChanged.Create(rows, cols, true);
+	}
+
+	//returns true if the foreground was detected again in this frame
+	bool Detect(const Mat &img, const BackgroundSnapshot &snapshot, bool force=false){
+		bool detected=false;
+		if (--redetectCount==0 || force==true){
+			redetectCount=parameters.redetectStep;
+			detected=true;
+
+			if (previous.rows==0){
+				GetForegroundFlag(img, snapshot.background, snapshot.terrainSpans, parameters.Threshold(), parameters.greenThreshold, flag, suddenlyChanged, snapshot.minRow, snapshot.maxRow, snapshot.minCol, snapshot.maxCol);
+			} else{
+				GetForegroundFlagWithRespectToPreviousFrameAndBackground3(img, previous, snapshot.background, snapshot.terrainSpans, parameters.Threshold(), parameters.ThresholdForPrevious(), parameters.greenThreshold, flag, suddenlyChanged, snapshot.redLower, snapshot.redUpper, snapshot.greenLower, snapshot.greenUpper, snapshot.minRow, snapshot.maxRow, snapshot.minCol, snapshot.maxCol);
+			}
+
+			detections.clear();
+			if (parameters.componentDetection==true){
+				GetGroups(flag, groups, labeler, labels, snapshot.minRow, snapshot.maxRow, snapshot.minCol, snapshot.maxCol);
+				for (int k=0;k<groups.size();++k){
+					const ComponentStats &group=groups[k];
+					if (group.area>=parameters.minimumGroupSize){
+						detections.push_back(Rect(group.minCol, group.minRow, group.maxCol-group.minCol+1, group.maxRow-group.minRow+1));
+					}
+				}
+			} else{
+				Mat imageCopy;
+				vector<Vec4i> hierarchy;
+				morphologyEx(flag.View(), imageCopy, 4, element);
+				findContours(imageCopy, contours, hierarchy, CV_RETR_EXTERNAL, CHAIN_APPROX_TC89_KCOS);
+				for (int k=0;k<contours.size();++k){
+					detections.push_back(boundingRect(contours[k]));
+				}
+			}
+		}
+
+		img.copyTo(previous);
+
+		return detected;
+	}
+
+	//the flags are saved as well, the pixels outside of the bounds of the background keep their values from the frames before
+	bool Save(StateWriter &writer){
+		writer.WriteValue(redetectCount);
+		writer.WriteMat(previous);
+		writer.WritePlane(flag);
+		writer.WritePlane(suddenlyChanged);
+		return writer.failed==false;
+	}
+
+	bool Load(StateReader &reader){
+		int rows=flag.rows;
+		int cols=flag.cols;
+		reader.ReadValue(redetectCount);
+		reader.ReadMat(previous);
+		reader.ReadPlane(flag);
+		reader.ReadPlane(suddenlyChanged);
+		return reader.failed==false && flag.rows==rows && flag.cols==cols && suddenlyChanged.rows==rows && suddenlyChanged.cols==cols;
+	}
+
+	//the previous frame is left out, it is the previous frame of the background part
+	bool SaveReplayState(StateWriter &writer){
+		writer.WriteValue(redetectCount);
+		writer.WriteCompressedMat(flag.View());
+		writer.WriteCompressedMat(suddenlyChanged.View());
+		return writer.failed==false;
+	}
+
+	bool LoadReplayState(StateReader &reader, const Mat &previousImage){
+		int rows=flag.rows;
+		int cols=flag.cols;
+		reader.ReadValue(redetectCount);
+		reader.ReadCompressedPlane(flag);
+		reader.ReadCompressedPlane(suddenlyChanged);
+		previousImage.copyTo(previous);
+		return reader.failed==false && flag.rows==rows && flag.cols==cols && suddenlyChanged.rows==rows && suddenlyChanged.cols==cols;
+	}
+};
+
+//the detection and background part of Test97 without any windows or interaction, one frame after another
+struct HeadlessTracker{
+	BackgroundMaintainer model;
+	ForegroundDetector detector;
+	BackgroundSnapshot snapshot;
+	int framesCount;
+
+	HeadlessTracker(const TrackingParameters &parameters):model(parameters), detector(parameters){
+		framesCount=0;
+	}
+
+	void Initialize(const Mat &firstImage, const Plane<uchar> &terrain, bool calculateBounds=true){
+		model.Initialize(firstImage, terrain, calculateBounds);
+		detector.Initialize(firstImage.rows, firstImage.cols);
+	}
+
+	bool ProcessFrame(const Mat &img){
+		++framesCount;
+		model.Update(img, framesCount);
+		model.GetSnapshot(snapshot);
+		return detector.Detect(img, snapshot);
+	}
+
+	bool Save(StateWriter &writer){
+		writer.WriteValue(framesCount);
+		return model.Save(writer) && detector.Save(writer);
+	}
+
+	bool Load(StateReader &reader){
+		reader.ReadValue(framesCount);
+		return reader.failed==false && model.Load(reader) && detector.Load(reader);
+	}
+
+	bool SaveReplayState(StateWriter &writer){
+		writer.WriteValue(framesCount);
+		return model.SaveReplayState(writer) && detector.SaveReplayState(writer);
+	}
+
+	bool LoadReplayState(StateReader &reader){
+		reader.ReadValue(framesCount);
+		return reader.failed==false && model.LoadReplayState(reader) && detector.LoadReplayState(reader, model.previous);
+	}
+};
+
+//bounded lock-free queue for exactly one producer and one consumer thread, Push and Pop retry for a short while and then sleep
+//until the other side makes room or adds an item, the lock is only taken by a side that sleeps or wakes the other one up
+template<typename T>
+struct SpscQueue{
+	//the retries before sleeping, a few microseconds, long enough for a stage that keeps up and short enough not to burn a core
+	static const int spinCount=256;
+
+	vector<T> items;
+	size_t mask;
+	atomic<size_t> head;
+	atomic<size_t> tail;
+	mutex lock;
+	condition_variable notEmpty;
+	condition_variable notFull;
+	atomic<bool> popWaiting;
+	atomic<bool> pushWaiting;
+
+	SpscQueue(int capacity){
+		size_t size=1;
+		while (size<(size_t)capacity){
+			size<<=1;
+		}
+		items.resize(size);
+		mask=size-1;
+		head=0;
+		tail=0;
+		popWaiting=false;
+		pushWaiting=false;
+	}
+
+	bool Enqueue(const T &item){
+		size_t t=tail.load(memory_order_relaxed);
+		if (t-head.load(memory_order_acquire)>mask){
+			return false;
+		}
+		items[t&mask]=item;
+		tail.store(t+1, memory_order_release);
+		return true;
+	}
+
+	bool Dequeue(T &item){
+		size_t h=head.load(memory_order_relaxed);
+		if (h==tail.load(memory_order_acquire)){
+			return false;
+		}
+		item=items[h&mask];
+		head.store(h+1, memory_order_release);
+		return true;
+	}
+
+	//the fence orders the store of head or tail before the load of the flag, and the sleeping side sets its flag before it checks
+	//the queue again, so either it finds the change or it is woken up; locked is true if the caller already holds the lock
+	void WakeUp(atomic<bool> &waiting, condition_variable &condition, bool locked=false){
+		atomic_thread_fence(memory_order_seq_cst);
+		if (waiting.load(memory_order_relaxed)==true){
+			if (locked==true){
+				condition.notify_one();
+			} else{
+				lock_guard<mutex> guard(lock);
+				condition.notify_one();
+			}
+		}
+	}
+
+	bool TryPush(const T &item){
+		if (Enqueue(item)==false){
+			return false;
+		}
+		WakeUp(popWaiting, notEmpty);
+		return true;
+	}
+
+	bool TryPop(T &item){
+		if (Dequeue(item)==false){
+			return false;
+		}
+		WakeUp(pushWaiting, notFull);
+		return true;
+	}
+
+	void Push(const T &item){
+		for (int k=0;k<spinCount;++k){
+			if (TryPush(item)==true){
+				return;
+			}
+		}
+		unique_lock<mutex> guard(lock);
+		pushWaiting.store(true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (Enqueue(item)==false){
+			notFull.wait(guard);
+		}
+		pushWaiting.store(false, memory_order_relaxed);
+		WakeUp(popWaiting, notEmpty, true);
+	}
+
+	T Pop(){
+		T item;
+		for (int k=0;k<spinCount;++k){
+			if (TryPop(item)==true){
+				return item;
+			}
+		}
+		unique_lock<mutex> guard(lock);
+		popWaiting.store(true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (Dequeue(item)==false){
+			notEmpty.wait(guard);
+		}
+		popWaiting.store(false, memory_order_relaxed);
+		WakeUp(pushWaiting, notFull, true);
+		return item;
+	}
+};
+
+//a frame travelling through the pipeline, the packets are recycled so the frame buffers are allocated only once
+struct FramePacket{
+	//-1 marks the end of the video
+	int frame;
+	Mat img;
+	BackgroundSnapshot snapshot;
+	bool detected;
+	vector<Rect> detections;
+};
+
+//decoding, background maintenance, detection and output run on their own threads connected by bounded queues,
+//so the throughput is given by the slowest stage; the results are the same as with HeadlessTracker
+struct TrackingPipeline{
+	BackgroundMaintainer &model;
+	ForegroundDetector &detector;
+	int depth;
+
+	vector<FramePacket> packets;
+	SpscQueue<FramePacket*> freePackets;
+	SpscQueue<FramePacket*> decoded;
+	SpscQueue<FramePacket*> modelled;
+	SpscQueue<FramePacket*> detected;
+
+	TrackingPipeline(BackgroundMaintainer &model, ForegroundDetector &detector, int depth=8):model(model), detector(detector), depth(depth), packets(depth), freePackets(depth), decoded(depth), modelled(depth), detected(depth){
+		for (int i=0;i<depth;++i){
+			freePackets.Push(&packets[i]);
+		}
+	}
+
+	void Decode(VideoCapture *video, int maximumFrames, int firstFrame){
+		int frame=0;
+		while (true){
+			FramePacket *packet=freePackets.Pop();
+			if (maximumFrames!=0 && frame==maximumFrames){
+				packet->frame=-1;
+			} else{
+				(*video)>>packet->img;
+				packet->frame=packet->img.empty()==true ? -1 : firstFrame+(++frame);
+			}
+			decoded.Push(packet);
+			if (packet->frame==-1){
+				break;
+			}
+		}
+	}
+
+	void Model(){
+		while (true){
+			FramePacket *packet=decoded.Pop();
+			if (packet->frame!=-1){
+				model.Update(packet->img, packet->frame);
+				model.GetSnapshot(packet->snapshot);
+			}
+			modelled.Push(packet);
+			if (packet->frame==-1){
+				break;
+			}
+		}
+	}
+
+	void Detect(){
+		while (true){
+			FramePacket *packet=modelled.Pop();
+			if (packet->frame!=-1){
+				packet->detected=detector.Detect(packet->img, packet->snapshot);
+				if (packet->detected==true){
+					packet->detections=detector.detections;
+				}
+			}
+			detected.Push(packet);
+			if (packet->frame==-1){
+				break;
+			}
+		}
+	}
+
+	//the output stage runs on the calling thread, output is called for every frame in order,
+	//the frames are numbered from firstFrame+1 and the pipeline can be run again on the rest of the video
+	template<typename Output>
+	int Run(VideoCapture &video, int maximumFrames, Output output, int firstFrame=0){
+		thread decoder(&TrackingPipeline::Decode, this, &video, maximumFrames, firstFrame);
+		thread modeller(&TrackingPipeline::Model, this);
+		thread detectorThread(&TrackingPipeline::Detect, this);
+
+		int framesCount=0;
+		while (true){
+			FramePacket *packet=detected.Pop();
+			if (packet->frame==-1){
+				freePackets.Push(packet);
+				break;
+			}
+			++framesCount;
+			output(*packet);
+			packet->detections.clear();
+			packet->snapshot=BackgroundSnapshot();
+			freePackets.Push(packet);
+		}
+
+		decoder.join();
+		modeller.join();
+		detectorThread.join();
+
+		return framesCount;
+	}
+};
+
+void WriteDetections(FILE *output, int frame, const vector<Rect> &detections){
+	for (int i=0;i<detections.size();++i){
+		const Rect &r=detections[i];
+		fprintf(output, "%d %d %d %d %d\n", frame, r.x, r.y, r.width, r.height);
+	}
+}
+
+//the hash of the video content, of the terrain mask given by the user and of every parameter the startup artifacts depend on
+uint64 GetStartupArtifactsKey(const char *videoPath, const Plane<uchar> &terrainMask, const TrackingParameters &parameters){
+	uint64 hash=HashValue(startupArtifactsVersion, 14695981039346656037ULL);
+	hash=HashValue(HashVideoContent(videoPath), hash);
+	hash=HashValue(terrainMask.Empty()==true ? (uint64)0 : HashPlane(terrainMask), hash);
+	hash=HashValue(parameters.skip, hash);
+	hash=HashValue(parameters.step, hash);
+	hash=HashValue(parameters.take, hash);
+	hash=HashValue(parameters.redLower, hash);
+	hash=HashValue(parameters.redUpper, hash);
+	hash=HashValue(parameters.greenLower, hash);
+	hash=HashValue(parameters.greenUpper, hash);
+	hash=HashValue(parameters.spreadFactor, hash);
+	hash=HashValue(parameters.previousSizeThreshold, hash);
+	hash=HashValue(parameters.backgroundSampling, hash);
+	hash=HashValue(parameters.automaticTerrain, hash);
+	return hash;
+}
+
+//the key of the startup artifacts and of every parameter the tracking after the startup depends on
+uint64 GetCheckpointKey(const char *videoPath, const Plane<uchar> &terrainMask, const TrackingParameters &parameters){
+	uint64 hash=GetStartupArtifactsKey(videoPath, terrainMask, parameters);
+	hash=HashBytes(parameters.backgroundEngine.c_str(), parameters.backgroundEngine.size(), hash);
+	hash=HashValue(parameters.n, hash);
+	hash=HashValue(parameters.learningRate, hash);
+	hash=HashValue(parameters.asynchronousBackground, hash);
+	hash=HashValue(parameters.thresholdFactor, hash);
+	hash=HashValue(parameters.cameraMovedThreshold, hash);
+	hash=HashValue(parameters.pixelChangedThreshold, hash);
+	hash=HashValue(parameters.cameraMovedStep, hash);
+	hash=HashValue(parameters.cameraMotionCompensation, hash);
+	hash=HashValue(parameters.maximumCameraTranslation, hash);
+	hash=HashValue(parameters.chromaticityBoundsCalculationStep, hash);
+	hash=HashValue(parameters.chromaticityForgetting, hash);
+	hash=HashValue(parameters.greenThreshold, hash);
+	hash=HashValue(parameters.redetectStep, hash);
+	hash=HashValue(parameters.componentDetection, hash);
+	hash=HashValue(parameters.minimumGroupSize, hash);
+	hash=HashValue(parameters.startFrame, hash);
+	return hash;
+}
+
+//the checkpoint file is this header followed by the state of HeadlessTracker
+const unsigned int checkpointMagic=0x4b435053;
+const int checkpointVersion=4;
+
+struct CheckpointHeader{
+	unsigned int magic;
+	int version;
+	uint64 key;
+	int rows;
+	int cols;
+	//the size of the detections file when the checkpoint was written
+	long long detectionsOffset;
+};
+
+//written to a temporary file which is then renamed, so the previous checkpoint stays valid until the new one is complete
+bool SaveCheckpoint(const char *path, uint64 key, long long detectionsOffset, HeadlessTracker &tracker){
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic=checkpointMagic;
+	header.version=checkpointVersion;
+	header.key=key;
+	header.rows=tracker.model.rows;
+	header.cols=tracker.model.cols;
+	header.detectionsOffset=detectionsOffset;
+
+	char temporaryPath[1100];
+	sprintf(temporaryPath, "%s.tmp", path);
+	FILE *output=fopen(temporaryPath, "wb");
+	if (output==NULL){
+		return false;
+	}
+	StateWriter writer(output);
+	writer.WriteValue(header);
+	bool written=tracker.Save(writer);
+	if (fclose(output)!=0){
+		written=false;
+	}
+	if (written==false){
+		remove(temporaryPath);
+		return false;
+	}
+
+	return RenameOverFile(temporaryPath, path);
+}
+
+//the file positioned after the header if the checkpoint was written for the same key and frame size, NULL otherwise
+FILE *OpenCheckpoint(const char *path, uint64 key, int rows, int cols, long long &detectionsOffset){
+	FILE *input=fopen(path, "rb");
+	if (input==NULL){
+		return NULL;
+	}
+	CheckpointHeader header;
+	if (fread(&header, sizeof(header), 1, input)!=1 || header.magic!=checkpointMagic || header.version!=checkpointVersion || header.key!=key || header.rows!=rows || header.cols!=cols){
+		fclose(input);
+		return NULL;
+	}
+	detectionsOffset=header.detectionsOffset;
+	return input;
+}
+
+//-1 if there is no checkpoint for the key at path, 0 if there is one but it could not be read, 1 if the tracker was initialized from it
+int LoadCheckpoint(const char *path, uint64 key, const Mat &firstImage, const Plane<uchar> &terrainMask, HeadlessTracker &tracker, long long &detectionsOffset){
+	FILE *input=OpenCheckpoint(path, key, firstImage.rows, firstImage.cols, detectionsOffset);
+	if (input==NULL){
+		return -1;
+	}
+	tracker.Initialize(firstImage, terrainMask, false);
+	StateReader reader(input);
+	bool loaded=tracker.Load(reader);
+	fclose(input);
+	return loaded==true ? 1 : 0;
+}
+
+//the index and the replay snapshots start with a CheckpointHeader with these
+const unsigned int replayMagic=0x504c5052;
+const int replayVersion=1;
+
+//snapshots of the published state of the tracker (see HeadlessTracker::SaveReplayState) written every few frames while the video is tracked,
+//each one in its own file, so the tracking can be restored at the nearest snapshot before any frame and only the frames after it have to be
+//tracked again; VideoCapture does not tell the byte offsets of the frames, so the snapshots are located by the frame and its time;
+//a snapshot is a few MB at 1080p since the frame ring of the background model is not in it, the model is refilled after a restore
+struct ReplayIndex{
+	struct Entry{
+		//the frames tracked before the snapshot, i.e. HeadlessTracker::framesCount
+		int framesCount;
+		//the position of the video after the snapshot in milliseconds
+		double msec;
+	};
+
+	string directory;
+	uint64 key;
+	int rows;
+	int cols;
+	//sorted by framesCount
+	vector<Entry> entries;
+
+	void Create(const char *directory, uint64 key, int rows, int cols){
+		this->directory=directory;
+		this->key=key;
+		this->rows=rows;
+		this->cols=cols;
+		entries.clear();
+	}
+
+	void GetIndexPath(char *path) const{
+		sprintf(path, "%s/%016llx.index", directory.c_str(), (unsigned long long)key);
+	}
+
+	void GetSnapshotPath(int framesCount, char *path) const{
+		sprintf(path, "%s/%016llx_%d.snapshot", directory.c_str(), (unsigned long long)key, framesCount);
+	}
+
+	//the index written for the same key, an empty one if there is none
+	bool Load(const char *directory, uint64 key, int rows, int cols){
+		Create(directory, key, rows, cols);
+		char path[1100];
+		GetIndexPath(path);
+		FILE *input=fopen(path, "rb");
+		if (input==NULL){
+			return false;
+		}
+		CheckpointHeader header;
+		StateReader reader(input);
+		reader.ReadValue(header);
+		if (header.magic!=replayMagic || header.version!=replayVersion || header.key!=key || header.rows!=rows || header.cols!=cols){
+			fclose(input);
+			return false;
+		}
+		reader.ReadVector(entries);
+		fclose(input);
+		if (reader.failed==true){
+			entries.clear();
+			return false;
+		}
+		return true;
+	}
+
+	void GetHeader(CheckpointHeader &header) const{
+		memset(&header, 0, sizeof(header));
+		header.magic=replayMagic;
+		header.version=replayVersion;
+		header.key=key;
+		header.rows=rows;
+		header.cols=cols;
+	}
+
+	bool Save() const{
+		CheckpointHeader header;
+		GetHeader(header);
+
+		char path[1100];
+		GetIndexPath(path);
+		char temporaryPath[1200];
+		sprintf(temporaryPath, "%s.tmp", path);
+		FILE *output=fopen(temporaryPath, "wb");
+		if (output==NULL){
+			return false;
+		}
+		StateWriter writer(output);
+		writer.WriteValue(header);
+		writer.WriteVector(entries);
+		bool written=writer.failed==false;
+		if (fclose(output)!=0){
+			written=false;
+		}
+		if (written==false){
+			remove(temporaryPath);
+			return false;
+		}
+		return RenameOverFile(temporaryPath, path);
+	}
+
+	//a snapshot of the same frame is replaced, the tracking is deterministic so it holds the same state
+	bool AddSnapshot(HeadlessTracker &tracker, double msec){
+		CheckpointHeader header;
+		GetHeader(header);
+		char path[1100];
+		GetSnapshotPath(tracker.framesCount, path);
+		FILE *output=fopen(path, "wb");
+		if (output==NULL){
+			return false;
+		}
+		StateWriter writer(output);
+		writer.WriteValue(header);
+		bool written=tracker.SaveReplayState(writer);
+		if (fclose(output)!=0){
+			written=false;
+		}
+		if (written==false){
+			remove(path);
+			return false;
+		}
+		Entry entry;
+		entry.framesCount=tracker.framesCount;
+		entry.msec=msec;
+		int k=0;
+		while (k<(int)entries.size() && entries[k].framesCount<entry.framesCount){
+			++k;
+		}
+		if (k<(int)entries.size() && entries[k].framesCount==entry.framesCount){
+			entries[k]=entry;
+		} else{
+			entries.insert(entries.begin()+k, entry);
+		}
+		return Save();
+	}
+
+	//the last snapshot taken at or before framesCount, -1 if there is none
+	int FindSnapshot(int framesCount) const{
+		int k=(int)entries.size()-1;
+		while (k>=0 && framesCount<entries[k].framesCount){
+			--k;
+		}
+		return k;
+	}
+
+	//restores the tracker at the nearest snapshot before framesCount, the frames up to framesCount are left to the caller,
+	//-1 if there is no snapshot to restore, 0 if it could not be read, 1 if the tracker was restored
+	int Restore(int framesCount, const Mat &firstImage, const Plane<uchar> &terrainMask, HeadlessTracker &tracker) const{
+		int k=FindSnapshot(framesCount);
+		if (k==-1){
+			return -1;
+		}
+		char path[1100];
+		GetSnapshotPath(entries[k].framesCount, path);
+		FILE *input=fopen(path, "rb");
+		if (input==NULL){
+			return 0;
+		}
+		CheckpointHeader header;
+		CheckpointHeader expected;
+		GetHeader(expected);
+		StateReader reader(input);
+		reader.ReadValue(header);
+		if (reader.failed==true || memcmp(&header, &expected, sizeof(header))!=0){
+			fclose(input);
+			return 0;
+		}
+		tracker.Initialize(firstImage, terrainMask, false);
+		bool loaded=tracker.LoadReplayState(reader);
+		fclose(input);
+		return loaded==true ? 1 : 0;
+	}
+};
 
-				//RULE
-				//check for trajectories connecting when the disposed group closest to the current newly found group was pushed out by the closest tracked group
-				if (closeDisposed.size()>0) {
-					//if (closeTracked[0].second->pushedOutGroups.find(closeDisposed[0].second)!=closeTracked[0].second->pushedOutGroups.end()){
-					if (closeTracked.size()>0 && closeDisposed[0].second->pushedOut == true && closeDisposed[0].second->pushedOutBy == closeTracked[0].second && (sizeShrinked == true || sizeShrinkedLately == true)) {
-						//if (closeDisposed[0].second->pushedOut==true && closeDisposed[0].second->pushedOutBy==closeTracked[0].second){
-						add = closeDisposed[0].second;
-						disposedGroups.erase(disposedGroups.find(add));
+int TrackHeadless(const char *videoPath, const TrackingParameters &parameters){
 
-						ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, closeTracked[0].second);
-					}
-				}
+	GetThreadPool().SetThreadsCount(parameters.threadsCount);
 
-				//RULE
-				//check for the closest disposed group that was not pushed out and that is significantly closer than other similar groups
-				//somewhat unstable and therefore currently disabled
-				if (add == newlyFoundGroups[i] && closeDisposed.size()>0) {
+	VideoBootstrap bootstrap;
+	if (bootstrap.Open(videoPath)==false){
+		printf("Could not read %s.\n", videoPath);
+		return 1;
+	}
+	const Mat &preImg=bootstrap.firstImage;
 
-					if (closeDisposed[0].second->pushedOut == false && (closeDisposed.size() == 1 || closeDisposed[0].first * 5 <= closeDisposed[1].first)) {
-						add = closeDisposed[0].second;
-						disposedGroups.erase(disposedGroups.find(add));
+	Plane<uchar> terrainMask;
+	if (parameters.terrainPath.empty()==false){
+		Mat img=imread(parameters.terrainPath.c_str(), 6);
+		if (img.rows!=preImg.rows || img.cols!=preImg.cols || img.channels()!=1){
+			printf("The terrain %s does not match the video.\n", parameters.terrainPath.c_str());
+			return 1;
+		}
+		terrainMask.Create(img.rows, img.cols);
+		for (int i=0;i<img.rows;++i){
+			for (int j=0;j<img.cols;++j){
+				terrainMask[i][j]=*(((uchar *)(img.data))+i*img.cols+j)!=0;
+			}
+		}
+	} else if (parameters.terrainPolygonPath.empty()==false){
+		vector<Point> polygon;
+		if (LoadTerrainPolygon(parameters.terrainPolygonPath.c_str(), polygon)==false){
+			printf("Could not read the terrain polygon %s.\n", parameters.terrainPolygonPath.c_str());
+			return 1;
+		}
+		RasterizeTerrainPolygon(polygon, preImg.rows, preImg.cols, terrainMask);
+	}
+
+	HeadlessTracker tracker(parameters);
+
+	//a resumed or replayed tracker gets its whole state from the checkpoint or the snapshot, so the startup is skipped
+	bool replaying=parameters.replayFrame>=0;
+	bool checkpoints=parameters.checkpointPath.empty()==false && replaying==false;
+	bool indexing=parameters.replayIndexPath.empty()==false && parameters.replayIndexStep>0 && replaying==false;
+	uint64 checkpointKey=0;
+	long long detectionsOffset=0;
+	bool resumed=false;
+	bool restored=false;
+	if (checkpoints==true || parameters.replayIndexPath.empty()==false){
+		checkpointKey=GetCheckpointKey(videoPath, terrainMask, parameters);
+	}
+	ReplayIndex replayIndex;
+	if (parameters.replayIndexPath.empty()==false){
+		replayIndex.Load(parameters.replayIndexPath.c_str(), checkpointKey, preImg.rows, preImg.cols);
+	}
+	if (replaying==true){
+		int result=replayIndex.Restore(parameters.replayFrame, preImg, terrainMask, tracker);
+		if (result==0){
+			printf("Could not read the snapshot before the frame %d from %s.\n", parameters.replayFrame, parameters.replayIndexPath.c_str());
+			return 1;
+		}
+		restored=result==1;
+		if (restored==false){
+			printf("There is no snapshot before the frame %d, tracking from the beginning.\n", parameters.replayFrame);
+		}
+	} else if (checkpoints==true && parameters.resume==true){
+		int result=LoadCheckpoint(parameters.checkpointPath.c_str(), checkpointKey, preImg, terrainMask, tracker, detectionsOffset);
+		if (result==0){
+			printf("Could not read the checkpoint %s.\n", parameters.checkpointPath.c_str());
+			return 1;
+		}
+		resumed=result==1;
+		restored=resumed;
+		if (resumed==true){
+			printf("Resuming %s after %d frames.\n", videoPath, tracker.framesCount);
+		} else{
+			printf("There is no checkpoint for %s in %s, starting from the beginning.\n", videoPath, parameters.checkpointPath.c_str());
+		}
+	}
+
+	//on a cache hit the terrain, the chromaticity bounds, the background and its bounding box are loaded and nothing is decoded but the first frame
+	uint64 artifactsKey=0;
+	char artifactsFile[1100];
+	StartupArtifacts artifacts;
+	bool cached=false;
+	if (restored==false && parameters.artifactsPath.empty()==false){
+		artifactsKey=GetStartupArtifactsKey(videoPath, terrainMask, parameters);
+		GetStartupArtifactsPath(parameters.artifactsPath.c_str(), artifactsKey, artifactsFile);
+		cached=LoadStartupArtifacts(artifactsFile, artifactsKey, preImg.rows, preImg.cols, artifacts);
+	}
+
+	if (cached==true){
+		tracker.model.redLower=artifacts.redLower;
+		tracker.model.redUpper=artifacts.redUpper;
+		tracker.model.greenLower=artifacts.greenLower;
+		tracker.model.greenUpper=artifacts.greenUpper;
+		tracker.Initialize(preImg, artifacts.terrainMask, false);
+		tracker.model.SetBackground(artifacts.background, artifacts.minRow, artifacts.maxRow, artifacts.minCol, artifacts.maxCol);
+	} else if (restored==false){
+		tracker.Initialize(preImg, terrainMask);
+
+		//the PNG cache of GetBackgroundSmartly is keyed only on the name of the video, so it is not used under the artifacts cache
+		bool backgroundsCache=parameters.backgroundsPath.empty()==false && parameters.artifactsPath.empty()==true;
+		Mat background;
+		if (parameters.backgroundCaptures>1 && backgroundsCache==false){
+			GetBackground2Parallel(videoPath, background, parameters.skip, parameters.step, parameters.take, tracker.model.redLower, tracker.model.redUpper, tracker.model.greenLower, tracker.model.greenUpper, parameters.previousSizeThreshold, false, parameters.backgroundCaptures);
+		} else if (backgroundsCache==true){
+			bootstrap.GetBackgroundSmartly(videoPath, background, parameters.skip, parameters.step, parameters.take, parameters.backgroundsPath.c_str(), true, tracker.model.redLower, tracker.model.redUpper, tracker.model.greenLower, tracker.model.greenUpper, parameters.previousSizeThreshold, parameters.backgroundSampling);
+		} else{
+			bootstrap.GetBackground(background, parameters.skip, parameters.step, parameters.take, tracker.model.redLower, tracker.model.redUpper, tracker.model.greenLower, tracker.model.greenUpper, parameters.previousSizeThreshold, false, parameters.backgroundSampling);
+		}
+		if (background.empty()==true){
+			printf("Could not build the background of %s.\n", videoPath);
+			return 1;
+		}
+		//the bounding box is found once and the same one is given to the model and written to the cache
+		int minRow, maxRow, minCol, maxCol;
+		GetBackgroundBounds(background, minRow, maxRow, minCol, maxCol);
+		tracker.model.SetBackground(background, minRow, maxRow, minCol, maxCol);
+
+		if (parameters.artifactsPath.empty()==false){
+			artifacts.background=background;
+			artifacts.terrainMask=tracker.model.terrainMask;
+			artifacts.redLower=tracker.model.redLower;
+			artifacts.redUpper=tracker.model.redUpper;
+			artifacts.greenLower=tracker.model.greenLower;
+			artifacts.greenUpper=tracker.model.greenUpper;
+			artifacts.minRow=minRow;
+			artifacts.maxRow=maxRow;
+			artifacts.minCol=minCol;
+			artifacts.maxCol=maxCol;
+			if (SaveStartupArtifacts(artifactsFile, artifactsKey, artifacts)==false){
+				printf("Could not write %s.\n", artifactsFile);
+			}
+		}
+	}
 
-						ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, nullptr);
-					}
-				}
+	//the detections written after the checkpoint are cut off, they are written again,
+	//a replay writes to its own file so the detections of the tracked video are kept
+	FILE *output=NULL;
+	const string &detectionsPath=replaying==true ? parameters.replayDetectionsPath : parameters.detectionsPath;
+	if (detectionsPath.empty()==false){
+		if (resumed==true){
+			output=fopen(detectionsPath.c_str(), "r+");
+			if (output!=NULL && (TruncateFile(output, detectionsOffset)==false || SeekFile(output, detectionsOffset, SEEK_SET)==false)){
+				fclose(output);
+				output=NULL;
+			}
+		} else{
+			output=fopen(detectionsPath.c_str(), "w");
+		}
+		if (output==NULL){
+			printf("Could not open %s for writing.\n", detectionsPath.c_str());
+			return 1;
+		}
+	}
 
-				if (add == newlyFoundGroups[i] && closeTracked.size()>0 && (closeTracked.size() == 1 || closeTracked[0].first * 3 <= closeTracked[1].first) && (closeTracked[0].second->pushedOutGroups.size()>0) && currentlyDisposedGroups.find(*(closeTracked[0].second->pushedOutGroups.begin())) == currentlyDisposedGroups.end() && framesCount - (*(closeTracked[0].second->pushedOutGroups.begin()))->lastFrame <= backFramesToCheckForClosePushedOut) {
-					add = *(closeTracked[0].second->pushedOutGroups.begin());
-					disposedGroups.erase(disposedGroups.find(add));
+	if (bootstrap.Rewind(videoPath, parameters.startFrame+tracker.framesCount)==false){
+		printf("Could not move %s to the frame %d.\n", videoPath, parameters.startFrame+tracker.framesCount);
+		return 1;
+	}
+	VideoCapture &video=bootstrap.video;
+	int startFrame=parameters.startFrame;
 
-					ReconnectGroups(add, newlyFoundGroups[i], img, framesCount, nullptr);
-				}
-				//
+	//the frames between the snapshot and the replayed frame are tracked again without any output,
+	//the tracking is then continued from there and maximumFrames counts from the replayed frame
+	int lastFrame=parameters.maximumFrames;
+	if (replaying==true){
+		int64 replayStart=getTickCount();
+		int replayedFramesCount=parameters.replayFrame-tracker.framesCount;
+		while (tracker.framesCount<parameters.replayFrame){
+			Mat img;
+			video>>img;
+			if (img.empty()){
+				printf("%s ends before the frame %d.\n", videoPath, parameters.replayFrame);
+				return 1;
+			}
+			++bootstrap.position;
+			tracker.ProcessFrame(img);
+		}
+		printf("Replayed %d frames up to the frame %d in %.2lf s.\n", replayedFramesCount, parameters.replayFrame, (getTickCount()-replayStart)/getTickFrequency());
+		if (lastFrame!=0){
+			lastFrame+=parameters.replayFrame;
+		}
+	}
+	int resumedFramesCount=tracker.framesCount;
+
+	//the video is tracked in parts ending at the checkpoints, the pipeline is empty between them so its state is the state of the tracker
+	TrackingPipeline *pipeline=parameters.pipelineDepth>0 ? new TrackingPipeline(tracker.model, tracker.detector, parameters.pipelineDepth) : NULL;
+	int64 start=getTickCount();
+	while (lastFrame==0 || tracker.framesCount<lastFrame){
+		//0 means until the end of the video
+		int frames=lastFrame==0 ? 0 : lastFrame-tracker.framesCount;
+		if (checkpoints==true && parameters.checkpointStep>0){
+			int untilCheckpoint=parameters.checkpointStep-tracker.framesCount%parameters.checkpointStep;
+			if (frames==0 || untilCheckpoint<frames){
+				frames=untilCheckpoint;
+			}
+		}
+		if (indexing==true){
+			int untilSnapshot=parameters.replayIndexStep-tracker.framesCount%parameters.replayIndexStep;
+			if (frames==0 || untilSnapshot<frames){
+				frames=untilSnapshot;
+			}
+		}
 
-				//AFTER ALL RULES
-				//adding the new (or old) group to the list of new tracked groups
-				if (add != nullptr) {
-					newTrackedGroups.push_back(add);
+		int processed=0;
+		if (pipeline!=NULL){
+			processed=pipeline->Run(video, frames, [output, startFrame](const FramePacket &packet){
+				if (packet.detected==true && output!=NULL){
+					WriteDetections(output, startFrame+packet.frame, packet.detections);
+				}
+			}, tracker.framesCount);
+			tracker.framesCount+=processed;
+		} else{
+			while (frames==0 || processed<frames){
+				Mat img;
+				video>>img;
+				if (img.empty()){
+					break;
+				}
+				++processed;
+				if (tracker.ProcessFrame(img)==true && output!=NULL){
+					WriteDetections(output, startFrame+tracker.framesCount, tracker.detector.detections);
 				}
+			}
+		}
 
+		if (checkpoints==true && parameters.checkpointStep>0 && processed>0 && tracker.framesCount%parameters.checkpointStep==0){
+			long long offset=0;
+			if (output!=NULL){
+				fflush(output);
+				offset=TellFile(output);
 			}
+			if (SaveCheckpoint(parameters.checkpointPath.c_str(), checkpointKey, offset, tracker)==false){
+				printf("Could not write the checkpoint %s.\n", parameters.checkpointPath.c_str());
+			}
+		}
+		if (indexing==true && processed>0 && tracker.framesCount%parameters.replayIndexStep==0){
+			if (replayIndex.AddSnapshot(tracker, video.get(CAP_PROP_POS_MSEC))==false){
+				printf("Could not write the snapshot of the frame %d to %s.\n", tracker.framesCount, parameters.replayIndexPath.c_str());
+			}
+		}
 
+		if (frames==0 || processed<frames){
+			break;
 		}
-		*/
+	}
+	double seconds=(getTickCount()-start)/getTickFrequency();
+	delete pipeline;
 
-		/*trackedGroups = newTrackedGroups;
-		
-		if (maximumGroupsCount<trackedGroups.size()) {
-			sort(trackedGroups.begin(), trackedGroups.end(), [](const TrackingData *d1, const TrackingData *d2) {return d1->positions.size()*d1->previous.size()>d2->positions.size()*d2->previous.size(); });
-			trackedGroups.resize(maximumGroupsCount);
+	if (output!=NULL){
+		fclose(output);
+	}
+
+	int framesCount=tracker.framesCount-resumedFramesCount;
+	printf("Processed %d frames in %.2lf s (%.2lf frames per second).\n", framesCount, seconds, seconds>0 ? framesCount/seconds : 0.0);
+
+	return 0;
+}
+
+//the self tests compare the kernels with straightforward implementations on random inputs, they print the first difference found
+
+//the pixel (j, i) is inside if it lies between the crossings 2k and 2k+1 of the row i with the edges, sorted by their columns,
+//where every edge covers the rows from its upper end up to but without its lower end; no edge table, every edge is checked
+static bool InsideRasterizedPolygon(const vector<Point> &polygon, int i, int j){
+	vector<pair<long long, long long> > xs;
+	int n=polygon.size();
+	for (int k=0;k<n;++k){
+		Point p=polygon[k];
+		Point q=polygon[(k+1)%n];
+		if (q.y<p.y){
+			swap(p, q);
+		}
+		if (p.y<=i && i<q.y){
+			xs.push_back(make_pair((long long)p.x*(q.y-p.y)+(long long)(i-p.y)*(q.x-p.x), (long long)(q.y-p.y)));
 		}
+	}
+	sort(xs.begin(), xs.end(), [](const pair<long long, long long> &a, const pair<long long, long long> &b){
+		return a.first*b.second<b.first*a.second;
+	});
+	for (int k=0;k+1<xs.size();k+=2){
+		if (xs[k].first<=j*xs[k].second && j*xs[k+1].second<=xs[k+1].first){
+			return true;
+		}
+	}
+	return false;
+}
 
-		for (auto si = currentlyDisposedGroups.cbegin(); si != currentlyDisposedGroups.cend(); ++si) {
-			disposedGroups.insert(*si);
+//random polygons, also self-crossing ones and ones reaching outside of the mask
+bool TestSpanMaskFromPolygon(int polygonsCount=3000){
+	mt19937 random(21);
+	for (int t=0;t<polygonsCount;++t){
+		int rows=1+random()%48;
+		int cols=1+random()%48;
+		vector<Point> polygon(3+random()%10);
+		for (int k=0;k<polygon.size();++k){
+			polygon[k]=Point((int)(random()%(cols+20))-10, (int)(random()%(rows+20))-10);
+		}
+		SpanMask spans;
+		spans.FromPolygon(polygon, rows, cols);
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				if (spans.Contains(i, j)!=InsideRasterizedPolygon(polygon, i, j)){
+					printf("SpanMask::FromPolygon differs from the reference in the polygon %d at (%d, %d).\n", t, j, i);
+					return false;
+				}
+			}
 		}
+	}
+	return true;
+}
 
-		vector<BoundingBox> boundingBoxes;
-		for (int gi = 0; gi<trackedGroups.size(); ++gi) {
-			BoundingBox boundingBox = GetBoundingBox(trackedGroups[gi]->positions);
-			boundingBox.frame = framesCount;
-			boundingBox.type = BoundingBoxType::NORMAL;
-			boundingBox.meanColor = trackedGroups[gi]->meanColor;
-			trackedGroups[gi]->previous.push_back(boundingBox);
-			trackedGroups[gi]->lastFrame = framesCount;
-			boundingBoxes.push_back(boundingBox);
+//random 0/1 rows packed by SetRow, counted by CountRow and moved by Translate, compared with the bytes they were packed from
+bool TestBitPlane(int planesCount=500){
+	mt19937 random(11);
+	for (int t=0;t<planesCount;++t){
+		int rows=1+random()%20;
+		int cols=1+random()%300;
+		//a sparse, a dense or a half-filled plane
+		int density=random()%3;
+		vector<uchar> values((size_t)rows*cols);
+		for (size_t k=0;k<values.size();++k){
+			int r=random()%8;
+			values[k]=density==0 ? r==0 : (density==1 ? r!=0 : r%2)*(1+random()%255);
+		}
+		BitPlane plane;
+		plane.Create(rows, cols);
+		for (int i=0;i<rows;++i){
+			plane.SetRow(i, values.data()+(size_t)i*cols);
+		}
+		for (int i=0;i<rows;++i){
+			int count=0;
+			for (int j=0;j<cols;++j){
+				bool set=values[(size_t)i*cols+j]!=0;
+				count+=set;
+				if (plane.Get(i, j)!=set){
+					printf("BitPlane::SetRow differs from the bytes in the plane %d at (%d, %d).\n", t, j, i);
+					return false;
+				}
+			}
+			if (plane.CountRow(i)!=count){
+				printf("BitPlane::CountRow counts %d bits instead of %d in the plane %d at the row %d.\n", plane.CountRow(i), count, t, i);
+				return false;
+			}
+		}
+		int dx=(int)(random()%(2*cols+1))-cols;
+		int dy=(int)(random()%(2*rows+1))-rows;
+		plane.Translate(dx, dy);
+		for (int i=0;i<rows;++i){
+			int count=0;
+			for (int j=0;j<cols;++j){
+				int si=i-dy;
+				int sj=j-dx;
+				bool set=0<=si && si<rows && 0<=sj && sj<cols && values[(size_t)si*cols+sj]!=0;
+				count+=set;
+				if (plane.Get(i, j)!=set){
+					printf("BitPlane::Translate differs from the moved bytes in the plane %d at (%d, %d).\n", t, j, i);
+					return false;
+				}
+			}
+			if (plane.CountRow(i)!=count){
+				printf("BitPlane::Translate leaves bits after the last column in the plane %d at the row %d.\n", t, i);
+				return false;
+			}
 		}
+	}
+	return true;
+}
 
-		for (auto si = currentlyDisposedGroups.cbegin(); si != currentlyDisposedGroups.cend(); ++si) {
-			TrackingData *currentlyDisposedGroup = *si;
-			if (currentlyDisposedGroup->pushedOut == true) {
-				if (currentlyDisposedGroup->previous.size()>0) {
-					currentlyDisposedGroup->previous[currentlyDisposedGroup->previous.size() - 1].type |= BoundingBoxType::PUSHED_OUT;
-					if (currentlyDisposedGroup->pushedOutBy != nullptr && currentlyDisposedGroup->pushedOutBy->previous.size()>0) {
-						currentlyDisposedGroup->pushedOutBy->previous[currentlyDisposedGroup->pushedOutBy->previous.size() - 1].type |= BoundingBoxType::PUSHER;
+//random flags and bounds, the components are compared with the ones found by a breadth-first search from their first pixels in raster order
+bool TestComponentLabeler(int planesCount=300){
+	mt19937 random(8);
+	ComponentLabeler labeler;
+	Plane<int> labels;
+	for (int t=0;t<planesCount;++t){
+		int rows=1+random()%120;
+		int cols=1+random()%120;
+		int density=1+random()%7;
+		Plane<uchar> flag(rows, cols);
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				flag[i][j]=random()%8<density;
+			}
+		}
+		int minRow=-1;
+		int maxRow=-1;
+		int minCol=-1;
+		int maxCol=-1;
+		if (random()%2==0){
+			minRow=random()%rows;
+			maxRow=minRow+random()%(rows-minRow);
+			minCol=random()%cols;
+			maxCol=minCol+random()%(cols-minCol);
+		}
+		int firstRow=minRow==-1 ? 0 : minRow;
+		int lastRow=maxRow==-1 ? rows-1 : maxRow;
+		int firstCol=minCol==-1 ? 0 : minCol;
+		int lastCol=maxCol==-1 ? cols-1 : maxCol;
+
+		int componentsCount=labeler.Label(flag, labels, minRow, maxRow, minCol, maxCol);
+
+		Plane<int> expected(rows, cols, true);
+		vector<ComponentStats> components;
+		vector<int> queue;
+		for (int i=firstRow;i<=lastRow;++i){
+			for (int j=firstCol;j<=lastCol;++j){
+				if (flag[i][j]!=1 || expected[i][j]!=0){
+					continue;
+				}
+				ComponentStats component;
+				component.label=components.size()+1;
+				expected[i][j]=component.label;
+				queue.assign(1, i*cols+j);
+				for (int k=0;k<queue.size();++k){
+					int r=queue[k]/cols;
+					int c=queue[k]%cols;
+					component.Add(r, c, r==0 || c==0 || r==rows-1 || c==cols-1);
+					const int dr[]={-1, 1, 0, 0};
+					const int dc[]={0, 0, -1, 1};
+					for (int d=0;d<4;++d){
+						int nr=r+dr[d];
+						int nc=c+dc[d];
+						if (firstRow<=nr && nr<=lastRow && firstCol<=nc && nc<=lastCol && flag[nr][nc]==1 && expected[nr][nc]==0){
+							expected[nr][nc]=component.label;
+							queue.push_back(nr*cols+nc);
+						}
 					}
 				}
+				components.push_back(component);
 			}
 		}
-		*/
-
-		img.copyTo(previous);
-		//Mat img2;
-		//img.copyTo(img2);
-		img.copyTo(img);
 
-		//DrawTrajectories(img2, trackedGroups, trajectoryDrawingLength);
-		//DrawRectangles(img2, boundingBoxes);
+		if (componentsCount!=components.size()){
+			printf("ComponentLabeler finds %d components instead of %d in the plane %d.\n", componentsCount, (int)components.size(), t);
+			return false;
+		}
+		for (int i=0;i<rows;++i){
+			for (int j=0;j<cols;++j){
+				if (labels[i][j]!=expected[i][j]){
+					printf("ComponentLabeler differs from the reference in the plane %d at (%d, %d).\n", t, j, i);
+					return false;
+				}
+			}
+		}
+		for (int k=0;k<componentsCount;++k){
+			const ComponentStats &a=labeler.components[k];
+			const ComponentStats &b=components[k];
+			if (a.label!=b.label || a.area!=b.area || a.minRow!=b.minRow || a.maxRow!=b.maxRow || a.minCol!=b.minCol || a.maxCol!=b.maxCol ||
+				a.rowSum!=b.rowSum || a.colSum!=b.colSum || a.touchesBorder!=b.touchesBorder){
+				printf("ComponentLabeler differs from the reference in the stats of the component %d of the plane %d.\n", k+1, t);
+				return false;
+			}
+		}
+	}
+	return true;
+}
 
-		resize(img, img, Size(img.cols / f, img.rows / f));
-		//resize(img2, img2, Size(img2.cols / f, img2.rows / f));
+//one thread pushes numbers through a small queue to another, both pause now and then, so each of them sleeps in Push or Pop
+//sometimes; the numbers have to arrive once and in order, and a lost wake-up hangs the test
+bool TestSpscQueue(int itemsCount=200000){
+	SpscQueue<int> queue(2);
+	thread producer([&queue, itemsCount]{
+		mt19937 random(6);
+		for (int k=0;k<itemsCount;++k){
+			if (random()%5000==0){
+				this_thread::sleep_for(chrono::microseconds(200));
+			}
+			queue.Push(k);
+		}
+	});
+	mt19937 random(7);
+	bool passed=true;
+	for (int k=0;k<itemsCount;++k){
+		if (random()%5000==0){
+			this_thread::sleep_for(chrono::microseconds(200));
+		}
+		int item=queue.Pop();
+		if (item!=k && passed==true){
+			printf("SpscQueue returns %d instead of %d.\n", item, k);
+			passed=false;
+		}
+	}
+	producer.join();
+	return passed;
+}
 
-		/*char framesCountText[17];
-		sprintf(framesCountText, "%d", framesCount);
-		putText(img2, framesCountText, Point(125, 50), CV_FONT_HERSHEY_PLAIN, 4, Scalar(0, 0, 255));*/
+//the union-find before the epochs and path halving, cleared element by element and linked by Find recursively
+struct BaselineUnionFind{
+	vector<int> parent;
+	vector<int> size;
+	vector<int> sum;
 
-		Mat displayBackground;
-		resize(background, displayBackground, Size(background.cols / f, background.rows / f));
-		
-		keyPressed = waitKey(1);
-		if (keyPressed == 'd' || keyPressed == 'D') {
-			//while (1) {				
-				img.copyTo(terrainSelectionImg);
-				drawContours(terrainSelectionImg, contours, -1, Scalar(0, 255, 255));
-				teamSelection.clear();
-				SelectTeam();
+	BaselineUnionFind(int n=0):parent(n), size(n), sum(n){
+		Clear();
+	}
 
-				if (!analyse(img, contours)) printf("problem");
-				printf("%d\n", histData[0].id);
-				printf("%d\n", histData[1].id);
-				Mat z = Mat::zeros(50, 50, CV_8UC3);
-				for (int i = 0; i < myTracking.size(); ++i) {
-					printf("%d\n", myTracking[i].team);
-					imshow("testing_r", z);
-					imshow("testing_r", myTracking[i].rect);
-					waitKey();
-				}
+	void Add(int x, int value=0){
+		parent[x]=x;
+		size[x]=1;
+		sum[x]=value;
+	}
 
-				for (int i = 0; i < myTracking.size(); ++i) {
-					if (myTracking[i].team == 0 || myTracking[i].team == 1) polylines(img, myTracking[i].contourPoints, true, Scalar(0, 0, 255), 1, 8);
-					else polylines(img, myTracking[i].contourPoints, true, Scalar(255, 0, 0), 1, 8);
-				}
-				imshow("i", img);
-				keyPressed = waitKey();
-				//if (keyPressed == 13) break;
-			//}			
+	int Find(int x){
+		if (parent[x]!=x){
+			parent[x]=Find(parent[x]);
 		}
-		else drawContours(img, contours, -1, Scalar(0, 255, 255));
-
-		imshow("i", img);
-		imshow("b", displayBackground);
-		//imshow("i2", img2);
-
-		
+		return parent[x];
+	}
 
-		img.release();
-		//foreground.release();
-		//img2.release();
-		if (framesCount == 300) {
-			//break;
+	void Union(int x, int y, bool sizePriority=false){
+		int px=Find(x);
+		int py=Find(y);
+		if (px!=py){
+			if ((sizePriority && size[px]<size[py]) || px<py){
+				parent[px]=py;
+				size[py]+=size[px];
+				sum[py]+=sum[px];
+			} else{
+				parent[py]=px;
+				size[px]+=size[py];
+				sum[px]+=sum[py];
+			}
 		}
 	}
 
+	void Clear(){
+		for (int i=0;i<parent.size();++i){
+			parent[i]=i;
+			size[i]=0;
+			sum[i]=0;
+		}
+	}
+};
 
-	delete bf;
+//random additions, unions and clears, after every operation both structures must hold the same sets with the same sizes and sums
+bool TestUnionFind(int runsCount=300){
+	mt19937 random(25);
+	for (int t=0;t<runsCount;++t){
+		int n=1+random()%200;
+		UnionFind uf(n);
+		BaselineUnionFind baseline(n);
+		vector<bool> added(n, false);
+		vector<int> addedElements;
+		for (int operation=0;operation<1000;++operation){
+			int kind=random()%100;
+			if (kind==0){
+				uf.Clear();
+				baseline.Clear();
+				added.assign(n, false);
+				addedElements.clear();
+			} else if (kind<40 || addedElements.empty()){
+				int x=random()%n;
+				if (added[x]==false){
+					int value=random()%1000;
+					uf.Add(x, value);
+					baseline.Add(x, value);
+					added[x]=true;
+					addedElements.push_back(x);
+				}
+			} else{
+				int x=addedElements[random()%addedElements.size()];
+				int y=addedElements[random()%addedElements.size()];
+				uf.Union(x, y);
+				baseline.Union(x, y, random()%2==0);
+			}
 
-	FreeIntMatrix(backgroundFlag, rows);
-	FreeIntMatrix(foregroundFlag, rows);
-	//FreeIntMatrix(visited, rows);
-	FreeIntMatrix(flag, rows);
-	FreeIntMatrix(suddenlyChanged, rows);
-	FreeIntMatrix(spreadData, rows);
-	FreeIntMatrix(terrainMask, rows);
-	FreeIntMatrix(currentBackgroundFlag, rows);
+			//two elements are in the same set in one structure exactly when they are in the other
+			vector<int> first(n, -1);
+			vector<int> baselineFirst(n, -1);
+			for (int x=0;x<n;++x){
+				int root=uf.Find(x);
+				int baselineRoot=baseline.Find(x);
+				if (added[x]==false){
+					if (uf.Contains(x)==true || root!=x || baselineRoot!=x || baseline.size[x]!=0){
+						printf("UnionFind holds the element %d that was not added in the run %d.\n", x, t);
+						return false;
+					}
+					continue;
+				}
+				if (first[root]==-1){
+					first[root]=x;
+				}
+				if (baselineFirst[baselineRoot]==-1){
+					baselineFirst[baselineRoot]=x;
+				}
+				if (first[root]!=baselineFirst[baselineRoot] || uf.size[root]!=baseline.size[baselineRoot] || uf.sum[root]!=baseline.sum[baselineRoot]){
+					printf("UnionFind differs from the baseline at the element %d after the operation %d of the run %d.\n", x, operation, t);
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
 
-	//FreeTrackingDataPointerMatrix(owners, rows);
+int RunSelfTests(){
+	struct SelfTest{
+		const char *name;
+		bool (*run)();
+	};
+	SelfTest tests[]={
+		{"SpanMask::FromPolygon", []{ return TestSpanMaskFromPolygon(); }},
+		{"UnionFind", []{ return TestUnionFind(); }},
+		{"BitPlane", []{ return TestBitPlane(); }},
+		{"ComponentLabeler", []{ return TestComponentLabeler(); }},
+		{"SpscQueue", []{ return TestSpscQueue(); }}
+	};
+	int failed=0;
+	for (int k=0;k<sizeof(tests)/sizeof(tests[0]);++k){
+		bool passed=tests[k].run();
+		printf("%s: %s\n", tests[k].name, passed==true ? "passed" : "FAILED");
+		failed+=passed==false;
+	}
+	return failed==0 ? 0 : 1;
 }
 
+//without arguments the interactive Test97 is run, mainNB --test runs the self tests, otherwise the video is processed headlessly:
+//mainNB <video> [parameters file]
 int main(int argc, char **argv){
 	
+	if (argc>1 && strcmp(argv[1], "--test")==0){
+		return RunSelfTests();
+	}
+	if (argc>1){
+		TrackingParameters parameters;
+		if (argc>2 && LoadTrackingParameters(argv[2], parameters)==false){
+			printf("Could not read the parameters from %s.\n", argv[2]);
+			return 1;
+		}
+		return TrackHeadless(argv[1], parameters);
+	}
+
 	Test97();
 	
 	return 0;